@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include "branch.h"
+#include "optimize.h"
+
+#define THREAD_MAX_HOPS 8 // Bounds threading through chains of b, which may loop
+
+static Opcode inverted_branch(Opcode opcode)
+{
+	switch (opcode)
+	{
+	case OPCODE_BZ:
+		return OPCODE_BNZ;
+	case OPCODE_BNZ:
+		return OPCODE_BZ;
+	case OPCODE_BC:
+		return OPCODE_BNC;
+	default:
+		return OPCODE_BC;
+	}
+}
+
+// The label a branch to label can go to instead: the first of the labels at its position, or where the b
+// that follows them goes
+static int threaded_label(InstructionVector *iv, int *labels, int label)
+{
+	for (int hop = 0; hop < THREAD_MAX_HOPS; hop++)
+	{
+		int position = labels[label];
+		if (position == -1)
+			return label;
+		while (position > 0 && iv->data[position - 1].opcode == OPCODE_LABEL)
+			position--;
+		label = iv->data[position].immediate;
+		while (position < iv->length && iv->data[position].opcode == OPCODE_LABEL)
+			position++;
+		if (position == iv->length || iv->data[position].opcode != OPCODE_B)
+			return label;
+		label = iv->data[position].immediate;
+	}
+	return label;
+}
+
+// Whether only labels lie between position and label, so execution falls through to it
+static bool falls_through_to(InstructionVector *iv, int *labels, int position, int label)
+{
+	int target = labels[label];
+	if (target <= position)
+		return false;
+	for (int i = position + 1; i < target; i++)
+	{
+		if (iv->data[i].opcode != OPCODE_LABEL)
+			return false;
+	}
+	return true;
+}
+
+static int optimize_branches_once(InstructionVector *iv)
+{
+	int label_count;
+	int *labels = label_positions(iv, &label_count);
+	bool *removed = calloc(iv->length + 1, sizeof(bool));
+	int changes = 0;
+	for (int i = 0; i < iv->length; i++)
+	{
+		Instruction *instruction = &iv->data[i];
+		if (removed[i])
+			continue;
+		if (instruction_ends_flow(instruction))
+		{
+			for (int j = i + 1; j < iv->length && iv->data[j].opcode != OPCODE_LABEL; j++)
+			{
+				removed[j] = true;
+				changes++;
+			}
+		}
+		if (!instruction_is_branch(instruction))
+			continue;
+
+		int label = threaded_label(iv, labels, instruction->immediate);
+		if (label != instruction->immediate)
+		{
+			instruction->immediate = label;
+			changes++;
+		}
+		if (falls_through_to(iv, labels, i, label))
+		{
+			removed[i] = true;
+			changes++;
+			continue;
+		}
+		Instruction *next = i + 1 < iv->length ? &iv->data[i + 1] : NULL;
+		if (instruction->opcode != OPCODE_B && next && next->opcode == OPCODE_B && !removed[i + 1] &&
+			falls_through_to(iv, labels, i + 1, label))
+		{
+			instruction->opcode = inverted_branch(instruction->opcode);
+			instruction->immediate = next->immediate;
+			removed[i + 1] = true;
+			changes++;
+		}
+	}
+
+	// Labels are only kept while a remaining branch goes to them
+	bool *used = calloc(label_count + 1, sizeof(bool));
+	for (int i = 0; i < iv->length; i++)
+	{
+		if (!removed[i] && instruction_is_branch(&iv->data[i]))
+			used[iv->data[i].immediate] = true;
+	}
+	int length = 0;
+	for (int i = 0; i < iv->length; i++)
+	{
+		Instruction *instruction = &iv->data[i];
+		if (!removed[i] && instruction->opcode == OPCODE_LABEL && !used[instruction->immediate])
+		{
+			removed[i] = true;
+			changes++;
+		}
+		if (!removed[i])
+			iv->data[length++] = *instruction;
+	}
+	iv->length = length;
+	free(used);
+	free(removed);
+	free(labels);
+	return changes;
+}
+
+int optimize_branches(InstructionVector *iv)
+{
+	int changes = 0;
+	int round;
+	while ((round = optimize_branches_once(iv)) != 0)
+		changes += round;
+	return changes;
+}
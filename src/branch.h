@@ -0,0 +1,15 @@
+#ifndef BRANCH_H
+#define BRANCH_H
+#include "emit.h"
+
+// Cleans up the branches the statement compilers leave behind, repeated until nothing changes:
+// - A branch to a label that is followed by a b goes straight to where the b goes, and labels next to
+//   each other are replaced by the first of them.
+// - A branch to the label right after it is removed.
+// - A conditional branch over a b becomes the opposite branch to where the b goes.
+// - Code after a b, return or other end of flow is removed up to the next label.
+// - Labels no branch goes to are removed, which lets the passes after it see across them.
+// Returns the number of changes.
+int optimize_branches(InstructionVector *iv);
+
+#endif // !BRANCH_H
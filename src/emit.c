@@ -0,0 +1,417 @@
+#include <stdlib.h>
+#include <string.h>
+#include "emit.h"
+
+InstructionVector *g_emit_target;
+static int g_label_count;
+
+void instruction_vector_init(InstructionVector *iv, int capacity)
+{
+	iv->length = 0;
+	iv->capacity = capacity;
+	iv->data = malloc(sizeof(Instruction) * capacity);
+}
+
+void instruction_vector_push(InstructionVector *iv, Instruction *instruction)
+{
+	if (iv->length == iv->capacity)
+	{
+		Instruction *new_array = malloc(sizeof(Instruction) * (iv->capacity * 2 + 1));
+		memcpy(new_array, iv->data, sizeof(Instruction) * iv->length);
+		free(iv->data);
+		iv->data = new_array;
+		iv->capacity = iv->capacity * 2 + 1;
+	}
+	iv->data[iv->length] = *instruction;
+	iv->length++;
+}
+
+void instruction_vector_free(InstructionVector *iv)
+{
+	free(iv->data);
+	iv->data = NULL;
+	iv->length = 0;
+	iv->capacity = 0;
+}
+
+static void print_register(int reg)
+{
+	if (reg == REGISTER_SP)
+	{
+		printf("sp");
+		return;
+	}
+	printf("r%d", reg);
+}
+
+static void print_operands(Instruction *instruction)
+{
+	printf(" ");
+	print_register(instruction->dst);
+	printf(", ");
+	print_register(instruction->src);
+	printf("\n");
+}
+
+void instruction_print(Instruction *instruction)
+{
+	switch (instruction->opcode)
+	{
+	case OPCODE_MOV:
+		printf("mov");
+		print_operands(instruction);
+		break;
+	case OPCODE_MOVI:
+		printf("movi #%d\n", instruction->immediate);
+		break;
+	case OPCODE_MHI:
+		if (instruction->symbol)
+			printf("mhi HI(%s)\n", instruction->symbol);
+		else
+			printf("mhi HI(#%d)\n", instruction->immediate);
+		break;
+	case OPCODE_ORI:
+		if (instruction->symbol)
+			printf("ori LO(%s)\n", instruction->symbol);
+		else
+			printf("ori LO(#%d)\n", instruction->immediate);
+		break;
+	case OPCODE_ADDI:
+		printf("addi #%d\n", instruction->immediate);
+		break;
+	case OPCODE_ADD:
+		printf("add");
+		print_operands(instruction);
+		break;
+	case OPCODE_SUB:
+		printf("sub");
+		print_operands(instruction);
+		break;
+	case OPCODE_ADC:
+		printf("adc");
+		print_operands(instruction);
+		break;
+	case OPCODE_SBC:
+		printf("sbc");
+		print_operands(instruction);
+		break;
+	case OPCODE_LDR:
+		printf("ldr");
+		print_operands(instruction);
+		break;
+	case OPCODE_STR:
+		printf("str");
+		print_operands(instruction);
+		break;
+	case OPCODE_PUSH:
+		printf("push ");
+		print_register(instruction->src);
+		printf("\n");
+		break;
+	case OPCODE_POP:
+		printf("pop ");
+		print_register(instruction->dst);
+		printf("\n");
+		break;
+	case OPCODE_CALL:
+		printf("call ");
+		print_register(instruction->src);
+		printf("\n");
+		break;
+	case OPCODE_RET:
+		puts("ret");
+		break;
+	case OPCODE_JMP:
+		printf("jmp ");
+		print_register(instruction->src);
+		printf("\n");
+		break;
+	case OPCODE_B:
+		printf("b .L%d\n", instruction->immediate);
+		break;
+	case OPCODE_BZ:
+	case OPCODE_BNZ:
+		printf(instruction->opcode == OPCODE_BZ ? "bz " : "bnz ");
+		print_register(instruction->src);
+		printf(", .L%d\n", instruction->immediate);
+		break;
+	case OPCODE_BC:
+		printf("bc .L%d\n", instruction->immediate);
+		break;
+	case OPCODE_BNC:
+		printf("bnc .L%d\n", instruction->immediate);
+		break;
+	case OPCODE_LABEL:
+		printf(".L%d:\n", instruction->immediate);
+		break;
+	case OPCODE_HALT:
+		puts("halt");
+		break;
+	case OPCODE_FRAME_ADDR:
+		// Pseudo instructions should have been lowered before printing
+		printf("frame_addr #%d, #%d\n", instruction->immediate, instruction->offset);
+		break;
+	case OPCODE_FRAME_CLEAR:
+		printf("frame_clear #%d, #%d, #%d\n", instruction->immediate, instruction->offset, instruction->count);
+		break;
+	case OPCODE_ARG_ADDR:
+		printf("arg_addr #%d\n", instruction->immediate);
+		break;
+	case OPCODE_RETURN:
+		puts("return");
+		break;
+	case OPCODE_TAIL_CALL:
+		printf("tail_call %s\n", instruction->symbol);
+		break;
+	default:
+		break;
+	}
+}
+
+void instruction_vector_print(InstructionVector *iv)
+{
+	for (int i = 0; i < iv->length; i++)
+	{
+		instruction_print(&iv->data[i]);
+	}
+}
+
+bool instruction_writes_register(Instruction *instruction, int reg)
+{
+	switch (instruction->opcode)
+	{
+	case OPCODE_MOVI:
+	case OPCODE_MHI:
+	case OPCODE_ORI:
+	case OPCODE_ADDI:
+	case OPCODE_FRAME_ADDR:
+	case OPCODE_ARG_ADDR:
+		return reg == 0;
+	case OPCODE_MOV:
+	case OPCODE_ADD:
+	case OPCODE_SUB:
+	case OPCODE_ADC:
+	case OPCODE_SBC:
+	case OPCODE_LDR:
+	case OPCODE_POP:
+		return reg == instruction->dst;
+	case OPCODE_PUSH:
+		return reg == REGISTER_SP;
+	case OPCODE_CALL:
+	case OPCODE_FRAME_CLEAR:
+		// Everything the calling convention doesn't preserve, a frame_clear may become a loop using them
+		return reg < REGISTER_FIRST_ARGUMENT + REGISTER_ARGUMENT_COUNT;
+	case OPCODE_RETURN:
+	case OPCODE_TAIL_CALL:
+		return reg == 0 || reg == REGISTER_SP;
+	default:
+		return false;
+	}
+}
+
+bool instruction_is_branch(Instruction *instruction)
+{
+	switch (instruction->opcode)
+	{
+	case OPCODE_B:
+	case OPCODE_BZ:
+	case OPCODE_BNZ:
+	case OPCODE_BC:
+	case OPCODE_BNC:
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool instruction_ends_flow(Instruction *instruction)
+{
+	switch (instruction->opcode)
+	{
+	case OPCODE_B:
+	case OPCODE_JMP:
+	case OPCODE_RET:
+	case OPCODE_HALT:
+	case OPCODE_RETURN:
+	case OPCODE_TAIL_CALL:
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool instruction_names_frame_object(Instruction *instruction)
+{
+	return instruction->opcode == OPCODE_FRAME_ADDR || instruction->opcode == OPCODE_FRAME_CLEAR;
+}
+
+static void emit(Opcode opcode, int dst, int src, int immediate)
+{
+	Instruction instruction = {0};
+	instruction.opcode = opcode;
+	instruction.dst = dst;
+	instruction.src = src;
+	instruction.immediate = immediate;
+	instruction_vector_push(g_emit_target, &instruction);
+}
+
+void emit_mov(int dst, int src)
+{
+	emit(OPCODE_MOV, dst, src, 0);
+}
+
+void emit_movi(int immediate)
+{
+	emit(OPCODE_MOVI, 0, 0, immediate);
+}
+
+void emit_mhi(int immediate)
+{
+	emit(OPCODE_MHI, 0, 0, immediate);
+}
+
+void emit_ori(int immediate)
+{
+	emit(OPCODE_ORI, 0, 0, immediate);
+}
+
+void emit_mhi_symbol(const char *symbol)
+{
+	emit(OPCODE_MHI, 0, 0, 0);
+	g_emit_target->data[g_emit_target->length - 1].symbol = symbol;
+}
+
+void emit_ori_symbol(const char *symbol)
+{
+	emit(OPCODE_ORI, 0, 0, 0);
+	g_emit_target->data[g_emit_target->length - 1].symbol = symbol;
+}
+
+void emit_addi(int immediate)
+{
+	emit(OPCODE_ADDI, 0, 0, immediate);
+}
+
+void emit_add(int dst, int src)
+{
+	emit(OPCODE_ADD, dst, src, 0);
+}
+
+void emit_sub(int dst, int src)
+{
+	emit(OPCODE_SUB, dst, src, 0);
+}
+
+void emit_adc(int dst, int src)
+{
+	emit(OPCODE_ADC, dst, src, 0);
+}
+
+void emit_sbc(int dst, int src)
+{
+	emit(OPCODE_SBC, dst, src, 0);
+}
+
+void emit_ldr(int dst, int src)
+{
+	emit(OPCODE_LDR, dst, src, 0);
+}
+
+void emit_str(int dst, int src)
+{
+	emit(OPCODE_STR, dst, src, 0);
+}
+
+void emit_push(int src)
+{
+	emit(OPCODE_PUSH, REGISTER_SP, src, 0);
+}
+
+void emit_pop(int dst)
+{
+	emit(OPCODE_POP, dst, REGISTER_SP, 0);
+}
+
+void emit_call(int src, int arguments)
+{
+	emit(OPCODE_CALL, 0, src, 0);
+	g_emit_target->data[g_emit_target->length - 1].arguments = arguments;
+}
+
+void emit_halt()
+{
+	emit(OPCODE_HALT, 0, 0, 0);
+}
+
+int emit_new_label(void)
+{
+	return g_label_count++;
+}
+
+void emit_b(int label)
+{
+	emit(OPCODE_B, 0, 0, label);
+}
+
+void emit_bz(int src, int label)
+{
+	emit(OPCODE_BZ, 0, src, label);
+}
+
+void emit_bnz(int src, int label)
+{
+	emit(OPCODE_BNZ, 0, src, label);
+}
+
+void emit_bc(int label)
+{
+	emit(OPCODE_BC, 0, 0, label);
+}
+
+void emit_bnc(int label)
+{
+	emit(OPCODE_BNC, 0, 0, label);
+}
+
+void emit_label(int label, int depth)
+{
+	emit(OPCODE_LABEL, 0, 0, label);
+	g_emit_target->data[g_emit_target->length - 1].depth = depth;
+}
+
+void emit_frame_addr(int address, int offset, int size, int depth)
+{
+	emit(OPCODE_FRAME_ADDR, 0, 0, address);
+	Instruction *instruction = &g_emit_target->data[g_emit_target->length - 1];
+	instruction->offset = offset;
+	instruction->size = size;
+	instruction->depth = depth;
+}
+
+void emit_frame_clear(int address, int size, int depth)
+{
+	emit(OPCODE_FRAME_CLEAR, 0, 0, address);
+	Instruction *instruction = &g_emit_target->data[g_emit_target->length - 1];
+	instruction->size = size;
+	instruction->count = size;
+	instruction->depth = depth;
+}
+
+void emit_arg_addr(int word, int depth)
+{
+	emit(OPCODE_ARG_ADDR, 0, 0, word);
+	g_emit_target->data[g_emit_target->length - 1].depth = depth;
+}
+
+void emit_return(int results)
+{
+	emit(OPCODE_RETURN, 0, 0, 0);
+	g_emit_target->data[g_emit_target->length - 1].arguments = results;
+}
+
+void emit_tail_call(const char *symbol, int arguments)
+{
+	emit(OPCODE_TAIL_CALL, 0, 0, 0);
+	g_emit_target->data[g_emit_target->length - 1].symbol = symbol;
+	g_emit_target->data[g_emit_target->length - 1].arguments = arguments;
+}
@@ -0,0 +1,134 @@
+#ifndef EMIT_H
+#define EMIT_H
+#include <stdio.h>
+#include <stdbool.h>
+
+#define REGISTER_COUNT 9
+#define REGISTER_FP 7
+#define REGISTER_SP 8
+
+// Calling convention
+// - The first REGISTER_ARGUMENT_COUNT one word arguments are passed in r1 upwards, left to right. Wider
+//   arguments and the ones that don't fit are pushed right to left, the caller pops them after the call.
+// - call pushes the return address and ret pops it, so the callee finds its first stack argument at sp + 2.
+// - Structs wider than two words are passed as their address. The callee must not write through it.
+// - One word results are returned in r1, two word integers in r1 (low word) and r2 (high word). For other
+//   structs the caller passes the address to write the result to in r1, ahead of the arguments.
+// - r0 to r4 and the carry are caller saved. r5, r6, r7 and sp are callee saved.
+#define REGISTER_FIRST_ARGUMENT 1
+#define REGISTER_ARGUMENT_COUNT 4
+#define REGISTER_RESULT 1
+#define REGISTER_FIRST_CALLEE_SAVED 5
+
+typedef enum
+{
+	OPCODE_INVALID,
+	OPCODE_MOV,	 // mov dst, src
+	OPCODE_MOVI, // r0 = immediate
+	OPCODE_MHI,	 // r0 = HI(immediate) << 8
+	OPCODE_ORI,	 // r0 |= LO(immediate)
+	OPCODE_ADDI, // r0 += immediate, sets carry
+	OPCODE_ADD,	 // dst += src, sets carry
+	OPCODE_SUB,	 // dst -= src, sets carry to the borrow
+	OPCODE_ADC,	 // dst += src + carry, sets carry
+	OPCODE_SBC,	 // dst -= src + carry, sets carry to the borrow
+	OPCODE_LDR,	 // dst = [src]
+	OPCODE_STR,	 // [dst] = src
+	OPCODE_PUSH,
+	OPCODE_POP,
+	OPCODE_CALL, // Pushes the return address and jumps to src
+	OPCODE_RET,	 // Pops the return address and jumps to it
+	OPCODE_JMP,	 // Jumps to src
+	OPCODE_B,	 // Jumps to label immediate
+	OPCODE_BZ,	 // Jumps to label immediate if src is zero
+	OPCODE_BNZ,	 // Jumps to label immediate if src is not zero
+	OPCODE_BC,	 // Jumps to label immediate if the carry is set
+	OPCODE_BNC,	 // Jumps to label immediate if the carry is clear
+	OPCODE_HALT,
+	OPCODE_FRAME_ADDR, // Pseudo instruction, r0 = address of word offset of the frame object at immediate
+	OPCODE_FRAME_CLEAR, // Pseudo instruction, zeroes count words of the frame object at immediate from word offset
+	OPCODE_ARG_ADDR,   // Pseudo instruction, r0 = address of word immediate of the incoming stack arguments
+	OPCODE_RETURN,	   // Pseudo instruction, tears down the frame and returns
+	OPCODE_TAIL_CALL,  // Pseudo instruction, tears down the frame and jumps to symbol
+	OPCODE_LABEL,	   // Pseudo instruction, marks where label immediate points
+} Opcode;
+
+typedef struct
+{
+	Opcode opcode;
+	int dst;
+	int src;
+	int immediate;
+	const char *symbol; // Used instead of immediate for mhi/ori of a label
+	int depth;			// Words pushed when the instruction was emitted, used to resolve sp relative slots
+	int offset;			// Word inside the frame object of a frame_addr
+	int size;			// Size of the frame object of a frame_addr or frame_clear
+	int count;			// Words a frame_clear zeroes
+	int arguments;		// Registers a call reads its arguments from or a return its result, one bit per register
+} Instruction;
+
+// The frame slot a frame_addr points at. An object of size words owns the slots immediate to
+// immediate + size - 1, their position in memory is only decided when the frame is laid out.
+#define FRAME_ADDR_SLOT(instruction) ((instruction)->immediate + (instruction)->offset)
+
+typedef struct
+{
+	Instruction *data;
+	int length;
+	int capacity;
+} InstructionVector;
+
+void instruction_vector_init(InstructionVector *iv, int capacity);
+void instruction_vector_push(InstructionVector *iv, Instruction *instruction);
+void instruction_vector_free(InstructionVector *iv);
+
+void instruction_print(Instruction *instruction);
+void instruction_vector_print(InstructionVector *iv);
+
+bool instruction_writes_register(Instruction *instruction, int reg);
+
+// Whether the instruction may continue somewhere else than the next instruction: b, bz, bnz, bc and bnc
+bool instruction_is_branch(Instruction *instruction);
+
+// Whether execution never continues with the next instruction
+bool instruction_ends_flow(Instruction *instruction);
+
+// Whether immediate, offset and size of the instruction name a frame object, true for frame_addr and frame_clear
+bool instruction_names_frame_object(Instruction *instruction);
+
+// All emit functions append to this vector
+extern InstructionVector *g_emit_target;
+
+// Returns a label number that hasn't been used in the program yet
+int emit_new_label(void);
+
+void emit_mov(int dst, int src);
+void emit_movi(int immediate);
+void emit_mhi(int immediate);
+void emit_ori(int immediate);
+void emit_mhi_symbol(const char *symbol);
+void emit_ori_symbol(const char *symbol);
+void emit_addi(int immediate);
+void emit_add(int dst, int src);
+void emit_sub(int dst, int src);
+void emit_adc(int dst, int src);
+void emit_sbc(int dst, int src);
+void emit_ldr(int dst, int src);
+void emit_str(int dst, int src);
+void emit_push(int src);
+void emit_pop(int dst);
+void emit_call(int src, int arguments);
+void emit_halt();
+void emit_b(int label);
+void emit_bz(int src, int label);
+void emit_bnz(int src, int label);
+void emit_bc(int label);
+void emit_bnc(int label);
+void emit_label(int label, int depth);
+void emit_frame_addr(int address, int offset, int size, int depth);
+void emit_frame_clear(int address, int size, int depth);
+void emit_arg_addr(int word, int depth);
+void emit_return(int results);
+void emit_tail_call(const char *symbol, int arguments);
+
+#endif // !EMIT_H
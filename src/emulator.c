@@ -0,0 +1,417 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "emulator.h"
+#include "isel.h"
+
+#define EMULATOR_MEMORY_WORDS 0x10000
+#define EMULATOR_DATA_BASE 0x0010 // Keeps null pointers away from the data
+
+
+typedef struct
+{
+	const char *name;
+	int value; // Code address for code, data address for data
+	bool code;
+} Symbol;
+
+struct EmulatorProgram
+{
+	InstructionVector code;
+	Symbol *symbols;
+	int symbol_count;
+	int symbol_capacity;
+	int *data; // Initial value of every data word from EMULATOR_DATA_BASE on
+	int data_size;
+	int *labels;		// Position of every label, set up when a run starts
+	int *symbol_values; // Value of the symbol operand of every instruction that has one
+};
+
+typedef struct
+{
+	Opcode opcode;
+	const char *name;
+} OpcodeName;
+
+static const OpcodeName g_opcode_names[] = {
+	{OPCODE_MOV, "mov"}, {OPCODE_MOVI, "movi"}, {OPCODE_MHI, "mhi"},   {OPCODE_ORI, "ori"},	 {OPCODE_ADDI, "addi"},
+	{OPCODE_ADD, "add"}, {OPCODE_SUB, "sub"},	{OPCODE_ADC, "adc"},   {OPCODE_SBC, "sbc"},	 {OPCODE_LDR, "ldr"},
+	{OPCODE_STR, "str"}, {OPCODE_PUSH, "push"}, {OPCODE_POP, "pop"},   {OPCODE_CALL, "call"}, {OPCODE_RET, "ret"},
+	{OPCODE_JMP, "jmp"}, {OPCODE_B, "b"},		{OPCODE_BZ, "bz"},	   {OPCODE_BNZ, "bnz"},	 {OPCODE_BC, "bc"},
+	{OPCODE_BNC, "bnc"}, {OPCODE_HALT, "halt"},
+};
+
+#define OPCODE_NAME_COUNT ((int)(sizeof(g_opcode_names) / sizeof(g_opcode_names[0])))
+
+void cycle_table_init(CycleTable *table)
+{
+	memset(table, 0, sizeof(CycleTable));
+	for (int i = 0; i < OPCODE_NAME_COUNT; i++)
+		table->opcodes[g_opcode_names[i].opcode] = instruction_cost(g_opcode_names[i].opcode);
+}
+
+bool cycle_table_load(CycleTable *table, const char *path)
+{
+	FILE *file = fopen(path, "r");
+	if (!file)
+	{
+		printf("Failed to open cycle table %s\n", path);
+		return false;
+	}
+	char line[128];
+	int line_number = 0;
+	bool result = true;
+	while (result && fgets(line, sizeof(line), file))
+	{
+		line_number++;
+		char name[64];
+		int cycles;
+		int fields = sscanf(line, "%63s %d", name, &cycles);
+		if (fields <= 0 || name[0] == '#')
+			continue;
+		int *entry = NULL;
+		for (int i = 0; i < OPCODE_NAME_COUNT && !entry; i++)
+		{
+			if (!strcmp(name, g_opcode_names[i].name))
+				entry = &table->opcodes[g_opcode_names[i].opcode];
+		}
+		if (!entry || fields != 2 || cycles < 0)
+		{
+			printf("Invalid entry in cycle table %s on line %d\n", path, line_number);
+			result = false;
+			continue;
+		}
+		*entry = cycles;
+	}
+	fclose(file);
+	return result;
+}
+
+EmulatorProgram *emulator_program_new(void)
+{
+	EmulatorProgram *program = calloc(1, sizeof(EmulatorProgram));
+	instruction_vector_init(&program->code, 100);
+	return program;
+}
+
+void emulator_program_free(EmulatorProgram *program)
+{
+	instruction_vector_free(&program->code);
+	free(program->symbols);
+	free(program->data);
+	free(program->labels);
+	free(program->symbol_values);
+	free(program);
+}
+
+static void add_symbol(EmulatorProgram *program, const char *name, int value, bool code)
+{
+	if (program->symbol_count == program->symbol_capacity)
+	{
+		program->symbol_capacity = program->symbol_capacity * 2 + 16;
+		program->symbols = realloc(program->symbols, sizeof(Symbol) * program->symbol_capacity);
+	}
+	program->symbols[program->symbol_count++] = (Symbol){name, value, code};
+}
+
+void emulator_add_code(EmulatorProgram *program, const char *name, InstructionVector *iv)
+{
+	if (name)
+		add_symbol(program, name, program->code.length, true);
+	for (int i = 0; i < iv->length; i++)
+		instruction_vector_push(&program->code, &iv->data[i]);
+}
+
+void emulator_add_data(EmulatorProgram *program, const char *name, int *values, int size)
+{
+	add_symbol(program, name, EMULATOR_DATA_BASE + program->data_size, false);
+	program->data = realloc(program->data, sizeof(int) * (program->data_size + size));
+	for (int i = 0; i < size; i++)
+		program->data[program->data_size + i] = values ? values[i] & 0xFFFF : 0;
+	program->data_size += size;
+}
+
+static Symbol *find_symbol(EmulatorProgram *program, const char *name, int length)
+{
+	for (int i = 0; i < program->symbol_count; i++)
+	{
+		Symbol *symbol = &program->symbols[i];
+		if ((int)strlen(symbol->name) == length && !strncmp(symbol->name, name, length))
+			return symbol;
+	}
+	return NULL;
+}
+
+// The value of a symbol operand such as "table+3". Symbols the program doesn't define are given addresses
+// past the end of the code, so calls to them can be told apart.
+static int resolve_symbol(EmulatorProgram *program, const char *operand)
+{
+	const char *plus = strchr(operand, '+');
+	int length = plus ? (int)(plus - operand) : (int)strlen(operand);
+	Symbol *symbol = find_symbol(program, operand, length);
+	if (!symbol)
+	{
+		int external = program->code.length;
+		for (int i = 0; i < program->symbol_count; i++)
+		{
+			if (program->symbols[i].code && program->symbols[i].value >= external)
+				external = program->symbols[i].value + 1;
+		}
+		add_symbol(program, operand, external, true);
+		symbol = &program->symbols[program->symbol_count - 1];
+	}
+	return (symbol->value + (plus ? atoi(plus + 1) : 0)) & 0xFFFF;
+}
+
+static const char *external_name(EmulatorProgram *program, int address)
+{
+	for (int i = 0; i < program->symbol_count; i++)
+	{
+		if (program->symbols[i].code && program->symbols[i].value == address)
+			return program->symbols[i].name;
+	}
+	return NULL;
+}
+
+Instruction *emulator_instruction(EmulatorProgram *program, int pc)
+{
+	return &program->code.data[pc];
+}
+
+int emulator_code_length(EmulatorProgram *program)
+{
+	return program->code.length;
+}
+
+int emulator_label_position(EmulatorProgram *program, int label)
+{
+	return program->labels[label];
+}
+
+int emulator_symbol_value(EmulatorProgram *program, int pc)
+{
+	return program->symbol_values[pc];
+}
+
+void emulator_start(EmulatorProgram *program, long long limit, EmulatorState *state)
+{
+	InstructionVector *code = &program->code;
+
+	// Labels are numbered across the whole program, so they resolve the same way in every piece of code
+	int label_count = 0;
+	for (int i = 0; i < code->length; i++)
+	{
+		if (code->data[i].opcode == OPCODE_LABEL && code->data[i].immediate >= label_count)
+			label_count = code->data[i].immediate + 1;
+	}
+	free(program->labels);
+	program->labels = malloc(sizeof(int) * (label_count + 1));
+	for (int i = 0; i < code->length; i++)
+	{
+		if (code->data[i].opcode == OPCODE_LABEL)
+			program->labels[code->data[i].immediate] = i;
+	}
+	free(program->symbol_values);
+	program->symbol_values = malloc(sizeof(int) * (code->length + 1));
+	for (int i = 0; i < code->length; i++)
+	{
+		if (code->data[i].symbol)
+			program->symbol_values[i] = resolve_symbol(program, code->data[i].symbol);
+	}
+
+	memset(state, 0, sizeof(EmulatorState));
+	state->memory = calloc(EMULATOR_MEMORY_WORDS, sizeof(int));
+	if (program->data_size > 0)
+		memcpy(&state->memory[EMULATOR_DATA_BASE], program->data, sizeof(int) * program->data_size);
+	state->registers[REGISTER_SP] = EMULATOR_STACK_TOP;
+	state->limit = limit;
+}
+
+void emulator_finish(EmulatorState *state)
+{
+	free(state->memory);
+	state->memory = NULL;
+}
+
+EmulatorStatus emulator_step(EmulatorProgram *program, CycleTable *table, EmulatorState *state)
+{
+	InstructionVector *code = &program->code;
+	EmulatorStatistics *statistics = &state->statistics;
+	int *registers = state->registers;
+	int *memory = state->memory;
+
+	// The entry code may end without a halt when there is nothing after it
+	if (state->pc == code->length)
+	{
+		statistics->halted = true;
+		return EMULATOR_HALTED;
+	}
+	if (state->pc < 0 || state->pc > code->length)
+	{
+		printf("Emulator: jumped to %d, which is outside of the code\n", state->pc);
+		return EMULATOR_FAULT;
+	}
+	Instruction *instruction = &code->data[state->pc];
+	int dst = instruction->dst;
+	int src = instruction->src;
+	int result;
+	state->pc++;
+	if (instruction->opcode == OPCODE_LABEL)
+		return EMULATOR_RUNNING;
+	if (instruction->opcode == OPCODE_HALT)
+	{
+		statistics->halted = true;
+		return EMULATOR_HALTED;
+	}
+	statistics->instructions++;
+	statistics->executed[instruction->opcode]++;
+	statistics->cycles += table->opcodes[instruction->opcode];
+
+	switch (instruction->opcode)
+	{
+	case OPCODE_MOV:
+		registers[dst] = registers[src];
+		break;
+	case OPCODE_MOVI:
+		registers[0] = instruction->immediate & 0xFF;
+		break;
+	case OPCODE_MHI:
+		registers[0] = (instruction->symbol ? program->symbol_values[state->pc - 1] : instruction->immediate) & 0xFF00;
+		break;
+	case OPCODE_ORI:
+		registers[0] |= (instruction->symbol ? program->symbol_values[state->pc - 1] : instruction->immediate) & 0xFF;
+		break;
+	case OPCODE_ADDI:
+		result = registers[0] + (instruction->immediate & 0xFFFF);
+		state->carry = result > 0xFFFF;
+		registers[0] = result & 0xFFFF;
+		break;
+	case OPCODE_ADD:
+	case OPCODE_ADC:
+		result = registers[dst] + registers[src] + (instruction->opcode == OPCODE_ADC ? state->carry : 0);
+		state->carry = result > 0xFFFF;
+		registers[dst] = result & 0xFFFF;
+		break;
+	case OPCODE_SUB:
+	case OPCODE_SBC:
+		result = registers[dst] - registers[src] - (instruction->opcode == OPCODE_SBC ? state->carry : 0);
+		state->carry = result < 0;
+		registers[dst] = result & 0xFFFF;
+		break;
+	case OPCODE_LDR:
+		registers[dst] = memory[registers[src]];
+		statistics->loads++;
+		break;
+	case OPCODE_STR:
+		memory[registers[dst]] = registers[src];
+		statistics->stores++;
+		break;
+	case OPCODE_PUSH:
+		memory[registers[REGISTER_SP]] = registers[src];
+		registers[REGISTER_SP] = (registers[REGISTER_SP] - 1) & 0xFFFF;
+		statistics->stores++;
+		break;
+	case OPCODE_POP:
+		registers[REGISTER_SP] = (registers[REGISTER_SP] + 1) & 0xFFFF;
+		registers[dst] = memory[registers[REGISTER_SP]];
+		statistics->loads++;
+		break;
+	case OPCODE_CALL:
+	case OPCODE_JMP:
+	{
+		int target = registers[src];
+		const char *external = target < code->length ? NULL : external_name(program, target);
+		if (target < code->length)
+		{
+			if (instruction->opcode == OPCODE_CALL)
+			{
+				memory[registers[REGISTER_SP]] = state->pc;
+				registers[REGISTER_SP] = (registers[REGISTER_SP] - 1) & 0xFFFF;
+				statistics->stores++;
+				statistics->calls++;
+			}
+			state->pc = target;
+			break;
+		}
+		if (!external)
+		{
+			printf("Emulator: call to %d, which is neither code nor a symbol\n", target);
+			return EMULATOR_FAULT;
+		}
+		fprintf(stderr, "Call to %s with r1=%d r2=%d r3=%d r4=%d\n", external, registers[1], registers[2],
+				registers[3], registers[4]);
+		statistics->external_calls++;
+		// A jmp leaves with the return address of the caller still on the stack
+		if (instruction->opcode == OPCODE_JMP)
+		{
+			registers[REGISTER_SP] = (registers[REGISTER_SP] + 1) & 0xFFFF;
+			state->pc = memory[registers[REGISTER_SP]];
+			statistics->loads++;
+		}
+		break;
+	}
+	case OPCODE_RET:
+		registers[REGISTER_SP] = (registers[REGISTER_SP] + 1) & 0xFFFF;
+		state->pc = memory[registers[REGISTER_SP]];
+		statistics->loads++;
+		break;
+	case OPCODE_B:
+		state->pc = program->labels[instruction->immediate];
+		break;
+	case OPCODE_BZ:
+		if (registers[src] == 0)
+			state->pc = program->labels[instruction->immediate];
+		break;
+	case OPCODE_BNZ:
+		if (registers[src] != 0)
+			state->pc = program->labels[instruction->immediate];
+		break;
+	case OPCODE_BC:
+		if (state->carry)
+			state->pc = program->labels[instruction->immediate];
+		break;
+	case OPCODE_BNC:
+		if (!state->carry)
+			state->pc = program->labels[instruction->immediate];
+		break;
+	default:
+		printf("Emulator: pseudo instruction left in the code at %d\n", state->pc - 1);
+		return EMULATOR_FAULT;
+	}
+
+	int stack = EMULATOR_STACK_TOP - registers[REGISTER_SP];
+	if (stack > statistics->peak_stack)
+		statistics->peak_stack = stack;
+	return EMULATOR_RUNNING;
+}
+
+bool emulator_run(EmulatorProgram *program, CycleTable *table, long long limit, EmulatorStatistics *statistics)
+{
+	EmulatorState state;
+	emulator_start(program, limit, &state);
+	EmulatorStatus status = EMULATOR_RUNNING;
+	while (status == EMULATOR_RUNNING && state.statistics.instructions < limit)
+		status = emulator_step(program, table, &state);
+	*statistics = state.statistics;
+	emulator_finish(&state);
+	return status == EMULATOR_HALTED;
+}
+
+void emulator_print_statistics(EmulatorStatistics *statistics)
+{
+	fprintf(stderr, "%-20s %12lld\n", "Instructions", statistics->instructions);
+	fprintf(stderr, "%-20s %12lld\n", "Cycles", statistics->cycles);
+	fprintf(stderr, "%-20s %12lld\n", "Loads", statistics->loads);
+	fprintf(stderr, "%-20s %12lld\n", "Stores", statistics->stores);
+	fprintf(stderr, "%-20s %12lld\n", "Calls", statistics->calls);
+	fprintf(stderr, "%-20s %12lld\n", "External calls", statistics->external_calls);
+	fprintf(stderr, "%-20s %12d\n", "Peak stack words", statistics->peak_stack);
+	for (int i = 0; i < OPCODE_NAME_COUNT; i++)
+	{
+		long long count = statistics->executed[g_opcode_names[i].opcode];
+		if (count > 0)
+			fprintf(stderr, "  %-18s %12lld\n", g_opcode_names[i].name, count);
+	}
+	if (!statistics->halted)
+		fprintf(stderr, "The program did not halt\n");
+}
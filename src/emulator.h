@@ -0,0 +1,88 @@
+#ifndef EMULATOR_H
+#define EMULATOR_H
+#include "emit.h"
+
+#define EMULATOR_DEFAULT_LIMIT 100000000 // Instructions a run may execute before it is stopped
+#define EMULATOR_STACK_TOP 0xFFFF		 // sp points at the next free word and the stack grows down
+
+// Cycles every instruction takes
+typedef struct
+{
+	int opcodes[OPCODE_LABEL + 1];
+} CycleTable;
+
+// Starts out with the costs the instruction selector assumes
+void cycle_table_init(CycleTable *table);
+
+// Overrides entries of the table from a file with one "name cycles" pair per line, names as the
+// instructions are printed. Lines starting with # are ignored. Returns false when the file can't be read
+// or has a line that doesn't make sense.
+bool cycle_table_load(CycleTable *table, const char *path);
+
+typedef struct
+{
+	long long instructions;
+	long long cycles;
+	long long loads;  // Words read from memory by ldr, pop and ret
+	long long stores; // Words written to memory by str, push and call
+	long long calls;  // Calls into the program
+	long long external_calls;
+	int peak_stack; // Most words the stack held at once
+	long long executed[OPCODE_LABEL + 1];
+	bool halted; // Stopped at a halt or the end of the entry code rather than an error or the limit
+} EmulatorStatistics;
+
+// Everything a running program can see, and what it took so far
+typedef struct
+{
+	int registers[REGISTER_COUNT];
+	int carry;
+	int pc;		 // Code address of the next instruction
+	int *memory; // Every word of the data address space
+	long long limit;
+	EmulatorStatistics statistics;
+} EmulatorState;
+
+typedef enum
+{
+	EMULATOR_RUNNING,
+	EMULATOR_HALTED,
+	EMULATOR_FAULT, // Jumped outside of the code, called something that isn't code or found a pseudo instruction
+} EmulatorStatus;
+
+typedef struct EmulatorProgram EmulatorProgram;
+
+// A program is made of code, which lives in its own address space with one instruction per address, and
+// data words. Execution starts at the first instruction of the first code that is added.
+EmulatorProgram *emulator_program_new(void);
+void emulator_program_free(EmulatorProgram *program);
+
+// Adds lowered code, name is its symbol or NULL for the entry code
+void emulator_add_code(EmulatorProgram *program, const char *name, InstructionVector *iv);
+
+// Adds size words of data at the next free address, values may be NULL for zeroed data
+void emulator_add_data(EmulatorProgram *program, const char *name, int *values, int size);
+
+// Resolves the labels and symbols of the program and puts it into its initial state, with the data
+// loaded and sp at EMULATOR_STACK_TOP. emulator_finish releases the memory of the state.
+void emulator_start(EmulatorProgram *program, long long limit, EmulatorState *state);
+void emulator_finish(EmulatorState *state);
+
+// Executes the instruction at pc. Labels are skipped without counting them.
+EmulatorStatus emulator_step(EmulatorProgram *program, CycleTable *table, EmulatorState *state);
+
+// The code of a started program, for running it some other way than one step at a time
+Instruction *emulator_instruction(EmulatorProgram *program, int pc);
+int emulator_code_length(EmulatorProgram *program);
+int emulator_label_position(EmulatorProgram *program, int label);
+int emulator_symbol_value(EmulatorProgram *program, int pc); // Of the symbol operand of the instruction at pc
+
+// Runs the program until it halts, runs off the end of the entry code, does something invalid or executes
+// limit instructions. Calls to symbols that are neither code nor data are printed to stderr with the
+// argument registers and otherwise do nothing. Returns whether the program halted.
+bool emulator_run(EmulatorProgram *program, CycleTable *table, long long limit, EmulatorStatistics *statistics);
+
+// Prints the statistics of a run to stderr
+void emulator_print_statistics(EmulatorStatistics *statistics);
+
+#endif // !EMULATOR_H
@@ -0,0 +1,297 @@
+#include <stdlib.h>
+#include <string.h>
+#include "eval.h"
+#include "optimize.h"
+#include "runtime.h"
+
+// The private stack is the top of the address space, like the real one. Anything outside of it belongs
+// to the program and can't be touched at compile time.
+#define EVAL_STACK_WORDS 4096
+#define EVAL_STACK_BASE (0x10000 - EVAL_STACK_WORDS)
+#define EVAL_SAVED_REGISTERS (REGISTER_SP - REGISTER_FIRST_CALLEE_SAVED) // r5, r6 and r7
+
+// A function that is being run
+typedef struct
+{
+	InstructionVector *code;
+	int *labels;
+	int pc;
+	int entry_sp;	// sp after the return address was pushed, the incoming arguments are above it
+	int frame_base; // Address of slot 0 of the frame objects
+	int saved[EVAL_SAVED_REGISTERS];
+	const char *saved_symbols[EVAL_SAVED_REGISTERS];
+} Activation;
+
+typedef struct
+{
+	int registers[REGISTER_COUNT];
+	const char *symbols[REGISTER_COUNT]; // Set when the register holds the address of a symbol
+	int carry;
+	int memory[EVAL_STACK_WORDS];
+	Activation *activations;
+	int depth;
+	EvalFunctionLookup lookup;
+} Evaluator;
+
+static bool valid_address(int address)
+{
+	return address >= EVAL_STACK_BASE && address <= 0xFFFF;
+}
+
+// Sets up a frame for code below sp and starts running it. The caller has pushed the return address.
+static bool enter(Evaluator *evaluator, Activation *activation, InstructionVector *code)
+{
+	int frame_size = 0;
+	for (int i = 0; i < code->length; i++)
+	{
+		Instruction *instruction = &code->data[i];
+		if (instruction_names_frame_object(instruction) && instruction->immediate + instruction->size > frame_size)
+			frame_size = instruction->immediate + instruction->size;
+	}
+	int *sp = &evaluator->registers[REGISTER_SP];
+	if (*sp - frame_size < EVAL_STACK_BASE)
+		return false;
+	int label_count;
+	activation->code = code;
+	activation->labels = label_positions(code, &label_count);
+	activation->pc = 0;
+	activation->entry_sp = *sp;
+	*sp -= frame_size;
+	activation->frame_base = *sp + 1;
+	return true;
+}
+
+// Tears down the frame of the running function and gives the caller its callee saved registers back
+static void leave(Evaluator *evaluator, Activation *activation)
+{
+	for (int i = 0; i < EVAL_SAVED_REGISTERS; i++)
+	{
+		evaluator->registers[REGISTER_FIRST_CALLEE_SAVED + i] = activation->saved[i];
+		evaluator->symbols[REGISTER_FIRST_CALLEE_SAVED + i] = activation->saved_symbols[i];
+	}
+	evaluator->registers[REGISTER_SP] = activation->entry_sp;
+	free(activation->labels);
+	activation->labels = NULL;
+}
+
+static bool call(Evaluator *evaluator, const char *symbol)
+{
+	int *registers = evaluator->registers;
+	// The runtime routine isn't part of the functions lookup knows, its result is computed directly
+	if (!strcmp(symbol, RUNTIME_MUL16))
+	{
+		if (evaluator->symbols[1] || evaluator->symbols[2])
+			return false;
+		registers[1] = (registers[1] * registers[2]) & 0xFFFF;
+		return true;
+	}
+	InstructionVector *code = evaluator->lookup(symbol);
+	if (!code || evaluator->depth == EVAL_MAX_DEPTH || registers[REGISTER_SP] <= EVAL_STACK_BASE)
+		return false;
+	// The return address is never looked at, the activation remembers where to continue
+	evaluator->memory[registers[REGISTER_SP] - EVAL_STACK_BASE] = 0;
+	registers[REGISTER_SP]--;
+	Activation *activation = &evaluator->activations[evaluator->depth];
+	for (int i = 0; i < EVAL_SAVED_REGISTERS; i++)
+	{
+		activation->saved[i] = registers[REGISTER_FIRST_CALLEE_SAVED + i];
+		activation->saved_symbols[i] = evaluator->symbols[REGISTER_FIRST_CALLEE_SAVED + i];
+	}
+	if (!enter(evaluator, activation, code))
+		return false;
+	evaluator->depth++;
+	return true;
+}
+
+// Executes one instruction of the running function. Returns false when the evaluation has to give up.
+static bool step(Evaluator *evaluator, Activation *activation)
+{
+	int *registers = evaluator->registers;
+	const char **symbols = evaluator->symbols;
+	Instruction *instruction = &activation->code->data[activation->pc++];
+	int dst = instruction->dst;
+	int src = instruction->src;
+	int result;
+
+	// Only mov, ori and call know what to do with the address of a symbol
+	switch (instruction->opcode)
+	{
+	case OPCODE_ADDI:
+		if (symbols[0])
+			return false;
+		break;
+	case OPCODE_ADD:
+	case OPCODE_SUB:
+	case OPCODE_ADC:
+	case OPCODE_SBC:
+		if (symbols[dst] || symbols[src])
+			return false;
+		break;
+	case OPCODE_LDR:
+	case OPCODE_PUSH:
+	case OPCODE_BZ:
+	case OPCODE_BNZ:
+		if (symbols[src])
+			return false;
+		break;
+	case OPCODE_STR:
+		if (symbols[dst] || symbols[src])
+			return false;
+		break;
+	default:
+		break;
+	}
+
+	switch (instruction->opcode)
+	{
+	case OPCODE_MOV:
+		registers[dst] = registers[src];
+		symbols[dst] = symbols[src];
+		return true;
+	case OPCODE_MOVI:
+		registers[0] = instruction->immediate & 0xFF;
+		symbols[0] = NULL;
+		return true;
+	case OPCODE_MHI:
+		registers[0] = instruction->symbol ? 0 : instruction->immediate & 0xFF00;
+		symbols[0] = instruction->symbol;
+		return true;
+	case OPCODE_ORI:
+		if (!symbols[0] != !instruction->symbol || (symbols[0] && strcmp(symbols[0], instruction->symbol)))
+			return false;
+		if (!instruction->symbol)
+			registers[0] |= instruction->immediate & 0xFF;
+		return true;
+	case OPCODE_ADDI:
+		result = registers[0] + (instruction->immediate & 0xFFFF);
+		evaluator->carry = result > 0xFFFF;
+		registers[0] = result & 0xFFFF;
+		return true;
+	case OPCODE_ADD:
+	case OPCODE_ADC:
+		result = registers[dst] + registers[src] + (instruction->opcode == OPCODE_ADC ? evaluator->carry : 0);
+		evaluator->carry = result > 0xFFFF;
+		registers[dst] = result & 0xFFFF;
+		return true;
+	case OPCODE_SUB:
+	case OPCODE_SBC:
+		result = registers[dst] - registers[src] - (instruction->opcode == OPCODE_SBC ? evaluator->carry : 0);
+		evaluator->carry = result < 0;
+		registers[dst] = result & 0xFFFF;
+		return true;
+	case OPCODE_LDR:
+		if (!valid_address(registers[src]))
+			return false;
+		registers[dst] = evaluator->memory[registers[src] - EVAL_STACK_BASE];
+		symbols[dst] = NULL;
+		return true;
+	case OPCODE_STR:
+		if (!valid_address(registers[dst]))
+			return false;
+		evaluator->memory[registers[dst] - EVAL_STACK_BASE] = registers[src];
+		return true;
+	case OPCODE_PUSH:
+		if (registers[REGISTER_SP] < EVAL_STACK_BASE)
+			return false;
+		evaluator->memory[registers[REGISTER_SP] - EVAL_STACK_BASE] = registers[src];
+		registers[REGISTER_SP]--;
+		return true;
+	case OPCODE_POP:
+		if (registers[REGISTER_SP] >= 0xFFFF)
+			return false;
+		registers[REGISTER_SP]++;
+		registers[dst] = evaluator->memory[registers[REGISTER_SP] - EVAL_STACK_BASE];
+		symbols[dst] = NULL;
+		return true;
+	case OPCODE_CALL:
+		return symbols[src] && call(evaluator, symbols[src]);
+	case OPCODE_RETURN:
+		leave(evaluator, activation);
+		registers[REGISTER_SP]++;
+		evaluator->depth--;
+		return true;
+	case OPCODE_TAIL_CALL:
+	{
+		// The frame goes away, the callee returns to our caller with the registers we were entered with
+		InstructionVector *code = evaluator->lookup(instruction->symbol);
+		if (!code)
+			return false;
+		leave(evaluator, activation);
+		return enter(evaluator, activation, code);
+	}
+	case OPCODE_B:
+		activation->pc = activation->labels[instruction->immediate];
+		return true;
+	case OPCODE_BZ:
+		if (registers[src] == 0)
+			activation->pc = activation->labels[instruction->immediate];
+		return true;
+	case OPCODE_BNZ:
+		if (registers[src] != 0)
+			activation->pc = activation->labels[instruction->immediate];
+		return true;
+	case OPCODE_BC:
+		if (evaluator->carry)
+			activation->pc = activation->labels[instruction->immediate];
+		return true;
+	case OPCODE_BNC:
+		if (!evaluator->carry)
+			activation->pc = activation->labels[instruction->immediate];
+		return true;
+	case OPCODE_FRAME_ADDR:
+		registers[0] = activation->frame_base + FRAME_ADDR_SLOT(instruction);
+		symbols[0] = NULL;
+		return true;
+	case OPCODE_FRAME_CLEAR:
+		for (int i = 0; i < instruction->count; i++)
+			evaluator->memory[activation->frame_base + FRAME_ADDR_SLOT(instruction) + i - EVAL_STACK_BASE] = 0;
+		return true;
+	case OPCODE_ARG_ADDR:
+		registers[0] = activation->entry_sp + 2 + instruction->immediate;
+		symbols[0] = NULL;
+		return true;
+	case OPCODE_LABEL:
+		return true;
+	default:
+		// halt, jmp and anything else leaves the function some other way
+		return false;
+	}
+}
+
+bool evaluate_call(InstructionVector *code, int *registers, int *stack_words, int stack_count,
+				   EvalFunctionLookup lookup, int *results)
+{
+	Evaluator *evaluator = calloc(1, sizeof(Evaluator));
+	evaluator->activations = malloc(sizeof(Activation) * EVAL_MAX_DEPTH);
+	evaluator->lookup = lookup;
+	for (int reg = 0; reg < REGISTER_COUNT; reg++)
+		evaluator->registers[reg] = registers[reg] & 0xFFFF;
+
+	// Stack arguments, then the return address
+	int *sp = &evaluator->registers[REGISTER_SP];
+	*sp = 0xFFFF;
+	for (int i = stack_count - 1; i >= 0; i--)
+		evaluator->memory[(*sp)-- - EVAL_STACK_BASE] = stack_words[i] & 0xFFFF;
+	(*sp)--;
+
+	bool success = enter(evaluator, &evaluator->activations[0], code);
+	evaluator->depth = success ? 1 : 0;
+	for (int steps = 0; success && evaluator->depth > 0; steps++)
+	{
+		Activation *activation = &evaluator->activations[evaluator->depth - 1];
+		if (steps == EVAL_MAX_STEPS || activation->pc >= activation->code->length)
+			success = false;
+		else
+			success = step(evaluator, activation);
+	}
+
+	// A symbol in a result register can't be turned into a constant
+	success = success && !evaluator->symbols[1] && !evaluator->symbols[2];
+	results[0] = evaluator->registers[1];
+	results[1] = evaluator->registers[2];
+	for (int i = 0; i < evaluator->depth; i++)
+		free(evaluator->activations[i].labels);
+	free(evaluator->activations);
+	free(evaluator);
+	return success;
+}
@@ -0,0 +1,22 @@
+#ifndef EVAL_H
+#define EVAL_H
+#include "emit.h"
+
+#define EVAL_MAX_STEPS 100000 // Instructions a single evaluation may execute
+#define EVAL_MAX_DEPTH 64	  // Calls that may be active at once
+
+// Finds the code of a function by its symbol, NULL when it isn't defined or isn't completely compiled yet
+typedef InstructionVector *(*EvalFunctionLookup)(const char *symbol);
+
+// Compile time evaluation of a call. The code of a function, before it is optimized and its frame is
+// lowered, is run on a private stack with the arguments in registers and stack_words words of stack
+// arguments, lowest address first. Calls to other functions found through lookup and to the __mul16
+// runtime routine are followed. Evaluation gives up as soon as the code does something that isn't a pure computation: loading
+// or storing outside the private stack, which covers globals and pointer arguments, calling a function
+// that can't be found, using the address of a symbol as a value or halting. It also gives up after
+// EVAL_MAX_STEPS instructions or EVAL_MAX_DEPTH nested calls, so calls that don't terminate are left alone.
+// results receives r1 and r2 when the function returns. Returns whether the evaluation succeeded.
+bool evaluate_call(InstructionVector *code, int *registers, int *stack_words, int stack_count,
+				   EvalFunctionLookup lookup, int *results);
+
+#endif // !EVAL_H
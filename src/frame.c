@@ -0,0 +1,264 @@
+#include <stdlib.h>
+#include "frame.h"
+#include "isel.h"
+
+// A frame_clear of up to this many words is lowered to stores, larger ones to a loop
+#define CLEAR_UNROLL_WORDS 3
+
+int frame_common_addresses(InstructionVector *iv)
+{
+	// The slot address each register holds, or -1
+	int register_slot[REGISTER_COUNT];
+	for (int i = 0; i < REGISTER_COUNT; i++)
+		register_slot[i] = -1;
+
+	int removed = 0;
+	int write_index = 0;
+	for (int i = 0; i < iv->length; i++)
+	{
+		Instruction instruction = iv->data[i];
+
+		// The label may be reached with other addresses in the registers
+		if (instruction.opcode == OPCODE_LABEL)
+		{
+			for (int reg = 0; reg < REGISTER_COUNT; reg++)
+				register_slot[reg] = -1;
+		}
+
+		if (instruction.opcode == OPCODE_FRAME_ADDR)
+		{
+			int slot = FRAME_ADDR_SLOT(&instruction);
+			if (register_slot[0] == slot)
+			{
+				removed++;
+				continue;
+			}
+			int holder = -1;
+			for (int reg = 1; reg < REGISTER_COUNT; reg++)
+			{
+				if (register_slot[reg] == slot)
+				{
+					holder = reg;
+					break;
+				}
+			}
+			if (holder != -1)
+			{
+				Instruction mov = {0};
+				mov.opcode = OPCODE_MOV;
+				mov.dst = 0;
+				mov.src = holder;
+				instruction = mov;
+				removed++;
+			}
+			register_slot[0] = slot;
+			iv->data[write_index++] = instruction;
+			continue;
+		}
+
+		if (instruction.opcode == OPCODE_MOV)
+		{
+			// Copying an address into a register that already holds it
+			if (instruction.src != REGISTER_SP && register_slot[instruction.src] != -1 &&
+				register_slot[instruction.dst] == register_slot[instruction.src])
+			{
+				removed++;
+				continue;
+			}
+			register_slot[instruction.dst] = instruction.src == REGISTER_SP ? -1 : register_slot[instruction.src];
+			iv->data[write_index++] = instruction;
+			continue;
+		}
+
+		for (int reg = 0; reg < REGISTER_COUNT; reg++)
+		{
+			if (instruction_writes_register(&instruction, reg))
+				register_slot[reg] = -1;
+		}
+		iv->data[write_index++] = instruction;
+	}
+	iv->length = write_index;
+	return removed;
+}
+
+static void push_instruction(InstructionVector *iv, Opcode opcode, int dst, int src, int immediate)
+{
+	Instruction instruction = {0};
+	instruction.opcode = opcode;
+	instruction.dst = dst;
+	instruction.src = src;
+	instruction.immediate = immediate;
+	instruction_vector_push(iv, &instruction);
+}
+
+int frame_lower(InstructionVector *iv, bool use_frame_pointer, bool function)
+{
+	// Only slots covered by an object that is still referenced get a place in the frame. Objects that
+	// were given the same slots share their place.
+	int slot_count = 0;
+	for (int i = 0; i < iv->length; i++)
+	{
+		Instruction *instruction = &iv->data[i];
+		if (instruction_names_frame_object(instruction) && instruction->immediate + instruction->size > slot_count)
+			slot_count = instruction->immediate + instruction->size;
+	}
+	bool *used = calloc(slot_count + 1, sizeof(bool));
+	int *layout = calloc(slot_count + 1, sizeof(int));
+	for (int i = 0; i < iv->length; i++)
+	{
+		Instruction *instruction = &iv->data[i];
+		if (!instruction_names_frame_object(instruction))
+			continue;
+		for (int slot = instruction->immediate; slot < instruction->immediate + instruction->size; slot++)
+			used[slot] = true;
+	}
+	int frame_size = 0;
+	for (int slot = 0; slot < slot_count; slot++)
+	{
+		layout[slot] = frame_size;
+		if (used[slot])
+			frame_size++;
+	}
+
+	// Without frame objects there is nothing to address from the frame pointer
+	if (frame_size == 0)
+		use_frame_pointer = false;
+
+	// A function keeps the callee saved registers it writes on the stack, the frame pointer included
+	bool saved[REGISTER_COUNT] = {0};
+	int saved_count = 0;
+	for (int reg = REGISTER_FIRST_CALLEE_SAVED; reg < REGISTER_SP && function; reg++)
+	{
+		saved[reg] = reg == REGISTER_FP && use_frame_pointer;
+		for (int i = 0; i < iv->length && !saved[reg]; i++)
+			saved[reg] = instruction_writes_register(&iv->data[i], reg);
+		if (saved[reg])
+			saved_count++;
+	}
+
+	InstructionVector lowered;
+	instruction_vector_init(&lowered, iv->length + 4);
+
+	// The whole frame is reserved at once, the frame pointer points just below it
+	for (int reg = REGISTER_FIRST_CALLEE_SAVED; reg < REGISTER_SP; reg++)
+	{
+		if (saved[reg])
+			push_instruction(&lowered, OPCODE_PUSH, REGISTER_SP, reg, 0);
+	}
+	if (frame_size > 0)
+	{
+		select_constant(&lowered, frame_size, NULL);
+		push_instruction(&lowered, OPCODE_SUB, REGISTER_SP, 0, 0);
+	}
+	if (use_frame_pointer)
+		push_instruction(&lowered, OPCODE_MOV, REGISTER_FP, REGISTER_SP, 0);
+	// Words between the frame and the incoming stack arguments
+	int frame_top = frame_size + saved_count + 1;
+
+	// Frame position whose address is in r0, or -1
+	int r0_position = -1;
+	for (int i = 0; i < iv->length; i++)
+	{
+		Instruction *instruction = &iv->data[i];
+		if (instruction->opcode == OPCODE_ARG_ADDR)
+		{
+			select_offset(&lowered, REGISTER_SP, instruction->depth + frame_top + 1 + instruction->immediate, NULL);
+			r0_position = -1;
+			continue;
+		}
+		if (instruction->opcode == OPCODE_RETURN || instruction->opcode == OPCODE_TAIL_CALL)
+		{
+			if (frame_size > 0)
+			{
+				select_constant(&lowered, frame_size, NULL);
+				push_instruction(&lowered, OPCODE_ADD, REGISTER_SP, 0, 0);
+			}
+			for (int reg = REGISTER_SP - 1; reg >= REGISTER_FIRST_CALLEE_SAVED; reg--)
+			{
+				if (saved[reg])
+					push_instruction(&lowered, OPCODE_POP, reg, REGISTER_SP, 0);
+			}
+			r0_position = -1;
+			if (instruction->opcode == OPCODE_RETURN)
+			{
+				push_instruction(&lowered, OPCODE_RET, 0, 0, 0);
+				continue;
+			}
+			// The target is loaded after the teardown since that goes through r0, the return address is
+			// left on the stack for the callee to return to our caller
+			push_instruction(&lowered, OPCODE_MHI, 0, 0, 0);
+			lowered.data[lowered.length - 1].symbol = instruction->symbol;
+			push_instruction(&lowered, OPCODE_ORI, 0, 0, 0);
+			lowered.data[lowered.length - 1].symbol = instruction->symbol;
+			push_instruction(&lowered, OPCODE_JMP, 0, 0, 0);
+			continue;
+		}
+		if (!instruction_names_frame_object(instruction))
+		{
+			instruction_vector_push(&lowered, instruction);
+			if (instruction_writes_register(instruction, 0) || instruction->opcode == OPCODE_LABEL)
+				r0_position = -1;
+			continue;
+		}
+
+		if (instruction->opcode == OPCODE_FRAME_CLEAR && instruction->count <= CLEAR_UNROLL_WORDS)
+		{
+			push_instruction(&lowered, OPCODE_MOVI, 0, 0, 0);
+			push_instruction(&lowered, OPCODE_MOV, 1, 0, 0);
+			r0_position = -1;
+		}
+		int position = layout[FRAME_ADDR_SLOT(instruction)];
+		if (r0_position != -1 && position >= r0_position && immediate_encodable(OPCODE_ADDI, position - r0_position))
+		{
+			// Walking up through an object, r0 already points just below the wanted word
+			if (position != r0_position)
+				push_instruction(&lowered, OPCODE_ADDI, 0, 0, position - r0_position);
+		}
+		else if (use_frame_pointer)
+		{
+			select_offset(&lowered, REGISTER_FP, position + 1, NULL);
+		}
+		else
+		{
+			select_offset(&lowered, REGISTER_SP, instruction->depth + position + 1, NULL);
+		}
+		r0_position = position;
+
+		if (instruction->opcode != OPCODE_FRAME_CLEAR)
+			continue;
+		if (instruction->count <= CLEAR_UNROLL_WORDS)
+		{
+			// r1 already holds zero, r0 walks up through the words
+			push_instruction(&lowered, OPCODE_STR, 0, 1, 0);
+			for (int word = 1; word < instruction->count; word++)
+			{
+				push_instruction(&lowered, OPCODE_ADDI, 0, 0, 1);
+				push_instruction(&lowered, OPCODE_STR, 0, 1, 0);
+			}
+			r0_position = position + instruction->count - 1;
+			continue;
+		}
+		// A loop storing zero from r3 through r1 while r2 counts the words down, r4 holds the step. A
+		// frame_clear may clobber what a call does, so the registers are free.
+		int loop = emit_new_label();
+		push_instruction(&lowered, OPCODE_MOV, 1, 0, 0);
+		select_constant(&lowered, instruction->count, NULL);
+		push_instruction(&lowered, OPCODE_MOV, 2, 0, 0);
+		push_instruction(&lowered, OPCODE_MOVI, 0, 0, 0);
+		push_instruction(&lowered, OPCODE_MOV, 3, 0, 0);
+		push_instruction(&lowered, OPCODE_MOVI, 0, 0, 1);
+		push_instruction(&lowered, OPCODE_MOV, 4, 0, 0);
+		push_instruction(&lowered, OPCODE_LABEL, 0, 0, loop);
+		push_instruction(&lowered, OPCODE_STR, 1, 3, 0);
+		push_instruction(&lowered, OPCODE_ADD, 1, 4, 0);
+		push_instruction(&lowered, OPCODE_SUB, 2, 4, 0);
+		push_instruction(&lowered, OPCODE_BNZ, 0, 2, loop);
+		r0_position = -1;
+	}
+
+	instruction_vector_free(iv);
+	*iv = lowered;
+	free(used);
+	free(layout);
+	return frame_size;
+}
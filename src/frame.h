@@ -0,0 +1,19 @@
+#ifndef FRAME_H
+#define FRAME_H
+#include <stdbool.h>
+#include "emit.h"
+
+// Reuses stack slot addresses that are still held in a register instead of recomputing them.
+// Returns the number of address computations removed.
+int frame_common_addresses(InstructionVector *iv);
+
+// Lays out the frame objects that are still referenced, reserves them with a single sp adjustment
+// and replaces frame_addr pseudo instructions with real address arithmetic. With use_frame_pointer
+// the objects are addressed from r7, otherwise relative to sp using the number of words pushed when
+// they were emitted. When the code is a function body, the callee saved registers it writes, r7 as the
+// frame pointer included, are kept on the stack for the duration of the function. arg_addr, return and
+// tail_call are lowered to match. frame_clear becomes a few stores or a loop. Returns the frame size in
+// words.
+int frame_lower(InstructionVector *iv, bool use_frame_pointer, bool function);
+
+#endif // !FRAME_H
@@ -0,0 +1,270 @@
+#include <stdlib.h>
+#include <limits.h>
+#include "isel.h"
+#include "optimize.h"
+
+typedef struct
+{
+	Opcode opcode;
+	int cost;			// Cycles
+	int immediate_mask; // Bits of a value the immediate field can hold, 0 when there is no immediate
+} InstructionInfo;
+
+// Every instruction is one word and takes one cycle, so the cheapest sequence is also the shortest
+static const InstructionInfo g_instruction_table[] = {
+	{OPCODE_MOV, 1, 0},
+	{OPCODE_MOVI, 1, 0x00FF},
+	{OPCODE_MHI, 1, 0xFF00},
+	{OPCODE_ORI, 1, 0x00FF},
+	{OPCODE_ADDI, 1, 0x00FF},
+	{OPCODE_ADD, 1, 0},
+	{OPCODE_SUB, 1, 0},
+	{OPCODE_ADC, 1, 0},
+	{OPCODE_SBC, 1, 0},
+	{OPCODE_LDR, 1, 0},
+	{OPCODE_STR, 1, 0},
+	{OPCODE_PUSH, 1, 0},
+	{OPCODE_POP, 1, 0},
+	{OPCODE_CALL, 1, 0},
+	{OPCODE_RET, 1, 0},
+	{OPCODE_JMP, 1, 0},
+	{OPCODE_B, 1, 0},
+	{OPCODE_BZ, 1, 0},
+	{OPCODE_BNZ, 1, 0},
+	{OPCODE_BC, 1, 0},
+	{OPCODE_BNC, 1, 0},
+	{OPCODE_HALT, 1, 0},
+};
+
+#define SEQUENCE_MAX_LENGTH 4
+
+// A candidate sequence and what it costs
+typedef struct
+{
+	Instruction data[SEQUENCE_MAX_LENGTH];
+	int length;
+	int cost;
+} Sequence;
+
+static const InstructionInfo *instruction_info(Opcode opcode)
+{
+	for (int i = 0; i < (int)(sizeof(g_instruction_table) / sizeof(g_instruction_table[0])); i++)
+	{
+		if (g_instruction_table[i].opcode == opcode)
+			return &g_instruction_table[i];
+	}
+	return NULL;
+}
+
+int instruction_cost(Opcode opcode)
+{
+	const InstructionInfo *info = instruction_info(opcode);
+	return info ? info->cost : 0;
+}
+
+bool immediate_encodable(Opcode opcode, int value)
+{
+	const InstructionInfo *info = instruction_info(opcode);
+	return info && info->immediate_mask != 0 && (value & 0xFFFF & ~info->immediate_mask) == 0;
+}
+
+static void sequence_add(Sequence *sequence, Opcode opcode, int dst, int src, int immediate)
+{
+	Instruction instruction = {0};
+	instruction.opcode = opcode;
+	instruction.dst = dst;
+	instruction.src = src;
+	instruction.immediate = immediate;
+	sequence->data[sequence->length++] = instruction;
+	sequence->cost += instruction_cost(opcode);
+}
+
+static void keep_cheaper(Sequence *best, Sequence *candidate)
+{
+	if (candidate->cost < best->cost)
+		*best = *candidate;
+}
+
+static Sequence constant_sequence(int value, SelectionContext *context)
+{
+	Sequence best = {0};
+	best.cost = INT_MAX;
+	Sequence candidate = {0};
+	if (context && context->constants[0] == value)
+		return candidate;
+
+	if (immediate_encodable(OPCODE_MOVI, value))
+	{
+		candidate = (Sequence){0};
+		sequence_add(&candidate, OPCODE_MOVI, 0, 0, value);
+		keep_cheaper(&best, &candidate);
+	}
+	if (immediate_encodable(OPCODE_MHI, value))
+	{
+		candidate = (Sequence){0};
+		sequence_add(&candidate, OPCODE_MHI, 0, 0, value);
+		keep_cheaper(&best, &candidate);
+	}
+	candidate = (Sequence){0};
+	sequence_add(&candidate, OPCODE_MHI, 0, 0, value);
+	sequence_add(&candidate, OPCODE_ORI, 0, 0, value);
+	keep_cheaper(&best, &candidate);
+
+	if (!context)
+		return best;
+	for (int reg = 1; reg < REGISTER_COUNT; reg++)
+	{
+		if (reg == REGISTER_SP || context->constants[reg] != value)
+			continue;
+		candidate = (Sequence){0};
+		sequence_add(&candidate, OPCODE_MOV, 0, reg, 0);
+		keep_cheaper(&best, &candidate);
+	}
+	int delta = (value - context->constants[0]) & 0xFFFF;
+	if (context->carry_free && context->constants[0] != -1 && immediate_encodable(OPCODE_ADDI, delta))
+	{
+		candidate = (Sequence){0};
+		sequence_add(&candidate, OPCODE_ADDI, 0, 0, delta);
+		keep_cheaper(&best, &candidate);
+	}
+	return best;
+}
+
+static int sequence_emit(InstructionVector *iv, Sequence *sequence)
+{
+	for (int i = 0; i < sequence->length; i++)
+		instruction_vector_push(iv, &sequence->data[i]);
+	return sequence->cost;
+}
+
+int select_constant(InstructionVector *iv, int value, SelectionContext *context)
+{
+	Sequence best = constant_sequence(value & 0xFFFF, context);
+	return sequence_emit(iv, &best);
+}
+
+int select_offset(InstructionVector *iv, int base, int offset, SelectionContext *context)
+{
+	offset &= 0xFFFF;
+
+	// The base, then the offset added with addi
+	Sequence best = {0};
+	best.cost = INT_MAX;
+	if (offset == 0 || immediate_encodable(OPCODE_ADDI, offset))
+	{
+		best.cost = 0;
+		sequence_add(&best, OPCODE_MOV, 0, base, 0);
+		if (offset != 0)
+			sequence_add(&best, OPCODE_ADDI, 0, 0, offset);
+	}
+
+	// The constant first, then the base added to it
+	Sequence candidate = constant_sequence(offset, context);
+	sequence_add(&candidate, OPCODE_ADD, 0, base, 0);
+	keep_cheaper(&best, &candidate);
+	return sequence_emit(iv, &best);
+}
+
+// Updates the constants the registers hold after the instruction
+static void track_constants(SelectionContext *context, Instruction *instruction)
+{
+	int *constants = context->constants;
+	switch (instruction->opcode)
+	{
+	case OPCODE_MOV:
+		constants[instruction->dst] =
+			instruction->src == REGISTER_SP || instruction->dst == REGISTER_SP ? -1 : constants[instruction->src];
+		return;
+	case OPCODE_MOVI:
+		constants[0] = instruction->immediate & 0xFF;
+		return;
+	case OPCODE_MHI:
+		constants[0] = instruction->symbol ? -1 : instruction->immediate & 0xFF00;
+		return;
+	case OPCODE_ORI:
+		constants[0] = instruction->symbol || constants[0] == -1 ? -1 : constants[0] | (instruction->immediate & 0xFF);
+		return;
+	case OPCODE_ADDI:
+		constants[0] = constants[0] == -1 ? -1 : (constants[0] + instruction->immediate) & 0xFFFF;
+		return;
+	case OPCODE_LABEL:
+		// Reached from branches with other values in the registers
+		for (int reg = 0; reg < REGISTER_COUNT; reg++)
+			constants[reg] = -1;
+		return;
+	default:
+		for (int reg = 0; reg < REGISTER_COUNT; reg++)
+		{
+			if (instruction_writes_register(instruction, reg))
+				constants[reg] = -1;
+		}
+		return;
+	}
+}
+
+int select_constants(InstructionVector *iv)
+{
+	// Whether the carry may still be read after each instruction
+	int *live_after = register_liveness(iv);
+
+	SelectionContext context;
+	for (int reg = 0; reg < REGISTER_COUNT; reg++)
+		context.constants[reg] = -1;
+
+	InstructionVector selected;
+	instruction_vector_init(&selected, iv->length + 1);
+	int saved = 0;
+	for (int i = 0; i < iv->length; i++)
+	{
+		Instruction *instruction = &iv->data[i];
+
+		// A movi, or an mhi with the ori that completes it
+		int value = -1;
+		int length = 0;
+		if (instruction->opcode == OPCODE_MOVI)
+		{
+			value = instruction->immediate & 0xFF;
+			length = 1;
+		}
+		else if (instruction->opcode == OPCODE_MHI && !instruction->symbol)
+		{
+			value = instruction->immediate & 0xFF00;
+			length = 1;
+			Instruction *next = i + 1 < iv->length ? &iv->data[i + 1] : NULL;
+			if (next && next->opcode == OPCODE_ORI && !next->symbol)
+			{
+				value |= next->immediate & 0xFF;
+				length = 2;
+			}
+		}
+		if (length == 0)
+		{
+			instruction_vector_push(&selected, instruction);
+			track_constants(&context, instruction);
+			continue;
+		}
+
+		int original = 0;
+		for (int j = i; j < i + length; j++)
+			original += instruction_cost(iv->data[j].opcode);
+		context.carry_free = !(live_after[i + length - 1] & CARRY_BIT);
+		Sequence best = constant_sequence(value, &context);
+		if (best.cost < original)
+		{
+			sequence_emit(&selected, &best);
+			saved += original - best.cost;
+		}
+		else
+		{
+			for (int j = i; j < i + length; j++)
+				instruction_vector_push(&selected, &iv->data[j]);
+		}
+		context.constants[0] = value;
+		i += length - 1;
+	}
+
+	instruction_vector_free(iv);
+	*iv = selected;
+	free(live_after);
+	return saved;
+}
@@ -0,0 +1,30 @@
+#ifndef ISEL_H
+#define ISEL_H
+#include "emit.h"
+
+// What the selector may rely on when picking a sequence
+typedef struct
+{
+	int constants[REGISTER_COUNT]; // The constant each register holds, or -1
+	bool carry_free;			   // Whether the carry may be overwritten
+} SelectionContext;
+
+// Cost of the instruction in cycles
+int instruction_cost(Opcode opcode);
+
+// Whether value fits the immediate field of the instruction
+bool immediate_encodable(Opcode opcode, int value);
+
+// Appends the cheapest sequence that loads value into r0 to iv. Depending on the value that is a movi, a
+// lone mhi when the low byte is zero or an mhi/ori pair. With a context it may also reuse a register that
+// holds the value or adjust r0 with addi. context may be NULL when nothing is known. Returns the cost.
+int select_constant(InstructionVector *iv, int value, SelectionContext *context);
+
+// Appends the cheapest sequence for r0 = base + offset to iv, base must not be r0. Returns the cost.
+int select_offset(InstructionVector *iv, int base, int offset, SelectionContext *context);
+
+// Selects every constant load of the lowered code again, now that it is known which constants the
+// registers hold and where the carry is dead. Returns the number of instructions saved.
+int select_constants(InstructionVector *iv);
+
+#endif // !ISEL_H
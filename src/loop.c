@@ -0,0 +1,225 @@
+#include <stdlib.h>
+#include <string.h>
+#include "loop.h"
+#include "optimize.h"
+
+#define LOOP_FIRST_REGISTER 5 // r5 and r6 hold hoisted values, r7 may be the frame pointer
+#define LOOP_REGISTER_COUNT 2
+
+// The instructions from header to latch, the branch back to header, and where code that runs before the
+// loop is inserted
+typedef struct
+{
+	int header;
+	int latch;
+	int preheader;
+} Loop;
+
+// A value computed inside the loop, an mhi/ori pair or a frame_addr
+typedef struct
+{
+	int first; // Position of the first computation
+	int length;
+	int count; // Computations of the value in the loop
+} Invariant;
+
+static bool same_invariant(Instruction *a, Instruction *b)
+{
+	if (a->opcode != b->opcode)
+		return false;
+	if (a->opcode == OPCODE_FRAME_ADDR)
+		return FRAME_ADDR_SLOT(a) == FRAME_ADDR_SLOT(b);
+	if (a->symbol || b->symbol)
+		return a->symbol && b->symbol && !strcmp(a->symbol, b->symbol) && !strcmp(a[1].symbol, b[1].symbol);
+	return !a[1].symbol && !b[1].symbol && (a->immediate & 0xFF00) == (b->immediate & 0xFF00) &&
+		   (a[1].immediate & 0xFF) == (b[1].immediate & 0xFF);
+}
+
+// The length of the invariant computation at position, 0 if there is none
+static int invariant_length(InstructionVector *iv, int position, int end)
+{
+	Instruction *instruction = &iv->data[position];
+	if (instruction->opcode == OPCODE_FRAME_ADDR)
+		return 1;
+	if (instruction->opcode == OPCODE_MHI && position + 1 <= end && iv->data[position + 1].opcode == OPCODE_ORI &&
+		!instruction->symbol == !iv->data[position + 1].symbol)
+		return 2;
+	return 0;
+}
+
+// Whether an instruction in the range names the register
+static bool register_referenced(InstructionVector *iv, int start, int end, int reg)
+{
+	for (int i = start; i <= end; i++)
+	{
+		Instruction *instruction = &iv->data[i];
+		if (instruction_writes_register(instruction, reg) ||
+			((instruction->dst == reg || instruction->src == reg) && (instruction_uses(instruction) & (1 << reg))))
+			return true;
+	}
+	return false;
+}
+
+// Whether the loop can only be entered through its preheader
+static bool single_entry(InstructionVector *iv, int *labels, Loop *loop)
+{
+	for (int i = 0; i < iv->length; i++)
+	{
+		Instruction *instruction = &iv->data[i];
+		if (!instruction_is_branch(instruction) || (i >= loop->header && i <= loop->latch) || i == loop->preheader)
+			continue;
+		int target = labels[instruction->immediate];
+		if (target >= loop->header && target <= loop->latch)
+			return false;
+	}
+	return true;
+}
+
+// Finds the loop with the earliest header, the outermost one when loops share it, that starts at or after
+// from. Returns false when there is none.
+static bool find_loop(InstructionVector *iv, int *labels, int from, Loop *loop)
+{
+	loop->header = -1;
+	loop->latch = -1;
+	for (int i = 0; i < iv->length; i++)
+	{
+		Instruction *instruction = &iv->data[i];
+		if (!instruction_is_branch(instruction))
+			continue;
+		int target = labels[instruction->immediate];
+		if (target == -1 || target > i || target < from)
+			continue;
+		if (loop->header == -1 || target < loop->header || (target == loop->header && i > loop->latch))
+		{
+			loop->header = target;
+			loop->latch = i;
+		}
+	}
+	if (loop->header == -1)
+		return false;
+
+	// Rotated loops are entered with a b to their condition
+	loop->preheader = loop->header;
+	Instruction *previous = loop->header > 0 ? &iv->data[loop->header - 1] : NULL;
+	if (previous && previous->opcode == OPCODE_B && labels[previous->immediate] > loop->header &&
+		labels[previous->immediate] <= loop->latch)
+		loop->preheader = loop->header - 1;
+	return true;
+}
+
+// The invariant computed most often in the loop, returns false when there is none
+static bool best_invariant(InstructionVector *iv, Loop *loop, Invariant *best)
+{
+	best->count = 0;
+	for (int i = loop->header; i <= loop->latch; i++)
+	{
+		int length = invariant_length(iv, i, loop->latch);
+		if (length == 0)
+			continue;
+		Invariant candidate = {i, length, 0};
+		for (int j = i; j <= loop->latch; j++)
+		{
+			int other = invariant_length(iv, j, loop->latch);
+			if (other == length && same_invariant(&iv->data[i], &iv->data[j]))
+			{
+				candidate.count++;
+				j += other - 1;
+			}
+		}
+		if (candidate.count > best->count)
+			*best = candidate;
+		i += length - 1;
+	}
+	return best->count > 0;
+}
+
+static void hoist(InstructionVector *iv, Loop *loop, Invariant *invariant, int reg)
+{
+	Instruction *computation = malloc(sizeof(Instruction) * invariant->length);
+	memcpy(computation, &iv->data[invariant->first], sizeof(Instruction) * invariant->length);
+	int depth = iv->data[loop->header].depth;
+
+	InstructionVector hoisted;
+	instruction_vector_init(&hoisted, iv->length + invariant->length + 2);
+	bool r0_holds = false; // r0 still holds the value since the last mov from reg
+	for (int i = 0; i < iv->length; i++)
+	{
+		if (i == loop->preheader)
+		{
+			for (int j = 0; j < invariant->length; j++)
+			{
+				Instruction instruction = computation[j];
+				instruction.depth = depth;
+				instruction_vector_push(&hoisted, &instruction);
+			}
+			Instruction mov = {0};
+			mov.opcode = OPCODE_MOV;
+			mov.dst = reg;
+			mov.depth = depth;
+			instruction_vector_push(&hoisted, &mov);
+		}
+		int length = i >= loop->header && i <= loop->latch ? invariant_length(iv, i, loop->latch) : 0;
+		if (length == invariant->length && same_invariant(computation, &iv->data[i]))
+		{
+			Instruction mov = {0};
+			mov.opcode = OPCODE_MOV;
+			mov.src = reg;
+			mov.depth = iv->data[i].depth;
+			if (!r0_holds)
+				instruction_vector_push(&hoisted, &mov);
+			r0_holds = true;
+			i += length - 1;
+			continue;
+		}
+		instruction_vector_push(&hoisted, &iv->data[i]);
+		if (instruction_writes_register(&iv->data[i], 0) || iv->data[i].opcode == OPCODE_LABEL)
+			r0_holds = false;
+	}
+	free(computation);
+	instruction_vector_free(iv);
+	*iv = hoisted;
+}
+
+// Hoists one invariant out of the first loop that has one and a register for it. Returns false when no
+// loop does.
+static bool hoist_one(InstructionVector *iv)
+{
+	int label_count;
+	int *labels = label_positions(iv, &label_count);
+	int *live_after = register_liveness(iv);
+	bool hoisted = false;
+	Loop loop;
+	for (int start = 0; !hoisted && find_loop(iv, labels, start, &loop); start = loop.header + 1)
+	{
+		Invariant invariant;
+		if (!single_entry(iv, labels, &loop) || !best_invariant(iv, &loop, &invariant))
+			continue;
+
+		// The computation clobbers r0, and the carry for a frame_addr, in front of the loop
+		int clobbered = (1 << 0) | (iv->data[invariant.first].opcode == OPCODE_FRAME_ADDR ? CARRY_BIT : 0);
+		if (live_after[loop.preheader] & clobbered)
+			continue;
+		for (int reg = LOOP_FIRST_REGISTER; reg < LOOP_FIRST_REGISTER + LOOP_REGISTER_COUNT; reg++)
+		{
+			if ((live_after[loop.preheader] & (1 << reg)) ||
+				register_referenced(iv, loop.preheader, loop.latch, reg))
+				continue;
+			hoist(iv, &loop, &invariant, reg);
+			hoisted = true;
+			break;
+		}
+	}
+	free(labels);
+	free(live_after);
+	return hoisted;
+}
+
+int hoist_loop_invariants(InstructionVector *iv)
+{
+	// Every hoist moves a computation out of at least one loop, so this ends. Computations hoisted in front
+	// of an inner loop can be hoisted again out of the loops around it.
+	int hoisted = 0;
+	while (hoist_one(iv))
+		hoisted++;
+	return hoisted;
+}
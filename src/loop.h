@@ -0,0 +1,14 @@
+#ifndef LOOP_H
+#define LOOP_H
+#include "emit.h"
+
+// Loop invariant code motion. Loops are found from their back edges, a branch to a label before it, and
+// only loops that are entered through their first label or the b that jumps into a rotated loop are
+// touched. Frame addresses and mhi/ori constants computed inside a loop are computed once in front of it
+// into a callee saved register, r5 or r6, and every computation in the loop becomes a mov from it. A
+// register is only used when nothing else reads or writes it across the loop. Outer loops are handled
+// first. Runs before frame lowering, which saves the registers in functions that use them.
+// Returns the number of values hoisted.
+int hoist_loop_invariants(InstructionVector *iv);
+
+#endif // !LOOP_H
@@ -2,6 +2,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include "tokenize.h"
+#include "emit.h"
+#include "frame.h"
+#include "optimize.h"
+#include "ssa.h"
+#include "isel.h"
+#include "outline.h"
+#include "pass.h"
+#include "eval.h"
+#include "emulator.h"
+#include "translate.h"
+#include "runtime.h"
 
 typedef enum
 {
@@ -10,12 +21,20 @@ typedef enum
 	DIRECTIVE_ADD,
 	DIRECTIVE_SUB,
 	DIRECTIVE_MUL,
+	DIRECTIVE_EQUAL,
+	DIRECTIVE_NOT_EQUAL,
+	DIRECTIVE_LESS,
+	DIRECTIVE_LESS_EQUAL,
+	DIRECTIVE_GREATER,
+	DIRECTIVE_GREATER_EQUAL,
 	DIRECTIVE_REF,
 	DIRECTIVE_DEREF,
 	DIRECTIVE_ASSIGN,
 	DIRECTIVE_CALL,
+	DIRECTIVE_RETURN,
 	DIRECTIVE_COMMA,
 	DIRECTIVE_OPEN_PAREN,
+	DIRECTIVE_OPEN_BRACKET,
 	DIRECTIVE_VARIABLE,
 	DIRECTIVE_ADDRESS,
 	DIRECTIVE_INT
@@ -27,7 +46,9 @@ typedef enum
 	PRIMITIVE_TYPE_VOID,
 	PRIMITIVE_TYPE_U16,
 	PRIMITIVE_TYPE_I16,
-	PRIMITIVE_TYPE_STRUCT
+	PRIMITIVE_TYPE_STRUCT,
+	PRIMITIVE_TYPE_U32,
+	PRIMITIVE_TYPE_I32
 } PrimitiveType;
 
 typedef struct TypeDescriptor TypeDescriptor;
@@ -61,6 +82,7 @@ struct StructDescriptorEntry
 	const char *entry_name;
 	int offset;
 	int pointer_count;
+	int array_length; // Elements of an array field, 0 for other fields
 };
 
 typedef struct
@@ -77,8 +99,14 @@ typedef struct
 	TypeDescriptor *type_descriptor;
 	int ref_count; // The number of times we need to defref this to get to it's value
 	int location; // Whether this var lives in the token(0), the stack(1), or in a register(2)
-	int address;  // A stack relative address or a register number
+	int address;  // The first frame slot or a register number
 	int pointer_count; // The number of stars if this directive represents a number (eg. u16** has pointer_count of 2)
+	int array_length;  // Elements of an array variable, 0 for everything else
+	int offset;		   // Word of the frame object at address where the value starts, for array elements
+	int object_size;   // Words of that frame object when the value is only part of it, 0 otherwise
+	const char *symbol; // Set for globals, which live at the symbol instead of in the frame
+	bool untyped;		// Computed only from comparisons and untyped literals, fits any one word integer
+	bool typed;			// A literal that keeps its declared type, like the folded result of a call
 } Directive;
 
 typedef struct
@@ -91,28 +119,139 @@ typedef struct
 {
 	Token *token;
 	TypeDescriptor *type_descriptor;
-	int address; // Stack pointer relative address
+	int address; // First frame slot
 	int scope;	 // What scope this var is in
 	int pointer_count;
+	int ref_count;	// 1 for struct parameters passed by reference, the slot holds their address
+	Token *literal; // Set for parameters of an inlined call that are bound to a literal argument
+	int array_length; // Elements of an array, 0 for other variables
+	const char *symbol; // Set for globals, the symbol of their address
 } ProgramVariable;
 
 typedef struct
 {
 	ProgramVariable *data;
 	int length;
-	int stack_size;
+	int stack_size; // Words pushed for call arguments
+	int frame_size; // Frame slots handed out to variables and temporaries
 	int scope_counter;
 } ProgramVariableStack;
 
+#define FUNCTION_MAX_PARAMETERS 16
+#define STRUCT_REFERENCE_WORDS 2 // Struct arguments wider than this are passed by reference
+#define ZERO_STORE_MAX_WORDS 8	 // Larger declarations are zeroed with a frame_clear instead of one store per word
+
+// Names of the functions a piece of code calls, each one once
+typedef struct
+{
+	const char **data;
+	int length;
+	int capacity;
+} CalleeVector;
+
+typedef struct
+{
+	Token *token;
+	TypeDescriptor *return_type;
+	int return_pointer_count;
+	ProgramVariable parameters[FUNCTION_MAX_PARAMETERS];
+	bool parameter_written[FUNCTION_MAX_PARAMETERS]; // Assigned or address taken somewhere in the body
+	int parameter_count;
+	TokenVector *tokens;
+	int body_start; // Token range of the statements in the body
+	int body_end;
+	bool inlinable;
+	int inline_size;	// Instructions of the body after optimization
+	bool takes_address; // A local may be referenced through a pointer, so calls can't outlive the frame
+	int result_address; // Slot holding the address a struct result is written to, -1 for register results
+	CalleeVector callees; // Calls left in the code after evaluation and inlining, including undefined functions
+	InstructionVector instructions;
+} Function;
+
+typedef struct
+{
+	Function *data;
+	int length;
+	int capacity;
+} FunctionVector;
+
+typedef struct
+{
+	ProgramVariable variable;
+	int size;	 // Words
+	int *values; // Initial value of every word, NULL when they all start out zero
+} GlobalVariable;
+
+typedef struct
+{
+	GlobalVariable *data;
+	int length;
+	int capacity;
+} GlobalVariableVector;
+
+// While a call is inlined its return statement produces result instead of returning
+typedef struct InlineSite InlineSite;
+struct InlineSite
+{
+	Function *function;
+	Directive result;
+	InlineSite *parent; // The call this one was inlined into
+};
+
+#define INLINE_DEFAULT_THRESHOLD 8
+#define INLINE_CALL_OVERHEAD 4	 // mhi, ori, call and ret
+#define INLINE_LITERAL_BONUS 2	 // Folding a literal argument usually saves loading and storing it
+#define INLINE_MAX_DEPTH 8
+
+#define LOOP_MAX_PRODUCTS 4	  // Products of the induction variable a for loop keeps up to date
+#define PRODUCT_UPDATE_COST 4 // Loading a product, adding the step and storing it back
+
+// A product of the induction variable of a for loop and a constant, kept in a slot of its own
+typedef struct
+{
+	int variable; // Slot of the induction variable
+	int factor;
+	int step; // Added after every step of the loop
+	int address;
+} InductionProduct;
+
+typedef struct LoopScope LoopScope;
+struct LoopScope
+{
+	InductionProduct products[LOOP_MAX_PRODUCTS];
+	int product_count;
+	LoopScope *parent; // The for loop this one is nested in
+};
+
+typedef struct
+{
+	const char *source_path;
+	int inline_threshold; // Calls are inlined when the estimated growth in instructions is at most this
+	bool whole_program;	  // Nothing but the entry code calls into the program, so unreachable functions go
+	bool run;			  // Run the compiled program in the emulator and report what it took
+	bool translate;		  // Run it by translating it to host code instead of interpreting it
+	const char *cycle_table_path; // Cycles per instruction for the emulator, NULL for the defaults
+	long long run_limit;		  // Instructions the emulator executes before it gives up
+	PassOptions passes;	  // Optimization level and what the pass manager reports
+} CompilerOptions;
+
 TypeDescriptorVector g_tdv;
+CompilerOptions g_options;
+FunctionVector g_functions;
+GlobalVariableVector g_globals;
+CalleeVector g_entry_callees; // Functions the top level code calls
+Function *g_current_function; // The function being compiled, NULL for top level code
+InlineSite *g_inline_site;	  // The call being inlined, NULL when compiling code normally
+int g_inline_depth;
+bool g_tail_position; // The call about to be compiled is the whole value of a return statement
+LoopScope *g_loop;	  // The for loop whose body is being compiled, NULL outside of for loops
 
 void sdev_push(StructDescriptorEntryVector *vector, StructDescriptorEntry *entry)
 {
-	if(vector->length == vector->capacity)
+	if (vector->length == vector->capacity)
 	{
-		//TODO: implement this
-		puts("StructDescriptorEntryVector full!");
-		return;
+		vector->capacity = vector->capacity * 2 + 4;
+		vector->data = realloc(vector->data, sizeof(StructDescriptorEntry) * vector->capacity);
 	}
 
 	vector->data[vector->length] = *entry;
@@ -179,6 +318,22 @@ TypeDescriptor *get_type_by_name(TypeDescriptorVector *tdv, Token *name_token)
 		desc.size = 1;
 		return &desc;
 	}
+	if(name_token->type == TOKEN_TYPE_U32)
+	{
+		static TypeDescriptor desc = {0};
+		desc.primitive_type = PRIMITIVE_TYPE_U32;
+		desc.type_name = "u32";
+		desc.size = 2;
+		return &desc;
+	}
+	if(name_token->type == TOKEN_TYPE_I32)
+	{
+		static TypeDescriptor desc = {0};
+		desc.primitive_type = PRIMITIVE_TYPE_I32;
+		desc.type_name = "i32";
+		desc.size = 2;
+		return &desc;
+	}
 	if(name_token->type == TOKEN_TYPE_VOID)
 	{
 		static TypeDescriptor desc = {0};
@@ -206,19 +361,95 @@ ProgramVariable *prog_var_stack_find(ProgramVariableStack *stack, const char *na
 	return NULL;
 }
 
+void function_vector_push(FunctionVector *vector, Function *function)
+{
+	if (vector->length == vector->capacity)
+	{
+		vector->capacity = vector->capacity * 2 + 4;
+		vector->data = realloc(vector->data, sizeof(Function) * vector->capacity);
+	}
+	vector->data[vector->length] = *function;
+	vector->length++;
+}
+
+void global_vector_push(GlobalVariableVector *vector, GlobalVariable *global)
+{
+	if (vector->length == vector->capacity)
+	{
+		vector->capacity = vector->capacity * 2 + 4;
+		vector->data = realloc(vector->data, sizeof(GlobalVariable) * vector->capacity);
+	}
+	vector->data[vector->length] = *global;
+	vector->length++;
+}
+
+ProgramVariable *global_find(GlobalVariableVector *vector, const char *name)
+{
+	for (int i = 0; i < vector->length; i++)
+	{
+		if (!strcmp(vector->data[i].variable.token->name, name))
+			return &vector->data[i].variable;
+	}
+	return NULL;
+}
+
+StructDescriptorEntry *struct_entry_find(StructDescriptor *descriptor, const char *name)
+{
+	for (int i = 0; i < descriptor->entries.length; i++)
+	{
+		if (!strcmp(descriptor->entries.data[i].entry_name, name))
+			return &descriptor->entries.data[i];
+	}
+	return NULL;
+}
+
+void callee_vector_add(CalleeVector *vector, const char *name)
+{
+	for (int i = 0; i < vector->length; i++)
+	{
+		if (!strcmp(vector->data[i], name))
+			return;
+	}
+	if (vector->length == vector->capacity)
+	{
+		vector->capacity = vector->capacity * 2 + 4;
+		vector->data = realloc(vector->data, sizeof(const char *) * vector->capacity);
+	}
+	vector->data[vector->length++] = name;
+}
+
+Function *function_find(FunctionVector *vector, const char *name)
+{
+	for (int i = 0; i < vector->length; i++)
+	{
+		if (!strcmp(vector->data[i].token->name, name))
+			return &vector->data[i];
+	}
+	return NULL;
+}
+
+#define COMPARISON_PRECEDENCE 2
+
 int directive_type_precedence(DirectiveType type)
 {
 	switch (type)
 	{
 	case DIRECTIVE_VAR:
 	case DIRECTIVE_ASSIGN:
+	case DIRECTIVE_RETURN:
 		return 1;
 
 	case DIRECTIVE_COMMA:
 		return 0;
 
-	case DIRECTIVE_REF:
-	case DIRECTIVE_DEREF:
+	case DIRECTIVE_EQUAL:
+	case DIRECTIVE_NOT_EQUAL:
+	case DIRECTIVE_LESS:
+	case DIRECTIVE_LESS_EQUAL:
+	case DIRECTIVE_GREATER:
+	case DIRECTIVE_GREATER_EQUAL:
+		return COMPARISON_PRECEDENCE;
+
 	case DIRECTIVE_ADD:
 	case DIRECTIVE_SUB:
 		return 3;
@@ -226,6 +457,9 @@ int directive_type_precedence(DirectiveType type)
 	case DIRECTIVE_MUL:
 		return 4;
 
+	// Unary operators bind tighter than any binary one
+	case DIRECTIVE_REF:
+	case DIRECTIVE_DEREF:
 	case DIRECTIVE_CALL:
 		return 5;
 
@@ -257,6 +491,9 @@ int directive_width(Directive *directive)
 		case PRIMITIVE_TYPE_U16:
 		case PRIMITIVE_TYPE_I16:
 		return 1;
+		case PRIMITIVE_TYPE_U32:
+		case PRIMITIVE_TYPE_I32:
+		return 2;
 		case PRIMITIVE_TYPE_VOID:
 		return 0;
 	}
@@ -264,887 +501,3433 @@ int directive_width(Directive *directive)
 	return 0;
 }
 
-void load_sprelative_addr(int addr)
+// The number of stack words the directive's own slot occupies
+int directive_storage_size(Directive *directive)
+{
+	if (directive->object_size > 0)
+		return directive->object_size;
+	if (directive->ref_count > 0 || directive->pointer_count > 0 || directive->type_descriptor->pointer_count > 0)
+		return 1;
+	if (directive->type_descriptor->size == 0)
+		return 1;
+	return directive->type_descriptor->size;
+}
+
+// Whether the directive is a temporary of width words that fills its whole frame object, so its slots can
+// be taken over instead of copied. A member of a temporary is only part of the object.
+bool directive_is_whole_temporary(Directive *directive, int width)
+{
+	return directive->location == 1 && directive->ref_count == 0 && directive->offset == 0 &&
+		   (directive->object_size == 0 || directive->object_size == width) && directive_width(directive) == width;
+}
+
+// Loads the address of word offset of the stack object at address into r0
+void load_slot_addr(int address, int offset, int size, int stack_size)
+{
+	emit_frame_addr(address, offset, size, stack_size);
+}
+
+// Loads the address of word of the value held in the directive's frame object, or at its symbol for
+// globals, into r0
+void load_directive_word_addr(Directive *directive, int word, int stack_size)
 {
-	if(addr <= 255)
+	if (directive->symbol)
 	{
-		puts("mov sp, r0");
-		printf("addi #%d\n", addr);
+		// The offset goes into the symbol, so the address is still a single mhi/ori pair
+		const char *symbol = directive->symbol;
+		int offset = directive->offset + word;
+		if (offset != 0)
+		{
+			int length = snprintf(NULL, 0, "%s+%d", symbol, offset);
+			char *name = malloc(length + 1);
+			snprintf(name, length + 1, "%s+%d", symbol, offset);
+			symbol = name;
+		}
+		emit_mhi_symbol(symbol);
+		emit_ori_symbol(symbol);
 		return;
 	}
-	printf("mhi HI(#%d)\n", addr);
-	printf("ori LO(#%d)\n", addr);
-	puts("add r0, sp");
+	load_slot_addr(directive->address, directive->offset + word, directive_storage_size(directive), stack_size);
 }
 
-void copy_directive_value(Directive *dst, Directive *src, int stack_size)
+void load_directive_addr(Directive *directive, int stack_size)
 {
-	load_sprelative_addr(stack_size - dst->address);
-	for(int i = 0; i < dst->ref_count; i++)
+	load_directive_word_addr(directive, 0, stack_size);
+}
+
+// Makes the directive name the whole frame object at address
+void directive_set_slot(Directive *directive, int address)
+{
+	directive->address = address;
+	directive->offset = 0;
+	directive->object_size = 0;
+	directive->symbol = NULL;
+}
+
+// Reserves size words in the function's frame for a variable or temporary and returns its first slot
+int frame_alloc(ProgramVariableStack *pvs, int size)
+{
+	int address = pvs->frame_size;
+	pvs->frame_size += size > 0 ? size : 1;
+	return address;
+}
+
+// Loads a constant into r0
+void load_constant(int value)
+{
+	select_constant(g_emit_target, value, NULL);
+}
+
+bool directive_is_literal(Directive *directive)
+{
+	return directive->location == 0 && directive->type == DIRECTIVE_INT;
+}
+
+bool directive_is_untyped_literal(Directive *directive)
+{
+	return directive_is_literal(directive) && !directive->typed;
+}
+
+// Literals take on whatever integer type they are combined with unless they keep a declared type, and so do
+// the results of comparisons and of arithmetic on them
+bool directive_takes_type(Directive *directive)
+{
+	return directive->untyped || directive_is_untyped_literal(directive);
+}
+
+// The number of pointer levels left after the derefs applied to the directive
+int directive_pointer_level(Directive *directive)
+{
+	return directive->pointer_count + directive->type_descriptor->pointer_count;
+}
+
+// The number of words a pointer directive steps over when 1 is added to it
+int directive_pointee_size(Directive *directive)
+{
+	if (directive_pointer_level(directive) > 1 || directive->type_descriptor->size == 0)
+		return 1;
+	return directive->type_descriptor->size;
+}
+
+bool directive_is_integer(Directive *directive)
+{
+	if (directive_pointer_level(directive) > 0)
+		return false;
+	switch (directive->type_descriptor->primitive_type)
+	{
+	case PRIMITIVE_TYPE_U16:
+	case PRIMITIVE_TYPE_I16:
+	case PRIMITIVE_TYPE_U32:
+	case PRIMITIVE_TYPE_I32:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Two word integers, the low word is stored first
+bool directive_is_wide(Directive *directive)
+{
+	if (directive_pointer_level(directive) > 0)
+		return false;
+	return directive->type_descriptor->primitive_type == PRIMITIVE_TYPE_U32 ||
+		   directive->type_descriptor->primitive_type == PRIMITIVE_TYPE_I32;
+}
+
+// Whether a value of type rvalue can be stored in lvalue
+bool directive_types_compatible(Directive *lvalue, Directive *rvalue)
+{
+	if ((directive_is_untyped_literal(rvalue) && directive_is_integer(lvalue)) ||
+		(directive_is_untyped_literal(lvalue) && directive_is_integer(rvalue)))
+		return true;
+	if ((rvalue->untyped && directive_is_integer(lvalue) && !directive_is_wide(lvalue)) ||
+		(lvalue->untyped && directive_is_integer(rvalue) && !directive_is_wide(rvalue)))
+		return true;
+	return lvalue->type_descriptor->primitive_type == rvalue->type_descriptor->primitive_type &&
+		   lvalue->type_descriptor->pointer_count == rvalue->type_descriptor->pointer_count &&
+		   lvalue->pointer_count == rvalue->pointer_count;
+}
+
+// Loads both words of a two word integer into registers, literals are widened
+void load_wide_value(Directive *directive, int low_reg, int high_reg, int stack_size)
+{
+	if (directive_is_literal(directive))
+	{
+		load_constant(directive->token->int_literal);
+		emit_mov(low_reg, 0);
+		load_constant(directive->token->int_literal >> 16);
+		emit_mov(high_reg, 0);
+		return;
+	}
+
+	if (directive->ref_count == 0)
+	{
+		load_directive_word_addr(directive, 0, stack_size);
+		emit_ldr(low_reg, 0);
+		load_directive_word_addr(directive, 1, stack_size);
+		emit_ldr(high_reg, 0);
+		return;
+	}
+
+	load_directive_addr(directive, stack_size);
+	for (int i = 0; i < directive->ref_count; i++)
 	{
-		puts("ldr r0, r0");
+		emit_ldr(0, 0);
 	}
-	puts("mov r1, r0");
+	emit_ldr(low_reg, 0);
+	emit_addi(1);
+	emit_ldr(high_reg, 0);
+}
 
-	if(src->location == 0)
+void copy_directive_value(Directive *dst, Directive *src, int stack_size)
+{
+	// Two word integers go through registers instead of the word copy loop
+	if (directive_is_wide(dst))
 	{
-		if(src->type == DIRECTIVE_INT)
+		load_wide_value(src, 2, 3, stack_size);
+		if (dst->ref_count == 0)
 		{
-			printf("mhi HI(#%d)\n", src->token->int_literal);
-			printf("ori LO(#%d)\n", src->token->int_literal);
-			puts("str r1, r0");
+			load_directive_word_addr(dst, 0, stack_size);
+			emit_str(0, 2);
+			load_directive_word_addr(dst, 1, stack_size);
+			emit_str(0, 3);
 			return;
 		}
-		if(src->type == DIRECTIVE_VARIABLE)
+		load_directive_addr(dst, stack_size);
+		for (int i = 0; i < dst->ref_count; i++)
 		{
-			load_sprelative_addr(stack_size - src->address);
-			for(int i = 0; i < src->ref_count; i++)
-			{
-				puts("ldr r0, r0");
-			}
-			puts("mov r2, r0");
+			emit_ldr(0, 0);
 		}
+		emit_str(0, 2);
+		emit_addi(1);
+		emit_str(0, 3);
+		return;
 	}
-	if(src->location == 1)
+
+	// Words of frame objects are addressed one by one, which keeps every access to an exact slot
+	if (dst->ref_count == 0 && src->ref_count == 0 && !(src->location == 0 && src->type == DIRECTIVE_INT))
 	{
-		load_sprelative_addr(stack_size - src->address);
-		for (int i = 0; i < src->ref_count; i++)
+		int size = directive_width(src);
+		for (int i = 0; i < size; i++)
 		{
-			puts("ldr r0, r0");
+			load_directive_word_addr(src, i, stack_size);
+			emit_ldr(1, 0);
+			load_directive_word_addr(dst, i, stack_size);
+			emit_str(0, 1);
 		}
-		puts("mov r2, r0");
+		return;
+	}
+
+	load_directive_addr(dst, stack_size);
+	for(int i = 0; i < dst->ref_count; i++)
+	{
+		emit_ldr(0, 0);
+	}
+	emit_mov(1, 0);
+
+	if(src->location == 0 && src->type == DIRECTIVE_INT)
+	{
+		load_constant(src->token->int_literal);
+		emit_str(1, 0);
+		return;
+	}
+
+	load_directive_addr(src, stack_size);
+	for(int i = 0; i < src->ref_count; i++)
+	{
+		emit_ldr(0, 0);
 	}
+	emit_mov(2, 0);
 
 	int size = directive_width(src);
 	for(int i = 0; i < size; i++)
 	{
-		puts("ldr r0, r2");
-		puts("str r1, r0");
-		puts("movi #1");
-		puts("add r1, r0");
-		puts("add r2, r0");
+		emit_ldr(0, 2);
+		emit_str(1, 0);
+		emit_movi(1);
+		emit_add(1, 0);
+		emit_add(2, 0);
 	}
 
 }
 
-//Copies the value at sp+src to the address in register dst; clobbers dst
-void copy_value_to_reg_ptr(int dst, int src, int size)
+// Loads the one word value of the directive into reg
+void load_directive_value(Directive *directive, int reg, int stack_size)
 {
-	int src_reg = dst == 1 ? 2 : 1;
-	puts("mov r0, sp");
-	printf("addi #%d\n", src);
-	printf("mov r0, %d\n", src_reg);
+	if (directive_is_literal(directive))
+	{
+		load_constant(directive->token->int_literal);
+		emit_mov(reg, 0);
+		return;
+	}
 
-	for(int i = 0; i < size; i++)
+	load_directive_addr(directive, stack_size);
+	emit_ldr(reg, 0);
+	for (int i = 0; i < directive->ref_count; i++)
 	{
-		printf("ldr r0, r%d\n", src_reg);
-		printf("str r0, r%d\n", dst);
-		puts("movi #1");
-		printf("add r%d, r0\n", dst);
-		printf("add r%d, r0\n", src_reg);
+		emit_ldr(reg, reg);
 	}
 }
 
-//Copies a value of width size from sp+src to sp+dst
-void copy_value_sprelative(int dst, int src, int size)
+// Writes the positive value in non-adjacent form, the signed binary representation with the fewest non-zero
+// digits, least significant digit first. The top digit is always 1. Returns the number of digits.
+int non_adjacent_form(int value, int *digits)
 {
-	if(size == 0) return;
-	if(dst <= 255 && src <= 255)
+	int digit_count = 0;
+	while (value != 0)
 	{
-		if(size == 1)
-		{
-			puts("push r1");
-			puts("mov r0, sp");
-			printf("addi #%d\n", src + 1);
-			puts("ldr r1, r0");
-			puts("mov r0, sp");
-			printf("addi #%d\n", dst + 1);
-			puts("str r0, r1");
-			puts("pop r1");
-			return;
-		}
+		int digit = 0;
+		if (value & 1)
+			digit = 2 - (value & 3);
+		value = (value - digit) / 2;
+		digits[digit_count++] = digit;
 	}
-	puts("push r1");
-	puts("push r2");
-
-	puts("mov sp, r0");
-	printf("addi #%d\n", dst + 2);
-	puts("mov r1, r0");
-	puts("mov sp, r0");
-	printf("addi #%d\n", src + 2);
-	puts("mov r2, r0");
+	return digit_count;
+}
 
-	for(int i = 0; i < size; i++)
+// The number of instructions emit_multiply_constant needs for the constant
+int multiply_constant_cost(int constant)
+{
+	int value = (int16_t)constant;
+	int cost = value < 0 ? 3 : 0;
+	if (value < 0)
+		value = -value;
+	if (value == 0)
+		return 2;
+	int digits[18];
+	int digit_count = non_adjacent_form(value, digits);
+	bool needs_original = false;
+	for (int i = digit_count - 2; i >= 0; i--)
 	{
-		puts("ldr r0, r2");
-		puts("str r1, r0");
-		puts("movi #1");
-		puts("add r1, r0");
-		puts("add r2, r0");
+		cost += digits[i] != 0 ? 2 : 1;
+		needs_original |= digits[i] != 0;
 	}
-
-	puts("pop r2");
-	puts("pop r1");
+	return cost + (needs_original ? 1 : 0);
 }
 
-void compile_add(Directive *lvalue_directive, Directive *rvalue_directive, ProgramVariableStack *local_var_stack)
+// Multiplies reg by a constant without a multiply instruction. The constant is written in non-adjacent
+// form and evaluated from the top digit down: each digit doubles the product and a digit of 1 or -1 adds
+// or subtracts the original value kept in scratch. Negative constants also use r0.
+void emit_multiply_constant(int reg, int scratch, int constant)
 {
-	int lvalue_width = directive_width(lvalue_directive);
-	int rvalue_width = directive_width(rvalue_directive);
-	if (lvalue_width > 1 || rvalue_width > 1)
+	int value = (int16_t)constant;
+	bool negate = value < 0;
+	if (negate)
+		value = -value;
+	if (value == 0)
 	{
-		puts("Adding types larger than 1 word is not yet supported!");
+		emit_movi(0);
+		emit_mov(reg, 0);
 		return;
 	}
 
-	if (rvalue_directive->location == 1)
-	{
-		puts("pop r2");
-		local_var_stack->stack_size--;
+	int digits[18];
+	int digit_count = non_adjacent_form(value, digits);
 
-		for (int i = 0; i < rvalue_directive->ref_count; i++)
-		{
-			puts("ldr r2, r2");
-		}
-	}
-	else
+	bool needs_original = false;
+	for (int i = digit_count - 2; i >= 0; i--)
+		needs_original |= digits[i] != 0;
+	if (needs_original)
+		emit_mov(scratch, reg);
+	for (int i = digit_count - 2; i >= 0; i--)
 	{
-		if (rvalue_directive->type == DIRECTIVE_INT)
-		{
-			printf("movi #%d\n", rvalue_directive->token->int_literal);
-			puts("mov r2, r0");
-		}
-		if (rvalue_directive->type == DIRECTIVE_VARIABLE)
-		{
-			puts("mov r0, sp");
-			printf("addi #%d\n", local_var_stack->stack_size - rvalue_directive->address);
-			puts("ldr r2, r0");
-		}
-		for (int i = 0; i < rvalue_directive->ref_count; i++)
-		{
-			puts("ldr r2, r2");
-		}
+		emit_add(reg, reg);
+		if (digits[i] == 1)
+			emit_add(reg, scratch);
+		else if (digits[i] == -1)
+			emit_sub(reg, scratch);
 	}
-	if (lvalue_directive->location == 0)
-	{
-		if (lvalue_directive->type == DIRECTIVE_INT)
-		{
-			printf("movi #%d\n", lvalue_directive->token->int_literal);
-			puts("mov r1, r0");
-		}
-		if (lvalue_directive->type == DIRECTIVE_VARIABLE)
-		{
-			puts("mov r0, sp");
-			printf("addi #%d\n", local_var_stack->stack_size - lvalue_directive->address);
-			puts("ldr r1, r0");
 
-			for (int i = 0; i < lvalue_directive->ref_count; i++)
-			{
-				puts("ldr r1, r1");
-			}
-		}
-	}
-	if (lvalue_directive->location == 1)
+	if (negate)
 	{
-		puts("pop r1");
-		local_var_stack->stack_size--;
-
-		if (lvalue_directive->type == DIRECTIVE_VARIABLE)
-		{
-			puts("ldr r1, r1");
-
-			for (int i = 0; i < lvalue_directive->ref_count; i++)
-			{
-				puts("ldr r1, r1");
-			}
-		}
+		emit_movi(0);
+		emit_sub(0, reg);
+		emit_mov(reg, 0);
 	}
-
-	puts("add r1, r2");
-	puts("push r1");
-	local_var_stack->stack_size++;
-	lvalue_directive->address = local_var_stack->stack_size - 1;
-	lvalue_directive->location = 1;
-	lvalue_directive->type = DIRECTIVE_INT;
 }
 
-void move_directive_to_stack(Directive *directive, ProgramVariableStack *pvs)
+// Loads the value of the directive times scale into reg, folding the scale into literals
+void load_scaled_value(Directive *directive, int reg, int scale, int stack_size)
 {
-	if(directive->location == 1) return;
-	directive->location = 1;
-
-	if(directive->ref_count > 0 || directive->type_descriptor->pointer_count > 0)
+	if (directive_is_literal(directive))
 	{
-		puts("mov r0, sp");
-		printf("addi #%d\n", pvs->stack_size - directive->address);
-		puts("ldr r0, r0");
-		puts("push r0");
-		pvs->stack_size++;
+		load_constant(directive->token->int_literal * scale);
+		emit_mov(reg, 0);
 		return;
 	}
+	load_directive_value(directive, reg, stack_size);
+	if (scale != 1)
+		emit_multiply_constant(reg, 3, scale);
+}
 
-	if(directive->type == DIRECTIVE_INT)
+// Stores r1, and r2 as the high word of a two word result, to a new temporary and turns the directive
+// into that temporary
+void store_result(Directive *directive, int size, ProgramVariableStack *local_var_stack)
+{
+	int address = frame_alloc(local_var_stack, size);
+	load_slot_addr(address, 0, size, local_var_stack->stack_size);
+	emit_str(0, 1);
+	if (size == 2)
 	{
-		printf("movi HI(#%d)\n", directive->token->int_literal);
-		printf("ori LO(#%d)\n", directive->token->int_literal);
-		puts("push r0");
-		pvs->stack_size++;
-		return;
+		load_slot_addr(address, 1, size, local_var_stack->stack_size);
+		emit_str(0, 2);
 	}
+	directive_set_slot(directive, address);
+	directive->location = 1;
+	directive->type = DIRECTIVE_INT;
+	directive->ref_count = 0;
+	directive->untyped = false;
+	directive->typed = false;
+}
 
-	if(directive->type_descriptor->size == 1)
-	{
-		puts("mov r0, sp");
-		printf("addi #%d\n", pvs->stack_size - directive->address);
-		puts("ldr r0, r0");
-		puts("push r0");
-		pvs->stack_size++;
-		return;
-	}
+// The result of an operation on a literal has the type of the other operand
+void adopt_operand_type(Directive *result, Directive *other)
+{
+	result->type_descriptor = other->type_descriptor;
+	result->pointer_count = other->pointer_count;
+}
 
-	printf("movi HI(#%d)\n", directive->type_descriptor->size);
-	printf("movi LO(#%d)\n", directive->type_descriptor->size);
-	puts("sub sp, r0");
-	puts("mov r0, sp");
-	puts("addi #1");
-	puts("mov r3, r0");
-	pvs->stack_size += directive->type_descriptor->size;
-	copy_value_to_reg_ptr(3, pvs->stack_size - directive->address, directive->type_descriptor->size);
+// Folding two literals keeps the declared type of either of them
+void fold_literal_type(Directive *result, Directive *other)
+{
+	if (result->typed || !other->typed)
+		return;
+	adopt_operand_type(result, other);
+	result->typed = true;
 }
 
-void push_directive_to_stack(Directive *directive, ProgramVariableStack *pvs)
+void compile_add(Directive *lvalue_directive, Directive *rvalue_directive, bool subtract,
+				 ProgramVariableStack *local_var_stack)
 {
-	if(directive->location == 0)
+	if (directive_is_literal(lvalue_directive) && directive_is_literal(rvalue_directive))
 	{
-		move_directive_to_stack(directive, pvs);
+		Token *token = malloc(sizeof(Token));
+		*token = *lvalue_directive->token;
+		if (subtract)
+			token->int_literal -= rvalue_directive->token->int_literal;
+		else
+			token->int_literal += rvalue_directive->token->int_literal;
+		lvalue_directive->token = token;
+		fold_literal_type(lvalue_directive, rvalue_directive);
 		return;
 	}
-	if(directive->type_descriptor->size == 1 || directive->pointer_count > 0)
+
+	bool lvalue_literal = directive_takes_type(lvalue_directive);
+	bool untyped = lvalue_literal && directive_takes_type(rvalue_directive);
+	if (directive_is_wide(lvalue_directive) || directive_is_wide(rvalue_directive))
 	{
-		if(directive->address <= 255)
+		// Both halves stay in registers, the carry out of the low words goes straight into the high words
+		load_wide_value(rvalue_directive, 3, 4, local_var_stack->stack_size);
+		load_wide_value(lvalue_directive, 1, 2, local_var_stack->stack_size);
+		if (subtract)
 		{
-			puts("mov r0, sp");
-			printf("addi #%d\n", pvs->stack_size - directive->address);
-			puts("ldr r0, r0");
-			puts("push r0");
-			pvs->stack_size++;
-			return;
+			emit_sub(1, 3);
+			emit_sbc(2, 4);
 		}
-		printf("mhi HI(#%d)\n", pvs->stack_size - directive->address);
-		printf("ori LO(#%d)\n", pvs->stack_size - directive->address);
-		puts("add r0, sp");
-		puts("ldr r0, r0");
-		puts("push r0");
-		pvs->stack_size++;
+		else
+		{
+			emit_add(1, 3);
+			emit_adc(2, 4);
+		}
+		if (lvalue_literal)
+			adopt_operand_type(lvalue_directive, rvalue_directive);
+		store_result(lvalue_directive, 2, local_var_stack);
 		return;
 	}
 
-	printf("mhi HI(#%d)\n", pvs->stack_size - directive->address);
-	printf("ori LO(#%d)\n", pvs->stack_size - directive->address);
-	puts("add r0, sp");
-	for(int i = 0; i < directive->type_descriptor->size; i++)
+	int lvalue_width = directive_width(lvalue_directive);
+	int rvalue_width = directive_width(rvalue_directive);
+	if (lvalue_width > 1 || rvalue_width > 1)
 	{
-		puts("ldr r1, r0");
-		puts("push r1");
-		pvs->stack_size++;
-		puts("addi #1");
+		puts("Adding types larger than 1 word is not yet supported!");
+		return;
 	}
-}
 
-void process_directive_stack(DirectiveStack *stack, int next_precedence, bool close_paren,
-							 ProgramVariableStack *local_var_stack)
-{
-	int directive_index = stack->size - 1;
-	while (true)
+	// Adding an integer to a pointer steps over whole pointees
+	int lvalue_scale = 1;
+	int rvalue_scale = 1;
+	bool lvalue_pointer = directive_pointer_level(lvalue_directive) > 0;
+	bool rvalue_pointer = directive_pointer_level(rvalue_directive) > 0;
+	if (subtract && lvalue_pointer && rvalue_pointer)
 	{
-		if (directive_index < 0)
-			return;
+		puts("Subtracting pointers is not yet supported!");
+		return;
+	}
+	if (lvalue_pointer && !rvalue_pointer)
+		rvalue_scale = directive_pointee_size(lvalue_directive);
+	if (rvalue_pointer && !lvalue_pointer)
+		lvalue_scale = directive_pointee_size(rvalue_directive);
+
+	load_scaled_value(rvalue_directive, 2, rvalue_scale, local_var_stack->stack_size);
+	load_scaled_value(lvalue_directive, 1, lvalue_scale, local_var_stack->stack_size);
+	if (subtract)
+		emit_sub(1, 2);
+	else
+		emit_add(1, 2);
+
+	if (lvalue_literal || (rvalue_pointer && !lvalue_pointer))
+		adopt_operand_type(lvalue_directive, rvalue_directive);
+	store_result(lvalue_directive, 1, local_var_stack);
+	lvalue_directive->untyped = untyped;
+}
+
+int induction_product(int address, int factor);
+
+void compile_mul(Directive *lvalue_directive, Directive *rvalue_directive, ProgramVariableStack *local_var_stack)
+{
+	int lvalue_width = directive_width(lvalue_directive);
+	int rvalue_width = directive_width(rvalue_directive);
+	if (lvalue_width > 1 || rvalue_width > 1)
+	{
+		puts("Multiplying types larger than 1 word is not yet supported!");
+		return;
+	}
+	if (directive_pointer_level(lvalue_directive) > 0 || directive_pointer_level(rvalue_directive) > 0)
+	{
+		puts("Pointers can not be multiplied!");
+		return;
+	}
+
+	if (directive_is_literal(lvalue_directive) && directive_is_literal(rvalue_directive))
+	{
+		Token *token = malloc(sizeof(Token));
+		*token = *lvalue_directive->token;
+		// Folded to 32 bits like the other literal arithmetic, a one word destination keeps the low word
+		token->int_literal = (long long)(((unsigned long long)lvalue_directive->token->int_literal *
+										  (unsigned long long)rvalue_directive->token->int_literal) &
+										 0xFFFFFFFFull);
+		lvalue_directive->token = token;
+		fold_literal_type(lvalue_directive, rvalue_directive);
+		return;
+	}
+
+	bool untyped = directive_takes_type(lvalue_directive) && directive_takes_type(rvalue_directive);
+	if (directive_takes_type(lvalue_directive))
+		adopt_operand_type(lvalue_directive, rvalue_directive);
+	if (directive_is_literal(lvalue_directive) || directive_is_literal(rvalue_directive))
+	{
+		Directive *constant = directive_is_literal(lvalue_directive) ? lvalue_directive : rvalue_directive;
+		Directive *variable = constant == lvalue_directive ? rvalue_directive : lvalue_directive;
+		int product = -1;
+		if (variable->type == DIRECTIVE_VARIABLE && variable->location == 0 && variable->ref_count == 0 &&
+			variable->object_size == 0 && !variable->symbol)
+			product = induction_product(variable->address, constant->token->int_literal);
+		if (product != -1)
+		{
+			// The loop keeps this product up to date, it is read like a variable
+			*lvalue_directive = *variable;
+			lvalue_directive->address = product;
+			return;
+		}
+		load_directive_value(variable, 1, local_var_stack->stack_size);
+		emit_multiply_constant(1, 2, constant->token->int_literal);
+		store_result(lvalue_directive, 1, local_var_stack);
+		lvalue_directive->untyped = untyped;
+		return;
+	}
+
+	// The runtime shift-add routine takes its operands in r1 and r2 and returns the product in r1, it is
+	// emitted with the program once it is called
+	load_directive_value(rvalue_directive, 2, local_var_stack->stack_size);
+	load_directive_value(lvalue_directive, 1, local_var_stack->stack_size);
+	emit_mhi_symbol(RUNTIME_MUL16);
+	emit_ori_symbol(RUNTIME_MUL16);
+	emit_call(0, (1 << 1) | (1 << 2));
+	store_result(lvalue_directive, 1, local_var_stack);
+	lvalue_directive->untyped = untyped;
+}
+
+bool directive_is_comparison(DirectiveType type)
+{
+	return directive_type_precedence(type) == COMPARISON_PRECEDENCE;
+}
+
+// Comparisons are signed unless an operand is unsigned or a pointer, untyped literals take the type of the
+// other side
+bool comparison_signed(Directive *lvalue_directive, Directive *rvalue_directive)
+{
+	Directive *operands[] = {lvalue_directive, rvalue_directive};
+	for (int i = 0; i < 2; i++)
+	{
+		Directive *operand = operands[i];
+		if (directive_takes_type(operand))
+			continue;
+		if (directive_pointer_level(operand) > 0 || operand->type_descriptor->primitive_type == PRIMITIVE_TYPE_U16 ||
+			operand->type_descriptor->primitive_type == PRIMITIVE_TYPE_U32)
+			return false;
+	}
+	return true;
+}
+
+// Turns every comparison into == or <, swapping the operands and inverting the outcome where needed.
+// Returns the comparison left and sets invert when it holds exactly when the original one doesn't.
+DirectiveType normalize_comparison(DirectiveType type, Directive **lvalue_directive, Directive **rvalue_directive,
+								   bool *invert)
+{
+	*invert = type == DIRECTIVE_NOT_EQUAL || type == DIRECTIVE_LESS_EQUAL || type == DIRECTIVE_GREATER_EQUAL;
+	if (type == DIRECTIVE_GREATER || type == DIRECTIVE_LESS_EQUAL)
+	{
+		Directive *swap = *lvalue_directive;
+		*lvalue_directive = *rvalue_directive;
+		*rvalue_directive = swap;
+	}
+	return type == DIRECTIVE_EQUAL || type == DIRECTIVE_NOT_EQUAL ? DIRECTIVE_EQUAL : DIRECTIVE_LESS;
+}
+
+// Compares two literals at the width of the comparison, which is two words when one of them keeps a wide type
+bool literal_comparison(DirectiveType type, long long left, long long right, bool is_signed, bool wide)
+{
+	if (is_signed)
+	{
+		left = wide ? (int32_t)left : (int16_t)left;
+		right = wide ? (int32_t)right : (int16_t)right;
+	}
+	else
+	{
+		left &= wide ? 0xFFFFFFFFll : 0xFFFF;
+		right &= wide ? 0xFFFFFFFFll : 0xFFFF;
+	}
+	switch (type)
+	{
+	case DIRECTIVE_EQUAL:
+		return left == right;
+	case DIRECTIVE_NOT_EQUAL:
+		return left != right;
+	case DIRECTIVE_LESS:
+		return left < right;
+	case DIRECTIVE_LESS_EQUAL:
+		return left <= right;
+	case DIRECTIVE_GREATER:
+		return left > right;
+	default:
+		return left >= right;
+	}
+}
+
+// Loads a one word operand of a comparison into reg, offset by 0x8000 when the comparison is signed.
+// Literals are offset when they are compiled.
+void load_compared_value(Directive *directive, int reg, bool is_signed, int stack_size)
+{
+	if (directive_is_literal(directive))
+	{
+		load_constant(directive->token->int_literal ^ (is_signed ? 0x8000 : 0));
+		emit_mov(reg, 0);
+		return;
+	}
+	load_directive_value(directive, reg, stack_size);
+	if (is_signed)
+	{
+		emit_mhi(0x8000);
+		emit_add(reg, 0);
+	}
+}
+
+// Loads the operands of a normalized comparison and subtracts them. Both words are subtracted for two word
+// integers. Afterwards r1, and r2 for the high word, hold the difference, which is zero when the operands
+// are equal, and the carry is set when the left one is less. Signed operands are offset by 0x8000 so the
+// unsigned borrow orders them.
+bool compare_operands(Directive *lvalue_directive, Directive *rvalue_directive, bool is_signed,
+					  ProgramVariableStack *local_var_stack)
+{
+	int stack_size = local_var_stack->stack_size;
+	if ((!directive_is_integer(lvalue_directive) && directive_pointer_level(lvalue_directive) == 0) ||
+		(!directive_is_integer(rvalue_directive) && directive_pointer_level(rvalue_directive) == 0))
+	{
+		puts("Only integers and pointers can be compared.");
+		return false;
+	}
+	if (directive_is_wide(lvalue_directive) || directive_is_wide(rvalue_directive))
+	{
+		load_wide_value(rvalue_directive, 3, 4, stack_size);
+		load_wide_value(lvalue_directive, 1, 2, stack_size);
+		if (is_signed)
+		{
+			emit_mhi(0x8000);
+			emit_add(2, 0);
+			emit_add(4, 0);
+		}
+		emit_sub(1, 3);
+		emit_sbc(2, 4);
+		return true;
+	}
+	load_compared_value(rvalue_directive, 2, is_signed, stack_size);
+	load_compared_value(lvalue_directive, 1, is_signed, stack_size);
+	emit_sub(1, 2);
+	return true;
+}
+
+// Branches to label when the outcome of the comparison is when. The comparison is tested right where it is
+// computed, equality on the difference and order on the borrow, so no boolean is ever stored.
+bool compile_comparison_branch(Directive *lvalue_directive, Directive *rvalue_directive, DirectiveType type,
+							   bool when, int label, ProgramVariableStack *local_var_stack)
+{
+	bool is_signed = comparison_signed(lvalue_directive, rvalue_directive);
+	if (directive_is_literal(lvalue_directive) && directive_is_literal(rvalue_directive))
+	{
+		if (literal_comparison(type, lvalue_directive->token->int_literal, rvalue_directive->token->int_literal,
+							   is_signed, directive_is_wide(lvalue_directive) || directive_is_wide(rvalue_directive)) ==
+			when)
+			emit_b(label);
+		return true;
+	}
+
+	bool invert;
+	type = normalize_comparison(type, &lvalue_directive, &rvalue_directive, &invert);
+	when ^= invert;
+	if (type == DIRECTIVE_EQUAL && directive_is_literal(lvalue_directive))
+	{
+		Directive *swap = lvalue_directive;
+		lvalue_directive = rvalue_directive;
+		rvalue_directive = swap;
+	}
+	if (type == DIRECTIVE_EQUAL && directive_is_literal(rvalue_directive) &&
+		(rvalue_directive->token->int_literal & 0xFFFF) == 0 && !directive_is_wide(lvalue_directive))
+	{
+		// Testing against zero needs no subtraction
+		load_directive_value(lvalue_directive, 1, local_var_stack->stack_size);
+		if (when)
+			emit_bz(1, label);
+		else
+			emit_bnz(1, label);
+		return true;
+	}
+	if (!compare_operands(lvalue_directive, rvalue_directive, is_signed && type == DIRECTIVE_LESS, local_var_stack))
+		return false;
+	if (type == DIRECTIVE_LESS)
+	{
+		if (when)
+			emit_bc(label);
+		else
+			emit_bnc(label);
+		return true;
+	}
+	if (!directive_is_wide(lvalue_directive) && !directive_is_wide(rvalue_directive))
+	{
+		if (when)
+			emit_bz(1, label);
+		else
+			emit_bnz(1, label);
+		return true;
+	}
+	if (!when)
+	{
+		emit_bnz(1, label);
+		emit_bnz(2, label);
+		return true;
+	}
+	int different = emit_new_label();
+	emit_bnz(1, different);
+	emit_bz(2, label);
+	emit_label(different, local_var_stack->stack_size);
+	return true;
+}
+
+// Compiles a comparison used as a value, the result is 1 when it holds and 0 otherwise. The outcome is
+// moved into the carry and taken from there without branching.
+void compile_comparison(Directive *lvalue_directive, Directive *rvalue_directive, DirectiveType type,
+						ProgramVariableStack *local_var_stack)
+{
+	Directive *result = lvalue_directive;
+	bool is_signed = comparison_signed(lvalue_directive, rvalue_directive);
+	if (directive_is_literal(lvalue_directive) && directive_is_literal(rvalue_directive))
+	{
+		Token *token = malloc(sizeof(Token));
+		*token = *lvalue_directive->token;
+		token->int_literal =
+			literal_comparison(type, lvalue_directive->token->int_literal, rvalue_directive->token->int_literal,
+							   is_signed, directive_is_wide(lvalue_directive) || directive_is_wide(rvalue_directive));
+		result->token = token;
+		result->type_descriptor = get_type_by_name(&g_tdv, &(Token){.type = TOKEN_TYPE_I16});
+		result->pointer_count = 0;
+		result->typed = false;
+		return;
+	}
+
+	bool invert;
+	type = normalize_comparison(type, &lvalue_directive, &rvalue_directive, &invert);
+	bool wide = directive_is_wide(lvalue_directive) || directive_is_wide(rvalue_directive);
+	if (!compare_operands(lvalue_directive, rvalue_directive, is_signed && type == DIRECTIVE_LESS, local_var_stack))
+		return;
+	if (type == DIRECTIVE_EQUAL)
+	{
+		// The difference is zero exactly when subtracting one from it borrows
+		emit_movi(1);
+		emit_sub(1, 0);
+		if (wide)
+		{
+			emit_movi(0);
+			emit_sbc(2, 0);
+		}
+	}
+
+	// r1 = 0 - carry, then 0 - r1 for the outcome or 1 + r1 for its inverse
+	emit_sbc(1, 1);
+	if (invert)
+	{
+		emit_movi(1);
+		emit_add(1, 0);
+	}
+	else
+	{
+		emit_movi(0);
+		emit_sub(0, 1);
+		emit_mov(1, 0);
+	}
+	result->type_descriptor = get_type_by_name(&g_tdv, &(Token){.type = TOKEN_TYPE_I16});
+	result->pointer_count = 0;
+	store_result(result, 1, local_var_stack);
+	result->untyped = true;
+}
+
+// Stores the address of the directive's value to a new temporary and returns a pointer directive for it
+Directive directive_address(Directive *directive, ProgramVariableStack *local_var_stack)
+{
+	load_directive_addr(directive, local_var_stack->stack_size);
+	for (int i = 0; i < directive->ref_count; i++)
+	{
+		emit_ldr(0, 0);
+	}
+	emit_mov(1, 0);
+	int address = frame_alloc(local_var_stack, 1);
+	load_slot_addr(address, 0, 1, local_var_stack->stack_size);
+	emit_str(0, 1);
+
+	Directive pointer = *directive;
+	pointer.ref_count = 0;
+	pointer.type = DIRECTIVE_ADDRESS;
+	pointer.location = 1;
+	directive_set_slot(&pointer, address);
+	pointer.array_length = 0;
+	pointer.pointer_count++;
+	return pointer;
+}
+
+// Words of one element of an array directive
+int array_element_size(Directive *array)
+{
+	if (directive_pointer_level(array) > 0 || array->type_descriptor->size == 0)
+		return 1;
+	return array->type_descriptor->size;
+}
+
+// Indexes an array or a pointer and returns the element. A constant index into an array in the frame only
+// moves the element within the array's frame object, so no code is needed. Other indices are scaled by the element
+// size, which takes only shifts for powers of two, and added to the address of the first element.
+Directive compile_index(Directive *base, Directive *index, ProgramVariableStack *local_var_stack)
+{
+	Directive element = *base;
+	if (!directive_is_integer(index) || directive_is_wide(index))
+	{
+		puts("Index must be a one word integer.");
+		return element;
+	}
+
+	if (base->array_length > 0)
+	{
+		int element_size = array_element_size(base);
+		element.array_length = 0;
+		if (directive_is_literal(index))
+		{
+			int position = index->token->int_literal;
+			if (position < 0 || position >= base->array_length)
+				puts("Array index out of bounds.");
+			if (base->ref_count == 0)
+			{
+				element.offset += position * element_size;
+				return element;
+			}
+		}
+		load_scaled_value(index, 1, element_size, local_var_stack->stack_size);
+		load_directive_addr(base, local_var_stack->stack_size);
+		for (int i = 0; i < base->ref_count; i++)
+		{
+			emit_ldr(0, 0);
+		}
+		emit_add(1, 0);
+		store_result(&element, 1, local_var_stack);
+		element.ref_count = 1;
+		return element;
+	}
+
+	// p[i] is *(p + i)
+	if (directive_pointer_level(base) > 0)
+	{
+		compile_add(&element, index, false, local_var_stack);
+		element.ref_count++;
+		element.pointer_count--;
+		return element;
+	}
+
+	puts("Only arrays and pointers can be indexed.");
+	return element;
+}
+
+// Turns the directive for a struct, or a pointer to one with arrow, into the field named name. A field of a
+// struct in the frame is the same frame object at the field's offset, so no code is needed. Behind a
+// pointer the field's address is the struct's address plus the offset, which is put in a temporary.
+bool compile_member(Directive *base, bool arrow, Token *name, ProgramVariableStack *local_var_stack)
+{
+	if (arrow)
+	{
+		if (directive_pointer_level(base) != 1)
+		{
+			puts("Expected a pointer to a struct before ->.");
+			return false;
+		}
+		base->ref_count++;
+		base->pointer_count--;
+	}
+	if (directive_pointer_level(base) != 0 || base->type_descriptor->primitive_type != PRIMITIVE_TYPE_STRUCT)
+	{
+		puts("Expected a struct before the field name.");
+		return false;
+	}
+	StructDescriptorEntry *entry = struct_entry_find(&base->type_descriptor->struct_descriptor, name->name);
+	if (!entry)
+	{
+		puts("Struct has no field of that name.");
+		return false;
+	}
+
+	if (base->ref_count == 0)
+	{
+		base->object_size = directive_storage_size(base);
+		base->offset += entry->offset;
+	}
+	else if (entry->offset != 0)
+	{
+		load_directive_addr(base, local_var_stack->stack_size);
+		for (int i = 0; i < base->ref_count; i++)
+		{
+			emit_ldr(0, 0);
+		}
+		if (immediate_encodable(OPCODE_ADDI, entry->offset))
+		{
+			emit_addi(entry->offset);
+			emit_mov(1, 0);
+		}
+		else
+		{
+			emit_mov(1, 0);
+			load_constant(entry->offset);
+			emit_add(1, 0);
+		}
+		store_result(base, 1, local_var_stack);
+		base->ref_count = 1;
+	}
+	base->type_descriptor = entry->type_descriptor;
+	base->pointer_count = entry->pointer_count;
+	base->array_length = entry->array_length;
+	return true;
+}
+
+// Pushes the value of the directive, used for call arguments
+void push_directive_to_stack(Directive *directive, ProgramVariableStack *pvs)
+{
+	if(directive->location == 0 && directive->type == DIRECTIVE_INT)
+	{
+		load_constant(directive->token->int_literal);
+		emit_push(0);
+		pvs->stack_size++;
+		return;
+	}
+
+	int width = directive_width(directive);
+	if(width == 1)
+	{
+		load_directive_addr(directive, pvs->stack_size);
+		for(int i = 0; i < directive->ref_count + 1; i++)
+		{
+			emit_ldr(0, 0);
+		}
+		emit_push(0);
+		pvs->stack_size++;
+		return;
+	}
+
+	// Push the highest word first so the copy keeps the same layout
+	if(directive->ref_count == 0)
+	{
+		for(int i = width - 1; i >= 0; i--)
+		{
+			load_directive_word_addr(directive, i, pvs->stack_size);
+			emit_ldr(0, 0);
+			emit_push(0);
+			pvs->stack_size++;
+		}
+		return;
+	}
+
+	load_directive_addr(directive, pvs->stack_size);
+	for(int i = 0; i < directive->ref_count; i++)
+	{
+		emit_ldr(0, 0);
+	}
+	emit_mov(1, 0);
+	for(int i = width - 1; i >= 0; i--)
+	{
+		emit_mov(0, 1);
+		if(i > 0)
+			emit_addi(i);
+		emit_ldr(0, 0);
+		emit_push(0);
+		pvs->stack_size++;
+	}
+}
+
+// The directive a parameter or return type describes, used for type checks and widths
+Directive declared_directive(TypeDescriptor *type_descriptor, int pointer_count)
+{
+	Directive directive = {0};
+	directive.type = DIRECTIVE_VARIABLE;
+	directive.type_descriptor = type_descriptor;
+	directive.pointer_count = pointer_count;
+	return directive;
+}
+
+bool compile_statement(TokenVector *tv, int start_index, DirectiveStack *stack,
+					   ProgramVariableStack *local_var_stack, int *last_index);
+
+// Whether a call to function with these arguments should be inlined. The growth is estimated from the
+// optimized size of the body minus the call sequence it replaces, literal arguments make it cheaper since
+// they get folded into the body.
+bool should_inline(Function *function, Directive **arguments, int argument_count)
+{
+	if (g_options.passes.level < OPTIMIZATION_O2 || !function->inlinable || g_inline_depth >= INLINE_MAX_DEPTH || function == g_current_function)
+		return false;
+	for (InlineSite *site = g_inline_site; site; site = site->parent)
+	{
+		if (site->function == function)
+			return false;
+	}
+	int cost = function->inline_size - INLINE_CALL_OVERHEAD;
+	for (int i = 0; i < argument_count; i++)
+	{
+		if (directive_is_literal(arguments[i]))
+			cost -= INLINE_LITERAL_BONUS;
+	}
+	return cost <= g_options.inline_threshold;
+}
+
+// Compiles the body of function in place of a call to it. Parameters that are never written and get a one
+// word literal are bound to the literal, the others are copied to new slots like locals.
+bool inline_call(Function *function, Directive **arguments, Directive *result,
+				 ProgramVariableStack *local_var_stack)
+{
+	int variable_count = local_var_stack->length;
+	int scope = ++local_var_stack->scope_counter;
+	for (int i = 0; i < function->parameter_count; i++)
+	{
+		ProgramVariable parameter = function->parameters[i];
+		Directive declared = declared_directive(parameter.type_descriptor, parameter.pointer_count);
+		int width = directive_width(&declared);
+		parameter.scope = scope;
+		parameter.literal = NULL;
+		if (width == 1 && parameter.pointer_count == 0 && !function->parameter_written[i] &&
+			directive_is_literal(arguments[i]))
+		{
+			parameter.literal = arguments[i]->token;
+		}
+		else if (width == 1)
+		{
+			parameter.address = frame_alloc(local_var_stack, width);
+			load_directive_value(arguments[i], 1, local_var_stack->stack_size);
+			load_slot_addr(parameter.address, 0, width, local_var_stack->stack_size);
+			emit_str(0, 1);
+		}
+		else
+		{
+			parameter.address = frame_alloc(local_var_stack, width);
+			declared.address = parameter.address;
+			copy_directive_value(&declared, arguments[i], local_var_stack->stack_size);
+		}
+		prog_var_stack_push(local_var_stack, &parameter);
+	}
+
+	InlineSite site = {0};
+	site.function = function;
+	site.result = declared_directive(function->return_type, function->return_pointer_count);
+	site.parent = g_inline_site;
+	g_inline_site = &site;
+	g_inline_depth++;
+
+	DirectiveStack stack = {0};
+	stack.data = malloc(sizeof(Directive) * 100);
+	bool success = true;
+	for (int index = function->body_start; index < function->body_end; index++)
+	{
+		if (!compile_statement(function->tokens, index, &stack, local_var_stack, &index))
+		{
+			success = false;
+			break;
+		}
+	}
+	free(stack.data);
+
+	g_inline_depth--;
+	g_inline_site = site.parent;
+	local_var_stack->length = variable_count;
+	*result = site.result;
+	return success;
+}
+
+// Whether an argument of the declared type is passed as the address of the value
+bool passed_by_reference(Directive *declared)
+{
+	return directive_width(declared) > STRUCT_REFERENCE_WORDS;
+}
+
+// Whether a result of the declared type is written to memory the caller passes the address of
+bool returned_by_reference(Directive *declared)
+{
+	int width = directive_width(declared);
+	return width > 2 || (width == 2 && !directive_is_wide(declared));
+}
+
+// The words an argument of the declared type takes in registers or on the stack
+int argument_width(Directive *declared)
+{
+	return passed_by_reference(declared) ? 1 : directive_width(declared);
+}
+
+// Puts the address of a struct argument passed by reference into a temporary. The callee never writes
+// through it, so temporaries and, as long as no pointer to a local exists, variables are passed in place.
+// Anything else is copied first since the callee could see it change through another pointer.
+Directive reference_argument(Directive *argument, ProgramVariableStack *local_var_stack)
+{
+	Directive object = *argument;
+	bool in_place = argument->ref_count == 0 && !argument->symbol &&
+					(argument->location == 1 ||
+					 (g_current_function && !g_current_function->takes_address && !g_inline_site));
+	if (!in_place)
+	{
+		object.type = DIRECTIVE_INT;
+		object.location = 1;
+		object.ref_count = 0;
+		directive_set_slot(&object, frame_alloc(local_var_stack, directive_width(argument)));
+		copy_directive_value(&object, argument, local_var_stack->stack_size);
+	}
+	load_directive_addr(&object, local_var_stack->stack_size);
+	emit_mov(1, 0);
+	int address = frame_alloc(local_var_stack, 1);
+	load_slot_addr(address, 0, 1, local_var_stack->stack_size);
+	emit_str(0, 1);
+
+	Directive reference = object;
+	reference.type = DIRECTIVE_ADDRESS;
+	directive_set_slot(&reference, address);
+	reference.pointer_count++;
+	return reference;
+}
+
+// Words of stack arguments the function is called with
+int stack_argument_words(Function *function)
+{
+	int words = 0;
+	Directive result = declared_directive(function->return_type, function->return_pointer_count);
+	int register_count = returned_by_reference(&result) ? 1 : 0;
+	for (int i = 0; i < function->parameter_count; i++)
+	{
+		ProgramVariable *parameter = &function->parameters[i];
+		Directive declared = declared_directive(parameter->type_descriptor, parameter->pointer_count);
+		int width = argument_width(&declared);
+		if (width == 1 && register_count < REGISTER_ARGUMENT_COUNT)
+			register_count++;
+		else
+			words += width;
+	}
+	return words;
+}
+
+// Whether a call in return position can reuse the current frame's return address. Stack arguments have to
+// fit into our own incoming arguments, which were copied into the frame on entry and are free to overwrite.
+// The frame is torn down before the jump, so nothing in it may be reachable through a pointer, which
+// includes structs passed by reference.
+bool can_tail_call(Function *function, int *widths, bool *in_register, bool *by_reference, int argument_count,
+				   ProgramVariableStack *local_var_stack)
+{
+	if (g_options.passes.level < OPTIMIZATION_O1 || !function || !g_current_function || g_inline_site || g_current_function->takes_address ||
+		local_var_stack->stack_size != 0)
+	{
+		return false;
+	}
+	Directive declared = declared_directive(g_current_function->return_type, g_current_function->return_pointer_count);
+	Directive result = declared_directive(function->return_type, function->return_pointer_count);
+	int width = directive_width(&declared);
+	if (width == 0 || returned_by_reference(&declared) || directive_width(&result) != width ||
+		!directive_types_compatible(&declared, &result))
+	{
+		return false;
+	}
+	int words = 0;
+	for (int i = 0; i < argument_count; i++)
+	{
+		if (by_reference[i])
+			return false;
+		if (!in_register[i])
+			words += widths[i];
+	}
+	return words <= stack_argument_words(g_current_function);
+}
+
+// Writes the arguments into our own incoming argument slots and registers and jumps to the function, which
+// then returns straight to our caller
+void compile_tail_call(Token *name, Directive **arguments, int *widths, bool *in_register, int argument_count)
+{
+	int word = 0;
+	for (int i = 0; i < argument_count; i++)
+	{
+		if (in_register[i])
+			continue;
+		if (widths[i] == 2)
+			load_wide_value(arguments[i], 1, 2, 0);
+		else
+			load_directive_value(arguments[i], 1, 0);
+		for (int w = 0; w < widths[i]; w++)
+		{
+			emit_arg_addr(word + w, 0);
+			emit_str(0, 1 + w);
+		}
+		word += widths[i];
+	}
+
+	int reg = REGISTER_FIRST_ARGUMENT;
+	int argument_registers = 0;
+	for (int i = 0; i < argument_count; i++)
+	{
+		if (!in_register[i])
+			continue;
+		load_directive_value(arguments[i], reg, 0);
+		argument_registers |= 1 << reg;
+		reg++;
+	}
+	emit_tail_call(name->name, argument_registers);
+}
+
+// The code of a function the evaluator may run. The function being compiled isn't finished yet.
+InstructionVector *evaluable_function(const char *symbol)
+{
+	Function *function = function_find(&g_functions, symbol);
+	if (!function || function == g_current_function)
+		return NULL;
+	return &function->instructions;
+}
+
+// Runs a call with literal arguments at compile time and makes its result a literal. This only works out
+// for functions that return an integer, or nothing, and don't depend on or change anything but their
+// arguments and locals. A call without a result that can be evaluated has no effect and disappears.
+bool evaluate_constant_call(Function *function, Directive **arguments, int *widths, bool *in_register,
+							int argument_count, Token *call_token, Directive *result)
+{
+	*result = declared_directive(function->return_type, function->return_pointer_count);
+	int width = directive_width(result);
+	if (g_options.passes.level < OPTIMIZATION_O1 || function == g_current_function || returned_by_reference(result) ||
+		(width != 0 && result->type_descriptor->primitive_type == PRIMITIVE_TYPE_STRUCT) || result->pointer_count > 0)
+	{
+		return false;
+	}
+
+	int registers[REGISTER_COUNT] = {0};
+	int stack_words[FUNCTION_MAX_PARAMETERS * 2];
+	int stack_count = 0;
+	int reg = REGISTER_FIRST_ARGUMENT;
+	for (int i = 0; i < argument_count; i++)
+	{
+		if (!directive_is_literal(arguments[i]))
+			return false;
+		int value = arguments[i]->token->int_literal;
+		if (in_register[i])
+			registers[reg++] = value;
+		else if (widths[i] == 2)
+		{
+			stack_words[stack_count++] = value;
+			stack_words[stack_count++] = value >> 16;
+		}
+		else
+			stack_words[stack_count++] = value;
+	}
+
+	int results[2];
+	if (!evaluate_call(&function->instructions, registers, stack_words, stack_count, evaluable_function, results))
+		return false;
+	if (width == 0)
+		return true;
+	Token *token = malloc(sizeof(Token));
+	*token = *call_token;
+	token->type = TOKEN_TYPE_INTEGER_LITERAL;
+	token->int_literal = width == 2 ? (int)((unsigned)results[0] | ((unsigned)results[1] << 16)) : results[0];
+	result->token = token;
+	result->type = DIRECTIVE_INT;
+	result->location = 0;
+	result->typed = true;
+	return true;
+}
+
+// Compiles a call whose arguments are the directives above the open paren following the call directive.
+// Everything from the call directive up is replaced by the result, if the function returns one.
+void compile_call(DirectiveStack *stack, int call_index, ProgramVariableStack *local_var_stack)
+{
+	bool tail_position = g_tail_position;
+	g_tail_position = false;
+	Directive call = stack->data[call_index];
+	Directive *arguments[FUNCTION_MAX_PARAMETERS];
+	int argument_count = 0;
+	for (int i = call_index + 2; i < stack->size; i++)
+	{
+		if (stack->data[i].type == DIRECTIVE_COMMA)
+			continue;
+		if (argument_count == FUNCTION_MAX_PARAMETERS)
+		{
+			puts("Too many arguments in function call.");
+			return;
+		}
+		arguments[argument_count++] = &stack->data[i];
+	}
+
+	// Functions that aren't defined in this file are called without checking the arguments
+	Function *function = function_find(&g_functions, call.token->name);
+	if (function && function->parameter_count != argument_count)
+	{
+		puts("Wrong number of arguments in function call.");
+		return;
+	}
+
+	// A struct result is written to a temporary whose address goes in the first argument register
+	Directive result = {0};
+	bool result_by_reference = false;
+	if (function)
+	{
+		result = declared_directive(function->return_type, function->return_pointer_count);
+		result_by_reference = returned_by_reference(&result);
+	}
+
+	int widths[FUNCTION_MAX_PARAMETERS];
+	bool in_register[FUNCTION_MAX_PARAMETERS];
+	bool by_reference[FUNCTION_MAX_PARAMETERS];
+	int register_count = result_by_reference ? 1 : 0;
+	for (int i = 0; i < argument_count; i++)
+	{
+		Directive declared = *arguments[i];
+		if (function)
+		{
+			ProgramVariable *parameter = &function->parameters[i];
+			declared = declared_directive(parameter->type_descriptor, parameter->pointer_count);
+			if (!directive_types_compatible(&declared, arguments[i]))
+			{
+				puts("Argument type not compatible");
+				return;
+			}
+		}
+		by_reference[i] = passed_by_reference(&declared);
+		widths[i] = argument_width(&declared);
+		in_register[i] = widths[i] == 1 && register_count < REGISTER_ARGUMENT_COUNT;
+		if (in_register[i])
+			register_count++;
+	}
+
+	// Evaluated calls leave a literal, or nothing, behind, which beats inlining them
+	Directive evaluated;
+	if (function &&
+		evaluate_constant_call(function, arguments, widths, in_register, argument_count, call.token, &evaluated))
+	{
+		stack->size = call_index;
+		if (directive_width(&evaluated) > 0)
+			directive_stack_push(stack, &evaluated);
+		return;
+	}
+
+	if (function && should_inline(function, arguments, argument_count))
+	{
+		Directive result;
+		if (!inline_call(function, arguments, &result, local_var_stack))
+			return;
+		stack->size = call_index;
+		if (directive_width(&result) == 0)
+			return;
+		result.token = result.location == 0 ? result.token : call.token;
+		directive_stack_push(stack, &result);
+		return;
+	}
+
+	// The call stays in the code from here on, which makes it an edge of the call graph
+	callee_vector_add(g_current_function ? &g_current_function->callees : &g_entry_callees, call.token->name);
+
+	// The return is done by the callee, so it is consumed together with the call
+	if (tail_position && can_tail_call(function, widths, in_register, by_reference, argument_count, local_var_stack))
+	{
+		compile_tail_call(call.token, arguments, widths, in_register, argument_count);
+		stack->size = call_index - 1;
+		return;
+	}
+
+	Directive references[FUNCTION_MAX_PARAMETERS];
+	for (int i = 0; i < argument_count; i++)
+	{
+		if (!by_reference[i])
+			continue;
+		references[i] = reference_argument(arguments[i], local_var_stack);
+		arguments[i] = &references[i];
+	}
+	int result_width = function ? directive_width(&result) : 0;
+	int result_address = result_by_reference ? frame_alloc(local_var_stack, result_width) : -1;
+
+	// Stack arguments first since loading them goes through the argument registers
+	int stack_size = local_var_stack->stack_size;
+	for (int i = argument_count - 1; i >= 0; i--)
+	{
+		if (in_register[i])
+			continue;
+		if (widths[i] == 2 && directive_is_literal(arguments[i]))
+		{
+			load_constant(arguments[i]->token->int_literal >> 16);
+			emit_push(0);
+			load_constant(arguments[i]->token->int_literal);
+			emit_push(0);
+			local_var_stack->stack_size += 2;
+			continue;
+		}
+		push_directive_to_stack(arguments[i], local_var_stack);
+	}
+	int pushed = local_var_stack->stack_size - stack_size;
+
+	int reg = REGISTER_FIRST_ARGUMENT;
+	int argument_registers = 0;
+	if (result_by_reference)
+	{
+		load_slot_addr(result_address, 0, result_width, local_var_stack->stack_size);
+		emit_mov(reg, 0);
+		argument_registers |= 1 << reg;
+		reg++;
+	}
+	for (int i = 0; i < argument_count; i++)
+	{
+		if (!in_register[i])
+			continue;
+		load_directive_value(arguments[i], reg, local_var_stack->stack_size);
+		argument_registers |= 1 << reg;
+		reg++;
+	}
+
+	emit_mhi_symbol(call.token->name);
+	emit_ori_symbol(call.token->name);
+	emit_call(0, argument_registers);
+	if (pushed > 0)
+	{
+		load_constant(pushed);
+		emit_add(REGISTER_SP, 0);
+		local_var_stack->stack_size = stack_size;
+	}
+
+	stack->size = call_index;
+	if (!function || result_width == 0)
+		return;
+	result.token = call.token;
+	if (result_by_reference)
+	{
+		result.address = result_address;
+		result.location = 1;
+		result.type = DIRECTIVE_INT;
+	}
+	else
+	{
+		store_result(&result, result_width, local_var_stack);
+	}
+	directive_stack_push(stack, &result);
+}
+
+// Makes the returned value the result of the call being inlined. Literals stay literals of the declared
+// type so they can be folded into the caller and temporaries are taken over, anything else is stored to a
+// temporary.
+void compile_inline_return(Directive *value, Directive *declared, ProgramVariableStack *local_var_stack)
+{
+	Directive *result = &g_inline_site->result;
+	int width = directive_width(declared);
+	if (width == 1 && directive_is_literal(value))
+	{
+		result->token = value->token;
+		result->location = 0;
+		result->type = DIRECTIVE_INT;
+		result->typed = true;
+		return;
+	}
+	if (directive_is_whole_temporary(value, width))
+	{
+		result->address = value->address;
+		result->location = 1;
+		result->type = DIRECTIVE_INT;
+		return;
+	}
+	if (returned_by_reference(declared))
+	{
+		result->address = frame_alloc(local_var_stack, width);
+		result->location = 1;
+		result->type = DIRECTIVE_INT;
+		copy_directive_value(result, value, local_var_stack->stack_size);
+		return;
+	}
+	if (width == 1)
+		load_directive_value(value, 1, local_var_stack->stack_size);
+	else
+		load_wide_value(value, 1, 2, local_var_stack->stack_size);
+	store_result(result, width, local_var_stack);
+}
+
+// Moves the value into the result registers and returns, value is NULL for a bare return
+void compile_return(Directive *value, ProgramVariableStack *local_var_stack)
+{
+	Function *function = g_inline_site ? g_inline_site->function : g_current_function;
+	if (!function)
+	{
+		puts("Return outside of a function.");
+		return;
+	}
+	Directive declared = declared_directive(function->return_type, function->return_pointer_count);
+	int width = directive_width(&declared);
+	if (!value)
+	{
+		if (width != 0)
+			puts("Missing return value.");
+		if (!g_inline_site)
+			emit_return(0);
+		return;
+	}
+	if (width == 0 || !directive_types_compatible(&declared, value))
+	{
+		puts("Return type not compatible");
+		return;
+	}
+	if (g_inline_site)
+	{
+		compile_inline_return(value, &declared, local_var_stack);
+		return;
+	}
+
+	if (width == 1)
+	{
+		load_directive_value(value, REGISTER_RESULT, local_var_stack->stack_size);
+		emit_return(1 << REGISTER_RESULT);
+		return;
+	}
+	if (directive_is_wide(&declared))
+	{
+		load_wide_value(value, REGISTER_RESULT, REGISTER_RESULT + 1, local_var_stack->stack_size);
+		emit_return((1 << REGISTER_RESULT) | (1 << (REGISTER_RESULT + 1)));
+		return;
+	}
+
+	// Structs are built where the caller wants them
+	Directive destination = declared;
+	destination.address = g_current_function->result_address;
+	destination.ref_count = 1;
+	copy_directive_value(&destination, value, local_var_stack->stack_size);
+	emit_return(0);
+}
+
+void process_directive_stack(DirectiveStack *stack, int next_precedence, bool close_paren,
+							 ProgramVariableStack *local_var_stack)
+{
+	int directive_index = stack->size - 1;
+	while (true)
+	{
+		if (directive_index < 0)
+			return;
+
+		Directive *current_directive = &stack->data[directive_index];
+
+		if (current_directive->type == DIRECTIVE_OPEN_PAREN)
+		{
+			if (!close_paren)
+				return;
+			if(directive_index >= 1)
+			{
+				Directive *previous_directive = &stack->data[directive_index - 1];
+				if(previous_directive->type == DIRECTIVE_CALL)
+				{
+					compile_call(stack, directive_index - 1, local_var_stack);
+					return;
+				}
+			}
+			if (directive_index + 1 >= stack->size)
+			{
+				puts("Failed to compile open paren.");
+				return;
+			}
+			Directive directive = stack->data[directive_index + 1];
+			directive_stack_pop(stack);
+			directive_stack_pop(stack);
+			directive_stack_push(stack, &directive);
+			directive_index = stack->size - 1;
+			return;
+		}
+
+		// The closing bracket of base[index]
+		if (current_directive->type == DIRECTIVE_OPEN_BRACKET)
+		{
+			if (!close_paren)
+				return;
+			if (directive_index == 0 || directive_index + 1 >= stack->size)
+			{
+				puts("Failed to compile index.");
+				return;
+			}
+			Directive element =
+				compile_index(&stack->data[directive_index - 1], &stack->data[directive_index + 1], local_var_stack);
+			stack->size = directive_index - 1;
+			directive_stack_push(stack, &element);
+			return;
+		}
+
+		if(current_directive->type == DIRECTIVE_VAR && next_precedence == 0)
+		{
+			int size = current_directive->type_descriptor->size;
+			if(current_directive->pointer_count + current_directive->type_descriptor->pointer_count > 0)
+				size = 1;
+			if (current_directive->array_length > 0)
+				size = array_element_size(current_directive) * current_directive->array_length;
+			int address = frame_alloc(local_var_stack, size);
+
+			// Variables start out zeroed, stores that are overwritten before they are read get removed later.
+			// Large objects are cleared in one go, the words written before they are read are left out later.
+			if (size > ZERO_STORE_MAX_WORDS)
+			{
+				emit_frame_clear(address, size, local_var_stack->stack_size);
+			}
+			else
+			{
+				emit_movi(0);
+				emit_mov(1, 0);
+				for (int i = 0; i < size; i++)
+				{
+					load_slot_addr(address, i, size, local_var_stack->stack_size);
+					emit_str(0, 1);
+				}
+			}
+
+			ProgramVariable pv = {0};
+			pv.address = address;
+			pv.token = current_directive->token;
+			pv.scope = local_var_stack->scope_counter;
+			pv.pointer_count = current_directive->pointer_count;
+			pv.type_descriptor = current_directive->type_descriptor;
+			pv.array_length = current_directive->array_length;
+			prog_var_stack_push(local_var_stack, &pv);
+			directive_stack_pop(stack);
+			directive_index = stack->size - 1;
+			continue;
+		}
+
+		if (current_directive->type == DIRECTIVE_INT ||
+			current_directive->type == DIRECTIVE_VARIABLE ||
+			current_directive->type == DIRECTIVE_ADDRESS)
+		{
+			directive_index--;
+			continue;
+		}
+
+		if (directive_type_precedence(current_directive->type) < next_precedence)
+			return;
+
+		Directive *rvalue_directive = &stack->data[stack->size - 1];
+		if (current_directive->type == DIRECTIVE_RETURN && rvalue_directive != current_directive)
+		{
+			compile_return(rvalue_directive, local_var_stack);
+			stack->size = directive_index;
+			directive_index = stack->size - 1;
+			continue;
+		}
+		if (rvalue_directive == current_directive)
+		{
+			return;
+		}
+		
+		// Call arguments stay on the stack until the call is compiled
+		if(current_directive->type == DIRECTIVE_COMMA)
+		{
+			directive_index--;
+			continue;
+		}
+
+		if (current_directive->type == DIRECTIVE_REF)
+		{
+			Directive directive = directive_address(rvalue_directive, local_var_stack);
+			directive_stack_pop(stack);
+			directive_stack_pop(stack);
+			directive_stack_push(stack, &directive);
+			directive_index = stack->size - 1;
+			continue;
+		}
+		if (current_directive->type == DIRECTIVE_DEREF)
+		{
+			Directive directive = *rvalue_directive;
+			directive.ref_count++;
+			directive.pointer_count--;
+			directive_stack_pop(stack);
+			directive_stack_pop(stack);
+			directive_stack_push(stack, &directive);
+			directive_index = stack->size - 1;
+			continue;
+		}
+
+		if (directive_index == 0)
+		{
+			puts("Failed to compile assignment directive");
+			return;
+		}
+		Directive *lvalue_directive = &stack->data[directive_index - 1];
+
+		// A pointer plus or minus an integer is fine, scaling happens in compile_add
+		Directive *integer_directive =
+			directive_pointer_level(lvalue_directive) > 0 ? rvalue_directive : lvalue_directive;
+		bool pointer_arithmetic =
+			(current_directive->type == DIRECTIVE_ADD ||
+			 (current_directive->type == DIRECTIVE_SUB && directive_pointer_level(lvalue_directive) > 0)) &&
+			(directive_pointer_level(lvalue_directive) > 0) != (directive_pointer_level(rvalue_directive) > 0) &&
+			(integer_directive->type_descriptor->primitive_type == PRIMITIVE_TYPE_U16 ||
+			 integer_directive->type_descriptor->primitive_type == PRIMITIVE_TYPE_I16);
+		// Pointers can be compared with literals, 0 in particular
+		bool literal_operand = directive_is_comparison(current_directive->type) &&
+								  (directive_is_untyped_literal(lvalue_directive) ||
+								   directive_is_untyped_literal(rvalue_directive));
+		if (!pointer_arithmetic && !literal_operand && !directive_types_compatible(lvalue_directive, rvalue_directive))
+		{
+			puts("Types not compatible");
+			return;
+		}
+
+		if (current_directive->type == DIRECTIVE_ASSIGN)
+		{
+			if (lvalue_directive->type == DIRECTIVE_VAR)
+			{
+				if (lvalue_directive->array_length > 0)
+				{
+					puts("Arrays can not be initialized with a value.");
+					stack->size = directive_index - 1;
+					directive_index = stack->size - 1;
+					continue;
+				}
+				Directive variable = *lvalue_directive;
+				variable.type = DIRECTIVE_VARIABLE;
+				variable.location = 0;
+				// A temporary is only used once, so the variable can take over its slots instead of a copy
+				if (directive_is_whole_temporary(rvalue_directive, directive_storage_size(&variable)))
+				{
+					variable.address = rvalue_directive->address;
+				}
+				else
+				{
+					variable.address = frame_alloc(local_var_stack, directive_storage_size(&variable));
+					copy_directive_value(&variable, rvalue_directive, local_var_stack->stack_size);
+				}
+
+				ProgramVariable pv = {0};
+				pv.address = variable.address;
+				pv.token = lvalue_directive->token;
+				pv.scope = local_var_stack->scope_counter;
+				pv.pointer_count = lvalue_directive->pointer_count;
+				pv.type_descriptor = lvalue_directive->type_descriptor;
+				prog_var_stack_push(local_var_stack, &pv);
+				directive_stack_pop(stack);
+				directive_stack_pop(stack);
+				directive_stack_pop(stack);
+				directive_index = stack->size - 1;
+				continue;
+			}
+
+			copy_directive_value(lvalue_directive, rvalue_directive, local_var_stack->stack_size);
+
+			directive_stack_pop(stack);
+			directive_stack_pop(stack);
+			directive_stack_pop(stack);
+			directive_index = stack->size - 1;
+			continue;
+
+			puts("Failed to compile assignment directive");
+			return;
+		}
+
+		bool operator_handled = false;
+		if (current_directive->type == DIRECTIVE_ADD || current_directive->type == DIRECTIVE_SUB)
+		{
+			compile_add(lvalue_directive, rvalue_directive, current_directive->type == DIRECTIVE_SUB,
+						local_var_stack);
+			operator_handled = true;
+		}
+		if (current_directive->type == DIRECTIVE_MUL)
+		{
+			compile_mul(lvalue_directive, rvalue_directive, local_var_stack);
+			operator_handled = true;
+		}
+		if (directive_is_comparison(current_directive->type))
+		{
+			compile_comparison(lvalue_directive, rvalue_directive, current_directive->type, local_var_stack);
+			operator_handled = true;
+		}
+
+		if (operator_handled)
+		{
+			Directive directive = *lvalue_directive;
+			directive_stack_pop(stack);
+			directive_stack_pop(stack);
+			directive_stack_pop(stack);
+			directive_stack_push(stack, &directive);
+			directive_index = stack->size - 1;
+			continue;
+		}
+
+		puts("Compiler error. Unhandled directive.");
+		directive_stack_pop(stack);
+	}
+}
+
+int type_descriptor_size(TypeDescriptor *descriptor)
+{
+	if (descriptor->pointer_count > 0)
+		return 1;
+	switch (descriptor->primitive_type)
+	{
+	case PRIMITIVE_TYPE_U16:
+	case PRIMITIVE_TYPE_I16:
+		return 1;
+
+	case PRIMITIVE_TYPE_U32:
+	case PRIMITIVE_TYPE_I32:
+		return 2;
+
+	case PRIMITIVE_TYPE_VOID:
+		return 0;
+
+	case PRIMITIVE_TYPE_STRUCT:
+		// TODO: Calculate struct size
+		return 0;
+
+	default:
+		return 1;
+	}
+}
+
+// Parses the [N] following the name of an array at index, leaving index on the closing bracket. Returns
+// the number of elements, 0 when there is no valid count.
+int parse_array_length(TokenVector *tv, int *index)
+{
+	int open = *index + 1;
+	if (open + 2 >= tv->length || tv->data[open + 1].type != TOKEN_TYPE_INTEGER_LITERAL ||
+		tv->data[open + 2].type != TOKEN_TYPE_CLOSE_BRACKET || tv->data[open + 1].int_literal <= 0)
+	{
+		puts("Expected a positive element count in brackets.");
+		return 0;
+	}
+	*index = open + 2;
+	return tv->data[open + 1].int_literal;
+}
 
-		Directive *current_directive = &stack->data[directive_index];
+bool compile_struct(TokenVector *tv, int start_index, int *last_index)
+{
+	StructDescriptor struct_descriptor;
+	struct_descriptor_init(&struct_descriptor, 10);
+	if(tv->length - start_index < 3) goto error_cleanup;
+	Token *identifier_token = &tv->data[start_index + 1];
+	if(tv->data[start_index].type != TOKEN_TYPE_STRUCT) goto error_cleanup;
+	if(tv->data[start_index + 2].type != TOKEN_TYPE_OPEN_BRACE) goto error_cleanup;
+	if(identifier_token->type != TOKEN_TYPE_IDENTIFIER) goto error_cleanup;
+	start_index += 3;
+
+	for(; start_index < tv->length; start_index++)
+	{
+		if(tv->data[start_index].type == TOKEN_TYPE_CLOSE_BRACE) break;
+
+		TypeDescriptor *type_descriptor = get_type_by_name(&g_tdv, &tv->data[start_index]);
+		if(!type_descriptor)
+		{
+			puts("Expected type name in struct definition!");
+			goto error_cleanup;
+		}
+		start_index++;
+		if(start_index >= tv->length)
+		{
+			puts("Unexpected end of struct definition!");
+			goto error_cleanup;
+		}
+
+		int pointer_count = 0;
+		for(; start_index < tv->length && tv->data[start_index].type == TOKEN_TYPE_STAR; start_index++)
+		{
+			pointer_count++;
+		}
+		if(start_index >= tv->length)
+		{
+			puts("Unexpected end of struct definition!");
+			goto error_cleanup;
+		}
+
+		Token *name_token = &tv->data[start_index];
+		if(name_token->type != TOKEN_TYPE_IDENTIFIER)
+		{
+			puts("Expected identifier in struct definition!");
+			goto error_cleanup;
+		}
+		int array_length = 0;
+		if(start_index + 1 < tv->length && tv->data[start_index + 1].type == TOKEN_TYPE_OPEN_BRACKET)
+		{
+			array_length = parse_array_length(tv, &start_index);
+			if(array_length == 0) goto error_cleanup;
+		}
+		start_index++;
+		if(start_index >= tv->length)
+		{
+			puts("Unexpected end of struct definition!");
+			goto error_cleanup;
+		}
+		
+		StructDescriptorEntry entry;
+		entry.type_descriptor = type_descriptor;
+		entry.entry_name = name_token->name;
+		entry.offset = struct_descriptor.size;
+		entry.pointer_count = pointer_count;
+		entry.array_length = array_length;
+		sdev_push(&struct_descriptor.entries, &entry);
+
+		int entry_size = pointer_count > 0 ? 1 : type_descriptor->size;
+		struct_descriptor.size += array_length > 0 ? entry_size * array_length : entry_size;
+
+		if(tv->data[start_index].type == TOKEN_TYPE_SEMICOLON) continue;
+
+		if(tv->data[start_index].type != TOKEN_TYPE_SEMICOLON)
+		{
+			puts("Expected closing semicolon in struct definition!");
+			goto error_cleanup;
+		}
+	}
+
+	TypeDescriptor type_descriptor = {0};
+	type_descriptor.primitive_type = PRIMITIVE_TYPE_STRUCT;
+	type_descriptor.struct_descriptor = struct_descriptor;
+	type_descriptor.type_name = identifier_token->name;
+	type_descriptor.size = struct_descriptor.size;
+	type_desc_vector_push(&g_tdv, &type_descriptor);
+	*last_index = start_index;
+	return true;
+
+	error_cleanup:
+	puts("Failed to compile struct");
+	struct_descriptor_free(&struct_descriptor);
+	return false;
+}
+
+// Whether the array whose last token is at index is indexed or has its address taken. Anywhere else an array
+// means the address of its first element. depth is the number of directives of the array on the stack.
+bool array_used_in_place(TokenVector *tv, int index, DirectiveStack *stack, int depth)
+{
+	bool indexed = index + 1 < tv->length && tv->data[index + 1].type == TOKEN_TYPE_OPEN_BRACKET;
+	bool referenced = stack->size > depth && stack->data[stack->size - depth - 1].type == DIRECTIVE_REF;
+	return indexed || referenced;
+}
+
+// Compiles the tokens from start_index up to end or the first semicolon. Whatever the tokens before end
+// leave on the stack stays there, which is how the value of a condition is handed back.
+bool compile_token_range(TokenVector *tv, int start_index, int end, DirectiveStack *stack,
+						 ProgramVariableStack *local_var_stack, int *last_index)
+{
+	int token_vector_index = start_index;
+	for (; token_vector_index < end; token_vector_index++)
+	{
+		int paren_count = 0;
+		Token *current_token = &tv->data[token_vector_index];
+		TypeDescriptor *type_descriptor = get_type_by_name(&g_tdv, current_token);
+		if (type_descriptor)
+		{
+			int pointer_count = 0;
+			token_vector_index++;
+			if (token_vector_index >= tv->length)
+			{
+				puts("Invalid variable definition.");
+				*last_index = token_vector_index;
+				return false;
+			}
+			for(; token_vector_index < tv->length && tv->data[token_vector_index].type == TOKEN_TYPE_STAR; token_vector_index++)
+			{
+				pointer_count++;
+			}
+			if (token_vector_index >= tv->length)
+			{
+				puts("Invalid variable definition.");
+				*last_index = token_vector_index;
+				return false;
+			}
+			current_token = &tv->data[token_vector_index];
+			if (current_token->type != TOKEN_TYPE_IDENTIFIER)
+			{
+				puts("Invalid variable definition. Expected identifier.");
+				*last_index = token_vector_index;
+				return false;
+			}
+			Directive directive = {0};
+			directive.token = current_token;
+			directive.type = DIRECTIVE_VAR;
+			directive.type_descriptor = type_descriptor;
+			directive.pointer_count = pointer_count;
+			if (token_vector_index + 1 < tv->length && tv->data[token_vector_index + 1].type == TOKEN_TYPE_OPEN_BRACKET)
+			{
+				directive.array_length = parse_array_length(tv, &token_vector_index);
+				if (directive.array_length == 0)
+				{
+					*last_index = token_vector_index;
+					return false;
+				}
+			}
+			directive_stack_push(stack, &directive);
+			continue;
+		}
+		if (current_token->type == TOKEN_TYPE_SEMICOLON)
+		{
+			if (stack->size == 1 && stack->data[0].type == DIRECTIVE_RETURN)
+			{
+				compile_return(NULL, local_var_stack);
+				directive_stack_pop(stack);
+			}
+			process_directive_stack(stack, 0, false, local_var_stack);
+			// The value of an expression statement, like a call whose result isn't used, is dropped
+			if (stack->size == 1 && (stack->data[0].type == DIRECTIVE_INT || stack->data[0].type == DIRECTIVE_VARIABLE ||
+									 stack->data[0].type == DIRECTIVE_ADDRESS))
+				directive_stack_pop(stack);
+			if (stack->size != 0)
+			{
+				puts("Failed to compile expression. Some directives could not be processed");
+				*last_index = token_vector_index;
+				return false;
+			}
+			*last_index = token_vector_index;
+			return true;
+		}
+
+		if (current_token->type == TOKEN_TYPE_CLOSE_PAREN)
+		{
+			// return f(...); where this paren closes the call
+			g_tail_position = stack->size >= 3 && stack->data[0].type == DIRECTIVE_RETURN &&
+							  stack->data[1].type == DIRECTIVE_CALL && token_vector_index + 1 < tv->length &&
+							  tv->data[token_vector_index + 1].type == TOKEN_TYPE_SEMICOLON;
+			for (int i = 3; i < stack->size; i++)
+			{
+				if (stack->data[i].type == DIRECTIVE_OPEN_PAREN)
+					g_tail_position = false;
+			}
+			process_directive_stack(stack, 0, true, local_var_stack);
+			g_tail_position = false;
+			continue;
+		}
+		if (current_token->type == TOKEN_TYPE_OPEN_PAREN)
+		{
+			Directive directive = {0};
+			directive.type = DIRECTIVE_OPEN_PAREN;
+			directive.type_descriptor= get_type_by_name(&g_tdv, &(Token){.type = TOKEN_TYPE_VOID});
+			directive_stack_push(stack, &directive);
+			continue;
+		}
+		if (current_token->type == TOKEN_TYPE_OPEN_BRACKET)
+		{
+			Directive directive = {0};
+			directive.type = DIRECTIVE_OPEN_BRACKET;
+			directive.type_descriptor = get_type_by_name(&g_tdv, &(Token){.type = TOKEN_TYPE_VOID});
+			directive_stack_push(stack, &directive);
+			continue;
+		}
+		if (current_token->type == TOKEN_TYPE_CLOSE_BRACKET)
+		{
+			process_directive_stack(stack, 0, true, local_var_stack);
+			continue;
+		}
+		// Field access applies to the value right before it
+		if (current_token->type == TOKEN_TYPE_DOT || current_token->type == TOKEN_TYPE_ARROW)
+		{
+			Directive *base = stack->size > 0 ? &stack->data[stack->size - 1] : NULL;
+			if (!base || token_vector_index + 1 >= end || tv->data[token_vector_index + 1].type != TOKEN_TYPE_IDENTIFIER ||
+				(base->type != DIRECTIVE_VARIABLE && base->type != DIRECTIVE_INT && base->type != DIRECTIVE_ADDRESS))
+			{
+				puts("Expected a value before and a field name after . or ->.");
+				*last_index = token_vector_index;
+				return false;
+			}
+			token_vector_index++;
+			if (!compile_member(base, current_token->type == TOKEN_TYPE_ARROW, &tv->data[token_vector_index],
+								local_var_stack))
+			{
+				*last_index = token_vector_index;
+				return false;
+			}
+			if (base->array_length > 0 && !array_used_in_place(tv, token_vector_index, stack, 1))
+				*base = directive_address(base, local_var_stack);
+			continue;
+		}
+
+		DirectiveType directive_type = DIRECTIVE_INVALID;
+		switch (current_token->type)
+		{
+		case TOKEN_TYPE_EQUALS:
+			directive_type = DIRECTIVE_ASSIGN;
+			break;
+
+		case TOKEN_TYPE_PLUS:
+			directive_type = DIRECTIVE_ADD;
+			break;
+
+		case TOKEN_TYPE_MINUS:
+			directive_type = DIRECTIVE_SUB;
+			break;
+
+		case TOKEN_TYPE_STAR:
+			if (stack->size == 0)
+			{
+				directive_type = DIRECTIVE_DEREF;
+				break;
+			}
+			if (stack->size >= 1 &&
+				stack->data[stack->size - 1].type != DIRECTIVE_VARIABLE &&
+				stack->data[stack->size - 1].type != DIRECTIVE_INT)
+			{
+				directive_type = DIRECTIVE_DEREF;
+				break;
+			}
+			directive_type = DIRECTIVE_MUL;
+			break;
+
+		case TOKEN_TYPE_AMP:
+			directive_type = DIRECTIVE_REF;
+			break;
+
+		case TOKEN_TYPE_COMMA:
+			directive_type = DIRECTIVE_COMMA;
+			break;
+
+		case TOKEN_TYPE_EQUAL_EQUAL:
+			directive_type = DIRECTIVE_EQUAL;
+			break;
+
+		case TOKEN_TYPE_NOT_EQUAL:
+			directive_type = DIRECTIVE_NOT_EQUAL;
+			break;
+
+		case TOKEN_TYPE_LESS:
+			directive_type = DIRECTIVE_LESS;
+			break;
+
+		case TOKEN_TYPE_LESS_EQUAL:
+			directive_type = DIRECTIVE_LESS_EQUAL;
+			break;
+
+		case TOKEN_TYPE_GREATER:
+			directive_type = DIRECTIVE_GREATER;
+			break;
+
+		case TOKEN_TYPE_GREATER_EQUAL:
+			directive_type = DIRECTIVE_GREATER_EQUAL;
+			break;
+
+		case TOKEN_TYPE_RETURN:
+			directive_type = DIRECTIVE_RETURN;
+			break;
+
+		case TOKEN_TYPE_INTEGER_LITERAL:
+			directive_type = DIRECTIVE_INT;
+			break;
+
+		case TOKEN_TYPE_IDENTIFIER:
+			directive_type = DIRECTIVE_VARIABLE;
+			break;
+
+		default:
+			puts("Invalid token type encountered while compiling.");
+			*last_index = token_vector_index;
+			return false;
+		}
+		int directive_precedence = directive_type_precedence(directive_type);
 
-		if (current_directive->type == DIRECTIVE_OPEN_PAREN)
+		for (int i = stack->size - 1; i >= 0; i--)
 		{
-			if (!close_paren)
-				return;
-			if(directive_index >= 1)
+			if (stack->data[i].type != DIRECTIVE_VARIABLE &&
+				stack->data[i].type != DIRECTIVE_INT &&
+				stack->data[i].type != DIRECTIVE_OPEN_PAREN &&
+				stack->data[i].type != DIRECTIVE_OPEN_BRACKET &&
+				stack->data[i].type != DIRECTIVE_VAR)
 			{
-				Directive *previous_directive = &stack->data[directive_index - 1];
-				if(previous_directive->type == DIRECTIVE_CALL)
+				if (directive_precedence <= directive_type_precedence(stack->data[i].type))
 				{
-					if(directive_index + 1 < stack->size)
-					{
-						Directive *next_directive = &stack->data[directive_index + 1];
-						if (next_directive->location == 0)
-							move_directive_to_stack(next_directive, local_var_stack);
-						directive_stack_pop(stack);
-					}
-					printf("movi HI(%s)\n", previous_directive->token->name);
-					printf("movi LO(%s)\n", previous_directive->token->name);
-					puts("call r0");
-					directive_stack_pop(stack);
-					directive_stack_pop(stack);
-					directive_index = stack->size - 1;
-					return;
+					process_directive_stack(stack, directive_precedence, false, local_var_stack);
 				}
+				break;
 			}
-			if (directive_index + 1 >= stack->size)
+		}
+
+		current_token = &tv->data[token_vector_index];
+
+		if (current_token->type == TOKEN_TYPE_IDENTIFIER)
+		{
+			int next_next_token_index = token_vector_index + 1;
+			// This is a function call
+			if (next_next_token_index < tv->length && tv->data[next_next_token_index].type == TOKEN_TYPE_OPEN_PAREN)
 			{
-				puts("Failed to compile open paren.");
-				return;
+				Directive directive = {0};
+				directive.token = current_token;
+				directive.type = DIRECTIVE_CALL;
+				directive.type_descriptor = get_type_by_name(&g_tdv, &(Token){.type = TOKEN_TYPE_VOID});
+				directive_stack_push(stack, &directive);
+				continue;
+			}
+
+			// This is a variable, locals hide globals of the same name
+			ProgramVariable *pv = prog_var_stack_find(local_var_stack, current_token->name);
+			if (!pv)
+				pv = global_find(&g_globals, current_token->name);
+			if (!pv)
+			{
+				puts("Could not find variable.");
+				*last_index = token_vector_index;
+				return false;
+			}
+
+			Directive directive = {0};
+			directive.token = current_token;
+			directive.location = 0;
+			directive.address = pv->address;
+			directive.type = DIRECTIVE_VARIABLE;
+			directive.ref_count = pv->ref_count;
+			if (pv->literal)
+			{
+				directive.token = pv->literal;
+				directive.type = DIRECTIVE_INT;
+				directive.typed = true;
+			}
+			directive.type_descriptor = pv->type_descriptor;
+			directive.pointer_count = pv->pointer_count;
+			directive.symbol = pv->symbol;
+			if (pv->array_length > 0)
+			{
+				directive.array_length = pv->array_length;
+				directive.object_size = array_element_size(&directive) * pv->array_length;
+				if (!array_used_in_place(tv, token_vector_index, stack, 0))
+					directive = directive_address(&directive, local_var_stack);
 			}
-			Directive directive = stack->data[directive_index + 1];
-			directive_stack_pop(stack);
-			directive_stack_pop(stack);
 			directive_stack_push(stack, &directive);
-			directive_index = stack->size - 1;
+			continue;
+		}
+
+		if (current_token->type == TOKEN_TYPE_INTEGER_LITERAL)
+		{
+			Directive directive = {0};
+			directive.token = current_token;
+			directive.type = DIRECTIVE_INT;
+			directive.type_descriptor = get_type_by_name(&g_tdv, &(Token){.type = TOKEN_TYPE_I16});
+			directive_stack_push(stack, &directive);
+			continue;
+		}
+
+		Directive directive = {0};
+		directive.token = current_token;
+		directive.type = directive_type;
+		directive.type_descriptor= get_type_by_name(&g_tdv, &(Token){.type = TOKEN_TYPE_VOID});
+		directive_stack_push(stack, &directive);
+		continue;
+	}
+
+	*last_index = token_vector_index;
+	return true;
+}
+
+bool compile_tokens(TokenVector *tv, int start_index, DirectiveStack *stack, ProgramVariableStack *local_var_stack,
+					int *last_index)
+{
+	if (!compile_token_range(tv, start_index, tv->length, stack, local_var_stack, last_index))
+		return false;
+	if (stack->size != 0)
+	{
+		puts("Failed to compile expression. Some directives could not be processed");
+		return false;
+	}
+	return true;
+}
+
+// Compiles the expression between start and end, which may not contain a semicolon, and leaves its value
+// on the stack. Assignments leave nothing.
+bool compile_expression(TokenVector *tv, int start, int end, DirectiveStack *stack,
+						ProgramVariableStack *local_var_stack)
+{
+	int last_index = start;
+	if (!compile_token_range(tv, start, end, stack, local_var_stack, &last_index))
+		return false;
+	if (last_index < end)
+	{
+		puts("Unexpected semicolon in expression.");
+		return false;
+	}
+	process_directive_stack(stack, 0, false, local_var_stack);
+	return true;
+}
+
+// The index of the paren or brace closing the one at index, tv->length when it is never closed
+int matching_token(TokenVector *tv, int index)
+{
+	TokenType open = tv->data[index].type;
+	TokenType close = open == TOKEN_TYPE_OPEN_PAREN ? TOKEN_TYPE_CLOSE_PAREN : TOKEN_TYPE_CLOSE_BRACE;
+	int depth = 0;
+	for (; index < tv->length; index++)
+	{
+		if (tv->data[index].type == open)
+			depth++;
+		else if (tv->data[index].type == close && --depth == 0)
+			return index;
+	}
+	return index;
+}
+
+// The index of the last token of the statement starting at index
+int statement_end(TokenVector *tv, int index)
+{
+	if (index >= tv->length)
+		return tv->length;
+	switch (tv->data[index].type)
+	{
+	case TOKEN_TYPE_OPEN_BRACE:
+		return matching_token(tv, index);
+	case TOKEN_TYPE_WHILE:
+	case TOKEN_TYPE_FOR:
+		if (index + 1 >= tv->length || tv->data[index + 1].type != TOKEN_TYPE_OPEN_PAREN)
+			return tv->length;
+		return statement_end(tv, matching_token(tv, index + 1) + 1);
+	case TOKEN_TYPE_IF:
+		if (index + 1 >= tv->length || tv->data[index + 1].type != TOKEN_TYPE_OPEN_PAREN)
+			return tv->length;
+		index = statement_end(tv, matching_token(tv, index + 1) + 1);
+		if (index + 1 < tv->length && tv->data[index + 1].type == TOKEN_TYPE_ELSE)
+			return statement_end(tv, index + 2);
+		return index;
+	default:
+		while (index < tv->length && tv->data[index].type != TOKEN_TYPE_SEMICOLON)
+			index++;
+		return index;
+	}
+}
+
+// Branches to label when whether the condition is not zero equals when. Literal conditions are decided here.
+bool compile_branch(Directive *condition, int label, bool when, ProgramVariableStack *local_var_stack)
+{
+	if (directive_is_literal(condition))
+	{
+		if (((condition->token->int_literal & 0xFFFF) != 0) == when)
+			emit_b(label);
+		return true;
+	}
+	if (directive_is_wide(condition))
+	{
+		load_wide_value(condition, 1, 2, local_var_stack->stack_size);
+		if (when)
+		{
+			emit_bnz(1, label);
+			emit_bnz(2, label);
+			return true;
+		}
+		int nonzero = emit_new_label();
+		emit_bnz(1, nonzero);
+		emit_bz(2, label);
+		emit_label(nonzero, local_var_stack->stack_size);
+		return true;
+	}
+	if (directive_width(condition) != 1)
+	{
+		puts("Condition must be an integer or a pointer.");
+		return false;
+	}
+	load_directive_value(condition, 1, local_var_stack->stack_size);
+	if (when)
+		emit_bnz(1, label);
+	else
+		emit_bz(1, label);
+	return true;
+}
+
+// Compiles the condition between start and end and branches to label when whether it holds equals when.
+// An empty condition always holds. A comparison at the top of the condition is fused with the branch.
+bool compile_condition(TokenVector *tv, int start, int end, int label, bool when, DirectiveStack *stack,
+					   ProgramVariableStack *local_var_stack)
+{
+	if (start == end)
+	{
+		if (when)
+			emit_b(label);
+		return true;
+	}
+	int last_index = start;
+	if (!compile_token_range(tv, start, end, stack, local_var_stack, &last_index))
+		return false;
+	if (last_index < end)
+	{
+		puts("Unexpected semicolon in expression.");
+		stack->size = 0;
+		return false;
+	}
+
+	// Everything that binds tighter than the comparison, leaving value, comparison, value
+	process_directive_stack(stack, COMPARISON_PRECEDENCE + 1, false, local_var_stack);
+	bool result;
+	if (stack->size == 3 && directive_is_comparison(stack->data[1].type))
+	{
+		Directive *lvalue_directive = &stack->data[0];
+		Directive *rvalue_directive = &stack->data[2];
+		if (!directive_types_compatible(lvalue_directive, rvalue_directive) &&
+			!directive_is_untyped_literal(lvalue_directive) && !directive_is_untyped_literal(rvalue_directive))
+		{
+			puts("Types not compatible");
+			stack->size = 0;
+			return false;
+		}
+		result = compile_comparison_branch(lvalue_directive, rvalue_directive, stack->data[1].type, when, label,
+										   local_var_stack);
+		stack->size = 0;
+		return result;
+	}
+
+	process_directive_stack(stack, 0, false, local_var_stack);
+	if (stack->size != 1)
+	{
+		puts("Expected a value as the condition.");
+		stack->size = 0;
+		return false;
+	}
+	result = compile_branch(&stack->data[0], label, when, local_var_stack);
+	stack->size = 0;
+	return result;
+}
+
+// Whether the tokens between start and end assign the variable
+bool tokens_assign(TokenVector *tv, int start, int end, const char *name)
+{
+	for (int i = start; i + 1 < end; i++)
+	{
+		if (tv->data[i].type == TOKEN_TYPE_IDENTIFIER && !strcmp(tv->data[i].name, name) &&
+			tv->data[i + 1].type == TOKEN_TYPE_EQUALS)
+			return true;
+	}
+	return false;
+}
+
+// Counts the products of the variable and the constant written as name * constant or constant * name
+// between start and end. Products that are part of a longer chain of multiplications or derefs are left
+// out since they don't multiply the variable itself.
+int count_products(TokenVector *tv, int start, int end, const char *name, int factor)
+{
+	int count = 0;
+	for (int i = start; i + 2 < end; i++)
+	{
+		Token *first = &tv->data[i];
+		Token *third = &tv->data[i + 2];
+		if (tv->data[i + 1].type != TOKEN_TYPE_STAR || (i > start && (tv->data[i - 1].type == TOKEN_TYPE_STAR ||
+																	 tv->data[i - 1].type == TOKEN_TYPE_AMP)))
+			continue;
+		if (first->type == TOKEN_TYPE_IDENTIFIER && !strcmp(first->name, name) &&
+			third->type == TOKEN_TYPE_INTEGER_LITERAL && (int16_t)third->int_literal == factor)
+			count++;
+		else if (first->type == TOKEN_TYPE_INTEGER_LITERAL && (int16_t)first->int_literal == factor &&
+				 third->type == TOKEN_TYPE_IDENTIFIER && !strcmp(third->name, name) &&
+				 (i + 3 >= end || tv->data[i + 3].type != TOKEN_TYPE_OPEN_PAREN))
+			count++;
+	}
+	return count;
+}
+
+// Recognizes the step of a for loop as name = name + constant, name = name - constant or
+// name = constant + name and returns the variable and how much it changes by
+ProgramVariable *induction_step(TokenVector *tv, int start, int end, ProgramVariableStack *local_var_stack,
+								int *step)
+{
+	if (end - start != 5)
+		return NULL;
+	Token *tokens = &tv->data[start];
+	if (tokens[0].type != TOKEN_TYPE_IDENTIFIER || tokens[1].type != TOKEN_TYPE_EQUALS)
+		return NULL;
+	const char *name = tokens[0].name;
+	if (tokens[2].type == TOKEN_TYPE_IDENTIFIER && !strcmp(tokens[2].name, name) &&
+		(tokens[3].type == TOKEN_TYPE_PLUS || tokens[3].type == TOKEN_TYPE_MINUS) &&
+		tokens[4].type == TOKEN_TYPE_INTEGER_LITERAL)
+	{
+		*step = tokens[3].type == TOKEN_TYPE_PLUS ? tokens[4].int_literal : -tokens[4].int_literal;
+	}
+	else if (tokens[2].type == TOKEN_TYPE_INTEGER_LITERAL && tokens[3].type == TOKEN_TYPE_PLUS &&
+			 tokens[4].type == TOKEN_TYPE_IDENTIFIER && !strcmp(tokens[4].name, name))
+	{
+		*step = tokens[2].int_literal;
+	}
+	else
+	{
+		return NULL;
+	}
+
+	ProgramVariable *pv = prog_var_stack_find(local_var_stack, name);
+	if (!pv || pv->literal || pv->ref_count != 0 || pv->pointer_count != 0 || pv->type_descriptor->pointer_count != 0)
+		return NULL;
+	if (pv->type_descriptor->primitive_type != PRIMITIVE_TYPE_U16 &&
+		pv->type_descriptor->primitive_type != PRIMITIVE_TYPE_I16)
+		return NULL;
+	return pv;
+}
+
+// Strength reduction of the induction variable of a for loop. Every product of the variable and a constant
+// in the condition and the body that costs more to compute each time than to keep up to date gets a slot
+// of its own. It is set after the loop is initialized and the step times the constant is added to it
+// after every step, so the multiplications in the loop become loads. The variable may not be assigned
+// anywhere but in the step or have its address taken.
+void reduce_induction_products(TokenVector *tv, int step_start, int step_end, int ranges[2][2], LoopScope *loop,
+							   ProgramVariableStack *local_var_stack)
+{
+	int step = 0;
+	ProgramVariable *pv = induction_step(tv, step_start, step_end, local_var_stack, &step);
+	if (!pv)
+		return;
+	const char *name = pv->token->name;
+	for (int r = 0; r < 2; r++)
+	{
+		if (tokens_assign(tv, ranges[r][0], ranges[r][1], name))
+			return;
+	}
+	for (int i = 0; i + 1 < tv->length; i++)
+	{
+		if (tv->data[i].type == TOKEN_TYPE_AMP && tv->data[i + 1].type == TOKEN_TYPE_IDENTIFIER &&
+			!strcmp(tv->data[i + 1].name, name))
 			return;
+	}
+
+	Directive variable = {0};
+	variable.type = DIRECTIVE_VARIABLE;
+	variable.token = pv->token;
+	variable.address = pv->address;
+	variable.type_descriptor = pv->type_descriptor;
+	for (int r = 0; r < 2; r++)
+	{
+		for (int i = ranges[r][0]; i + 1 < ranges[r][1] && loop->product_count < LOOP_MAX_PRODUCTS; i++)
+		{
+			// Every constant something is multiplied by is looked at once, where it first appears
+			if (tv->data[i].type != TOKEN_TYPE_INTEGER_LITERAL ||
+				(tv->data[i + 1].type != TOKEN_TYPE_STAR && (i == 0 || tv->data[i - 1].type != TOKEN_TYPE_STAR)))
+				continue;
+			int factor = (int16_t)tv->data[i].int_literal;
+			bool known = false;
+			for (int j = 0; j < loop->product_count; j++)
+				known |= loop->products[j].factor == factor;
+			int count = count_products(tv, ranges[0][0], ranges[0][1], name, factor) +
+						count_products(tv, ranges[1][0], ranges[1][1], name, factor);
+			if (known || count * multiply_constant_cost(factor) <= PRODUCT_UPDATE_COST)
+				continue;
+
+			InductionProduct *product = &loop->products[loop->product_count++];
+			product->variable = pv->address;
+			product->factor = factor;
+			product->step = step * factor;
+			product->address = frame_alloc(local_var_stack, 1);
+			load_directive_value(&variable, 1, local_var_stack->stack_size);
+			emit_multiply_constant(1, 2, factor);
+			load_slot_addr(product->address, 0, 1, local_var_stack->stack_size);
+			emit_str(0, 1);
+		}
+	}
+}
+
+// Adds the step of the induction variable times the constant to every product the loop keeps
+void update_induction_products(LoopScope *loop, ProgramVariableStack *local_var_stack)
+{
+	for (int i = 0; i < loop->product_count; i++)
+	{
+		InductionProduct *product = &loop->products[i];
+		load_slot_addr(product->address, 0, 1, local_var_stack->stack_size);
+		emit_ldr(1, 0);
+		load_constant(product->step);
+		emit_add(1, 0);
+		load_slot_addr(product->address, 0, 1, local_var_stack->stack_size);
+		emit_str(0, 1);
+	}
+}
+
+// The slot a for loop keeps the product of the variable at address and the factor in, -1 if there is none
+int induction_product(int address, int factor)
+{
+	for (LoopScope *loop = g_loop; loop; loop = loop->parent)
+	{
+		for (int i = 0; i < loop->product_count; i++)
+		{
+			if (loop->products[i].variable == address && loop->products[i].factor == (int16_t)factor)
+				return loop->products[i].address;
+		}
+	}
+	return -1;
+}
+
+// Compiles the statements of a block up to its closing brace, the variables declared in it go out of
+// scope at the end
+bool compile_block(TokenVector *tv, int start_index, DirectiveStack *stack, ProgramVariableStack *local_var_stack,
+				   int *last_index)
+{
+	int variable_count = local_var_stack->length;
+	local_var_stack->scope_counter++;
+	int index = start_index + 1;
+	bool result = true;
+	while (index < tv->length && tv->data[index].type != TOKEN_TYPE_CLOSE_BRACE)
+	{
+		if (!compile_statement(tv, index, stack, local_var_stack, &index))
+		{
+			result = false;
+			break;
+		}
+		index++;
+	}
+	if (result && index >= tv->length)
+	{
+		puts("Expected closing brace of block.");
+		result = false;
+	}
+	local_var_stack->length = variable_count;
+	*last_index = index;
+	return result;
+}
+
+// Loops are laid out with the condition at the bottom, so every iteration runs a single branch:
+//     b test
+// body:
+//     body statement
+// test:
+//     branch to body when the condition holds
+bool compile_while(TokenVector *tv, int start_index, DirectiveStack *stack, ProgramVariableStack *local_var_stack,
+				   int *last_index)
+{
+	int open = start_index + 1;
+	int close = open < tv->length && tv->data[open].type == TOKEN_TYPE_OPEN_PAREN ? matching_token(tv, open) : tv->length;
+	if (close + 1 >= tv->length)
+	{
+		puts("Expected condition in parens after while.");
+		*last_index = tv->length;
+		return false;
+	}
+
+	int body = emit_new_label();
+	int test = emit_new_label();
+	emit_b(test);
+	emit_label(body, local_var_stack->stack_size);
+	if (!compile_statement(tv, close + 1, stack, local_var_stack, last_index))
+		return false;
+	emit_label(test, local_var_stack->stack_size);
+	return compile_condition(tv, open + 1, close, body, true, stack, local_var_stack);
+}
+
+// for (init; condition; step) body, laid out like a while loop with the step at the end of the body. The
+// variables declared in init belong to the loop.
+bool compile_for(TokenVector *tv, int start_index, DirectiveStack *stack, ProgramVariableStack *local_var_stack,
+				 int *last_index)
+{
+	int open = start_index + 1;
+	int close = open < tv->length && tv->data[open].type == TOKEN_TYPE_OPEN_PAREN ? matching_token(tv, open) : tv->length;
+	int separators[2];
+	int separator_count = 0;
+	for (int i = open + 1; i < close; i++)
+	{
+		if (tv->data[i].type == TOKEN_TYPE_SEMICOLON && separator_count < 2)
+			separators[separator_count++] = i;
+	}
+	if (close + 1 >= tv->length || separator_count != 2)
+	{
+		puts("Expected init, condition and step in parens after for.");
+		*last_index = tv->length;
+		return false;
+	}
+	int variable_count = local_var_stack->length;
+	local_var_stack->scope_counter++;
+	int index = open + 1;
+	bool result = separators[0] == index || compile_tokens(tv, index, stack, local_var_stack, &index);
+
+	LoopScope loop = {0};
+	loop.parent = g_loop;
+	if (result && g_options.passes.level >= OPTIMIZATION_O2)
+	{
+		int ranges[2][2] = {{separators[0] + 1, separators[1]}, {close + 1, statement_end(tv, close + 1)}};
+		reduce_induction_products(tv, separators[1] + 1, close, ranges, &loop, local_var_stack);
+	}
+
+	int body = emit_new_label();
+	int test = emit_new_label();
+	if (result)
+	{
+		emit_b(test);
+		emit_label(body, local_var_stack->stack_size);
+		g_loop = &loop;
+		result = compile_statement(tv, close + 1, stack, local_var_stack, last_index);
+		g_loop = loop.parent;
+	}
+	if (result && separators[1] + 1 < close)
+	{
+		result = compile_expression(tv, separators[1] + 1, close, stack, local_var_stack);
+		if (result && stack->size != 0)
+		{
+			puts("The step of a for loop may not leave a value.");
+			stack->size = 0;
+			result = false;
+		}
+	}
+	if (result)
+	{
+		update_induction_products(&loop, local_var_stack);
+		emit_label(test, local_var_stack->stack_size);
+		g_loop = &loop;
+		result = compile_condition(tv, separators[0] + 1, separators[1], body, true, stack, local_var_stack);
+		g_loop = loop.parent;
+	}
+	local_var_stack->length = variable_count;
+	return result;
+}
+
+// The then branch is assumed to be the likely one and falls through from the condition, which branches
+// away only when it fails:
+//     branch to otherwise unless the condition holds
+//     then statement
+//     b end
+// otherwise:
+//     else statement
+// end:
+bool compile_if(TokenVector *tv, int start_index, DirectiveStack *stack, ProgramVariableStack *local_var_stack,
+				int *last_index)
+{
+	int open = start_index + 1;
+	int close = open < tv->length && tv->data[open].type == TOKEN_TYPE_OPEN_PAREN ? matching_token(tv, open) : tv->length;
+	if (close + 1 >= tv->length)
+	{
+		puts("Expected condition in parens after if.");
+		*last_index = tv->length;
+		return false;
+	}
+
+	int otherwise = emit_new_label();
+	if (!compile_condition(tv, open + 1, close, otherwise, false, stack, local_var_stack) ||
+		!compile_statement(tv, close + 1, stack, local_var_stack, last_index))
+		return false;
+	if (*last_index + 1 >= tv->length || tv->data[*last_index + 1].type != TOKEN_TYPE_ELSE)
+	{
+		emit_label(otherwise, local_var_stack->stack_size);
+		return true;
+	}
+
+	int end = emit_new_label();
+	InstructionVector *iv = g_emit_target;
+	if (iv->length == 0 || !instruction_ends_flow(&iv->data[iv->length - 1]))
+		emit_b(end);
+	emit_label(otherwise, local_var_stack->stack_size);
+	if (!compile_statement(tv, *last_index + 2, stack, local_var_stack, last_index))
+		return false;
+	emit_label(end, local_var_stack->stack_size);
+	return true;
+}
+
+// Compiles the statement starting at start_index, last_index is set to its last token
+bool compile_statement(TokenVector *tv, int start_index, DirectiveStack *stack,
+					   ProgramVariableStack *local_var_stack, int *last_index)
+{
+	if (start_index < tv->length)
+	{
+		switch (tv->data[start_index].type)
+		{
+		case TOKEN_TYPE_OPEN_BRACE:
+			return compile_block(tv, start_index, stack, local_var_stack, last_index);
+		case TOKEN_TYPE_WHILE:
+			return compile_while(tv, start_index, stack, local_var_stack, last_index);
+		case TOKEN_TYPE_FOR:
+			return compile_for(tv, start_index, stack, local_var_stack, last_index);
+		case TOKEN_TYPE_IF:
+			return compile_if(tv, start_index, stack, local_var_stack, last_index);
+		default:
+			break;
 		}
+	}
+	return compile_tokens(tv, start_index, stack, local_var_stack, last_index);
+}
 
-		if(current_directive->type == DIRECTIVE_VAR && next_precedence == 0)
-		{
-			int push_count = 0;
-			puts("movi #0");
-			if(current_directive->pointer_count + current_directive->type_descriptor->pointer_count > 0)
-			{
-				puts("push r0");
-				push_count++;
-			}
-			else
-			{
-				for(int i = 0; i < current_directive->type_descriptor->size; i++)
-				{
-					puts("push r0");
-					push_count++;
-				}
-			}
-			local_var_stack->stack_size += push_count;
+// Whether the tokens at index start a function definition: a type, optional stars, a name and an open paren
+bool is_function_definition(TokenVector *tv, int index)
+{
+	if (!get_type_by_name(&g_tdv, &tv->data[index]))
+		return false;
+	index++;
+	while (index < tv->length && tv->data[index].type == TOKEN_TYPE_STAR)
+		index++;
+	return index + 1 < tv->length && tv->data[index].type == TOKEN_TYPE_IDENTIFIER &&
+		   tv->data[index + 1].type == TOKEN_TYPE_OPEN_PAREN;
+}
 
-			ProgramVariable pv = {0};
-			pv.address = local_var_stack->stack_size - push_count;
-			pv.token = current_directive->token;
-			pv.scope = local_var_stack->scope_counter;
-			pv.pointer_count = current_directive->pointer_count;
-			pv.type_descriptor = current_directive->type_descriptor;
-			prog_var_stack_push(local_var_stack, &pv);
-			directive_stack_pop(stack);
-			directive_index = stack->size - 1;
-			continue;
-		}
+// Parses a type with optional stars at index, leaving index on the token after the stars
+TypeDescriptor *parse_type(TokenVector *tv, int *index, int *pointer_count)
+{
+	TypeDescriptor *type_descriptor = get_type_by_name(&g_tdv, &tv->data[*index]);
+	if (!type_descriptor)
+		return NULL;
+	*pointer_count = 0;
+	for ((*index)++; *index < tv->length && tv->data[*index].type == TOKEN_TYPE_STAR; (*index)++)
+	{
+		(*pointer_count)++;
+	}
+	return type_descriptor;
+}
 
-		if (current_directive->type == DIRECTIVE_INT ||
-			current_directive->type == DIRECTIVE_VARIABLE ||
-			current_directive->type == DIRECTIVE_ADDRESS)
+// Decides whether calls to the function can be inlined and estimates what that costs. The body is inlined
+// by compiling its statements again in the caller, so a return is only allowed as the last statement and
+// not inside a block or loop. The size is measured on an optimized copy of the code, which is what the call
+// would be replaced by.
+void analyze_inline(Function *function)
+{
+	TokenVector *tv = function->tokens;
+	int return_index = -1;
+	int last_statement = function->body_start;
+	int depth = 0;
+	function->inlinable = true;
+	for (int i = function->body_start; i < function->body_end; i++)
+	{
+		Token *token = &tv->data[i];
+		if (token->type == TOKEN_TYPE_SEMICOLON && i + 1 < function->body_end)
+			last_statement = i + 1;
+		if (token->type == TOKEN_TYPE_OPEN_BRACE)
+			depth++;
+		if (token->type == TOKEN_TYPE_CLOSE_BRACE)
+			depth--;
+		if (token->type == TOKEN_TYPE_RETURN)
 		{
-			directive_index--;
-			continue;
+			if (return_index != -1 || depth != 0 ||
+				(i > function->body_start && tv->data[i - 1].type != TOKEN_TYPE_SEMICOLON &&
+				 tv->data[i - 1].type != TOKEN_TYPE_CLOSE_BRACE))
+				function->inlinable = false;
+			return_index = i;
 		}
+	}
+	Directive declared = declared_directive(function->return_type, function->return_pointer_count);
+	if (return_index == -1 ? directive_width(&declared) != 0 : return_index < last_statement)
+		function->inlinable = false;
 
-		if (directive_type_precedence(current_directive->type) < next_precedence)
-			return;
+	InstructionVector copy = {0};
+	instruction_vector_init(&copy, function->instructions.length + 1);
+	for (int i = 0; i < function->instructions.length; i++)
+	{
+		instruction_vector_push(&copy, &function->instructions.data[i]);
+	}
+	pass_manager_run(PIPELINE_INLINE_ESTIMATE, &copy, function->token->name, true);
+	function->inline_size = 0;
+	for (int i = 0; i < copy.length; i++)
+	{
+		if (copy.data[i].opcode != OPCODE_RETURN)
+			function->inline_size++;
+	}
+	instruction_vector_free(&copy);
+}
 
-		Directive *rvalue_directive = &stack->data[stack->size - 1];
-		if (rvalue_directive == current_directive)
+// Looks through the body before it is compiled for parameters that are assigned or have their address taken
+// and for address taken locals
+void scan_body(Function *function)
+{
+	TokenVector *tv = function->tokens;
+	for (int i = function->body_start, depth = 0; i < tv->length && depth >= 0; i++)
+	{
+		Token *token = &tv->data[i];
+		if (token->type == TOKEN_TYPE_OPEN_BRACE)
+			depth++;
+		if (token->type == TOKEN_TYPE_CLOSE_BRACE)
+			depth--;
+		if (token->type == TOKEN_TYPE_AMP)
+			function->takes_address = true;
+		if (token->type != TOKEN_TYPE_IDENTIFIER)
+			continue;
+		for (int p = 0; p < function->parameter_count; p++)
 		{
-			return;
+			if (strcmp(token->name, function->parameters[p].token->name))
+				continue;
+			if ((i + 1 < tv->length && tv->data[i + 1].type == TOKEN_TYPE_EQUALS) ||
+				(i > function->body_start && tv->data[i - 1].type == TOKEN_TYPE_AMP))
+			{
+				function->parameter_written[p] = true;
+			}
 		}
-		
-		if(current_directive->type == DIRECTIVE_COMMA)
+	}
+}
+
+bool compile_function(TokenVector *tv, int start_index, int *last_index)
+{
+	Function function = {0};
+	int index = start_index;
+	function.return_type = parse_type(tv, &index, &function.return_pointer_count);
+	function.token = &tv->data[index];
+	if (function_find(&g_functions, function.token->name))
+	{
+		puts("Function already defined.");
+		return false;
+	}
+	index += 2;
+
+	for (; index < tv->length && tv->data[index].type != TOKEN_TYPE_CLOSE_PAREN; index++)
+	{
+		if (function.parameter_count > 0)
 		{
-			if(!close_paren)
+			if (tv->data[index].type != TOKEN_TYPE_COMMA)
 			{
-				directive_index--;
-				continue;
+				puts("Expected comma between parameters.");
+				return false;
 			}
-
-			push_directive_to_stack(rvalue_directive, local_var_stack);
-			directive_stack_pop(stack);
-			directive_stack_pop(stack);
-			directive_index = stack->size - 1;
-			continue;
+			index++;
 		}
-
-		if (current_directive->type == DIRECTIVE_REF)
+		if (function.parameter_count == FUNCTION_MAX_PARAMETERS)
 		{
-			puts("mov r0, sp");
-			printf("addi #%d\n", local_var_stack->stack_size - rvalue_directive->address);
-			puts("push r0");
-
-			Directive directive = *rvalue_directive;
-			directive.ref_count = 0;
-			directive.type = DIRECTIVE_ADDRESS;
-			directive.location = 1;
-			directive.address = local_var_stack->stack_size;
-			directive.pointer_count++;
-			local_var_stack->stack_size++;
-			directive_stack_pop(stack);
-			directive_stack_pop(stack);
-			directive_stack_push(stack, &directive);
-			directive_index = stack->size - 1;
-			continue;
+			puts("Too many parameters.");
+			return false;
 		}
-		if (current_directive->type == DIRECTIVE_DEREF)
+		ProgramVariable *parameter = &function.parameters[function.parameter_count];
+		if (index >= tv->length || !(parameter->type_descriptor = parse_type(tv, &index, &parameter->pointer_count)))
 		{
-			Directive directive = *rvalue_directive;
-			directive.ref_count++;
-			directive.pointer_count--;
-			directive_stack_pop(stack);
-			directive_stack_pop(stack);
-			directive_stack_push(stack, &directive);
-			directive_index = stack->size - 1;
-			continue;
+			puts("Expected parameter type.");
+			return false;
 		}
-
-		if (directive_index == 0)
+		if (index >= tv->length || tv->data[index].type != TOKEN_TYPE_IDENTIFIER)
 		{
-			puts("Failed to compile assignment directive");
-			return;
+			puts("Expected parameter name.");
+			return false;
 		}
-		Directive *lvalue_directive = &stack->data[directive_index - 1];
+		parameter->token = &tv->data[index];
+		function.parameter_count++;
+	}
+	index++;
+	if (index >= tv->length || tv->data[index].type != TOKEN_TYPE_OPEN_BRACE)
+	{
+		puts("Expected function body.");
+		return false;
+	}
+	index++;
+	function.tokens = tv;
+	function.body_start = index;
+	scan_body(&function);
+
+	// Registered before the body is compiled so the function can call itself
+	function_vector_push(&g_functions, &function);
+	g_current_function = &g_functions.data[g_functions.length - 1];
+	InstructionVector *previous_target = g_emit_target;
+	instruction_vector_init(&g_current_function->instructions, 100);
+	g_emit_target = &g_current_function->instructions;
 
-		if (lvalue_directive->type_descriptor->primitive_type != rvalue_directive->type_descriptor->primitive_type ||
-			lvalue_directive->type_descriptor->pointer_count != rvalue_directive->type_descriptor->pointer_count ||
-			lvalue_directive->pointer_count != rvalue_directive->pointer_count)
+	DirectiveStack stack = {0};
+	stack.data = malloc(sizeof(Directive) * 100);
+	ProgramVariableStack local_var_stack = {0};
+	local_var_stack.data = malloc(sizeof(ProgramVariable) * 100);
+
+	// Register arguments are saved before anything else can clobber them, stack arguments are copied into
+	// the frame so parameters are ordinary locals in the body
+	int reg = REGISTER_FIRST_ARGUMENT;
+	Directive result_declared = declared_directive(function.return_type, function.return_pointer_count);
+	g_current_function->result_address = -1;
+	if (returned_by_reference(&result_declared))
+	{
+		g_current_function->result_address = frame_alloc(&local_var_stack, 1);
+		load_slot_addr(g_current_function->result_address, 0, 1, 0);
+		emit_str(0, reg);
+		reg++;
+	}
+	int stack_word = 0;
+	int first_stack_word[FUNCTION_MAX_PARAMETERS]; // -1 for parameters passed in registers
+	for (int i = 0; i < function.parameter_count; i++)
+	{
+		ProgramVariable parameter = function.parameters[i];
+		Directive declared = declared_directive(parameter.type_descriptor, parameter.pointer_count);
+		int width = argument_width(&declared);
+		parameter.ref_count = passed_by_reference(&declared) ? 1 : 0;
+		parameter.address = frame_alloc(&local_var_stack, width);
+		parameter.scope = local_var_stack.scope_counter;
+		first_stack_word[i] = -1;
+		if (width == 1 && reg < REGISTER_FIRST_ARGUMENT + REGISTER_ARGUMENT_COUNT)
 		{
-			puts("Types not compatible");
-			return;
+			load_slot_addr(parameter.address, 0, 1, 0);
+			emit_str(0, reg);
+			reg++;
 		}
-
-		if (current_directive->type == DIRECTIVE_ASSIGN)
+		else
 		{
-			if (lvalue_directive->type == DIRECTIVE_VAR)
-			{
-				if (rvalue_directive->location == 0)
-				{
-					if (rvalue_directive->type == DIRECTIVE_INT)
-					{
-						printf("movi #%d\n", rvalue_directive->token->int_literal);
-						puts("push r0");
-						local_var_stack->stack_size++;
-					}
-					else
-					{
-						puts("mov r0, sp");
-						printf("addi #%d\n", local_var_stack->stack_size - rvalue_directive->address);
-						puts("ldr r2, r0");
-						puts("push r2");
-						local_var_stack->stack_size++;
-					}
-				}
-				ProgramVariable pv = {0};
-				pv.address = local_var_stack->stack_size - 1;
-				pv.token = lvalue_directive->token;
-				pv.scope = local_var_stack->scope_counter;
-				pv.pointer_count = lvalue_directive->pointer_count;
-				pv.type_descriptor = lvalue_directive->type_descriptor;
-				prog_var_stack_push(local_var_stack, &pv);
-				directive_stack_pop(stack);
-				directive_stack_pop(stack);
-				directive_stack_pop(stack);
-				directive_index = stack->size - 1;
-				continue;
-			}
-
-			copy_directive_value(lvalue_directive, rvalue_directive, local_var_stack->stack_size);
-
-			directive_stack_pop(stack);
-			directive_stack_pop(stack);
-			directive_stack_pop(stack);
-			directive_index = stack->size - 1;
-			continue;
-
-			puts("Failed to compile assignment directive");
-			return;
+			first_stack_word[i] = stack_word;
+			stack_word += width;
 		}
-
-		bool operator_handled = false;
-		if (current_directive->type == DIRECTIVE_ADD)
+		prog_var_stack_push(&local_var_stack, &parameter);
+	}
+	for (int i = 0; i < function.parameter_count; i++)
+	{
+		if (first_stack_word[i] == -1)
+			continue;
+		ProgramVariable *parameter = &local_var_stack.data[i];
+		Directive declared = declared_directive(parameter->type_descriptor, parameter->pointer_count);
+		int width = argument_width(&declared);
+		for (int word = 0; word < width; word++)
 		{
-			compile_add(lvalue_directive, rvalue_directive, local_var_stack);
-			operator_handled = true;
+			emit_arg_addr(first_stack_word[i] + word, 0);
+			emit_ldr(1, 0);
+			load_slot_addr(parameter->address, word, width, 0);
+			emit_str(0, 1);
 		}
+	}
+	// Structs passed by reference belong to the caller, the body gets its own copy if it writes them
+	for (int i = 0; i < function.parameter_count; i++)
+	{
+		ProgramVariable *parameter = &local_var_stack.data[i];
+		if (parameter->ref_count == 0 || !function.parameter_written[i])
+			continue;
+		Directive reference = declared_directive(parameter->type_descriptor, parameter->pointer_count);
+		reference.address = parameter->address;
+		reference.ref_count = 1;
+		Directive copy = declared_directive(parameter->type_descriptor, parameter->pointer_count);
+		copy.address = frame_alloc(&local_var_stack, directive_width(&copy));
+		copy_directive_value(&copy, &reference, 0);
+		parameter->address = copy.address;
+		parameter->ref_count = 0;
+	}
 
-		if (operator_handled)
+	bool result = true;
+	while (index < tv->length && tv->data[index].type != TOKEN_TYPE_CLOSE_BRACE)
+	{
+		if (!compile_statement(tv, index, &stack, &local_var_stack, &index))
 		{
-			Directive directive = *lvalue_directive;
-			directive_stack_pop(stack);
-			directive_stack_pop(stack);
-			directive_stack_pop(stack);
-			directive_stack_push(stack, &directive);
-			directive_index = stack->size - 1;
-			continue;
+			result = false;
+			break;
 		}
-
-		puts("Compiler error. Unhandled directive.");
-		directive_stack_pop(stack);
+		index++;
 	}
-}
-
-int type_descriptor_size(TypeDescriptor *descriptor)
-{
-	if (descriptor->pointer_count > 0)
-		return 1;
-	switch (descriptor->primitive_type)
+	if (result && index >= tv->length)
 	{
-	case PRIMITIVE_TYPE_U16:
-	case PRIMITIVE_TYPE_I16:
-		return 1;
-
-	case PRIMITIVE_TYPE_VOID:
-		return 0;
-
-	case PRIMITIVE_TYPE_STRUCT:
-		// TODO: Calculate struct size
-		return 0;
-
-	default:
-		return 1;
+		puts("Expected closing brace of function body.");
+		result = false;
 	}
+
+	// Falling off the end returns
+	InstructionVector *instructions = &g_current_function->instructions;
+	Opcode last_opcode = instructions->length > 0 ? instructions->data[instructions->length - 1].opcode : OPCODE_INVALID;
+	if (last_opcode != OPCODE_RETURN && last_opcode != OPCODE_TAIL_CALL)
+		emit_return(0);
+	g_current_function->body_end = index;
+	if (result)
+		analyze_inline(g_current_function);
+
+	free(stack.data);
+	free(local_var_stack.data);
+	g_emit_target = previous_target;
+	g_current_function = NULL;
+	*last_index = index;
+	return result;
 }
 
-bool compile_struct(TokenVector *tv, int start_index, int *last_index)
+// Parses an integer literal at index, which may be negated, and leaves index on the literal. Returns false
+// when there is none.
+bool parse_constant(TokenVector *tv, int *index, int *value)
 {
-	StructDescriptor struct_descriptor;
-	struct_descriptor_init(&struct_descriptor, 10);
-	if(tv->length - start_index < 3) goto error_cleanup;
-	Token *identifier_token = &tv->data[start_index + 1];
-	if(tv->data[start_index].type != TOKEN_TYPE_STRUCT) goto error_cleanup;
-	if(tv->data[start_index + 2].type != TOKEN_TYPE_OPEN_BRACE) goto error_cleanup;
-	if(identifier_token->type != TOKEN_TYPE_IDENTIFIER) goto error_cleanup;
-	start_index += 3;
+	bool negate = *index < tv->length && tv->data[*index].type == TOKEN_TYPE_MINUS;
+	int literal = *index + (negate ? 1 : 0);
+	if (literal >= tv->length || tv->data[literal].type != TOKEN_TYPE_INTEGER_LITERAL)
+		return false;
+	*value = negate ? -tv->data[literal].int_literal : tv->data[literal].int_literal;
+	*index = literal;
+	return true;
+}
 
-	for(; start_index < tv->length; start_index++)
+// Compiles global type name; with an optional initializer, a constant or a list of constants in braces
+// for arrays. Globals are addressed through their symbol and visible everywhere after their declaration.
+// Initialized globals are emitted as data words and the others are zero filled in bss, so no code runs to
+// set them up.
+bool compile_global(TokenVector *tv, int start_index, int *last_index)
+{
+	*last_index = tv->length;
+	int index = start_index + 1;
+	int pointer_count = 0;
+	TypeDescriptor *type_descriptor = index < tv->length ? parse_type(tv, &index, &pointer_count) : NULL;
+	if (!type_descriptor || index >= tv->length || tv->data[index].type != TOKEN_TYPE_IDENTIFIER)
 	{
-		if(tv->data[start_index].type == TOKEN_TYPE_CLOSE_BRACE) break;
+		puts("Expected a type and a name after global.");
+		return false;
+	}
+	GlobalVariable global = {0};
+	ProgramVariable *variable = &global.variable;
+	variable->token = &tv->data[index];
+	variable->type_descriptor = type_descriptor;
+	variable->pointer_count = pointer_count;
+	variable->symbol = variable->token->name;
+	if (global_find(&g_globals, variable->symbol) || function_find(&g_functions, variable->symbol))
+	{
+		puts("The name of the global is already in use.");
+		return false;
+	}
+	if (index + 1 < tv->length && tv->data[index + 1].type == TOKEN_TYPE_OPEN_BRACKET)
+	{
+		variable->array_length = parse_array_length(tv, &index);
+		if (variable->array_length == 0)
+			return false;
+	}
 
-		TypeDescriptor *type_descriptor = get_type_by_name(&g_tdv, &tv->data[start_index]);
-		if(!type_descriptor)
+	Directive element = {0};
+	element.type_descriptor = type_descriptor;
+	element.pointer_count = pointer_count;
+	int element_size = array_element_size(&element);
+	int element_count = variable->array_length > 0 ? variable->array_length : 1;
+	global.size = element_size * element_count;
+	index++;
+
+	if (index < tv->length && tv->data[index].type == TOKEN_TYPE_EQUALS)
+	{
+		if (pointer_count == 0 && type_descriptor->primitive_type == PRIMITIVE_TYPE_STRUCT)
 		{
-			puts("Expected type name in struct definition!");
-			goto error_cleanup;
+			puts("Only integers, pointers and arrays of them can be initialized.");
+			return false;
 		}
-		start_index++;
-		if(start_index >= tv->length)
+		global.values = calloc(global.size, sizeof(int));
+		bool list = variable->array_length > 0;
+		index++;
+		if (list && (index >= tv->length || tv->data[index++].type != TOKEN_TYPE_OPEN_BRACE))
 		{
-			puts("Unexpected end of struct definition!");
-			goto error_cleanup;
+			puts("Expected a list of constants in braces to initialize the array.");
+			return false;
 		}
-
-		int pointer_count = 0;
-		for(; start_index < tv->length && tv->data[start_index].type == TOKEN_TYPE_STAR; start_index++)
+		for (int i = 0;; i++)
 		{
-			pointer_count++;
+			int value;
+			if (!parse_constant(tv, &index, &value))
+			{
+				puts("Globals can only be initialized with constants.");
+				return false;
+			}
+			if (i >= element_count)
+			{
+				puts("Too many constants to initialize the array.");
+				return false;
+			}
+			global.values[i * element_size] = value & 0xFFFF;
+			if (element_size == 2)
+				global.values[i * element_size + 1] = (value >> 16) & 0xFFFF;
+			index++;
+			if (!list || index >= tv->length || tv->data[index].type != TOKEN_TYPE_COMMA)
+				break;
+			index++;
 		}
-		if(start_index >= tv->length)
+		if (list && (index >= tv->length || tv->data[index++].type != TOKEN_TYPE_CLOSE_BRACE))
 		{
-			puts("Unexpected end of struct definition!");
-			goto error_cleanup;
+			puts("Expected a closing brace after the constants.");
+			return false;
 		}
 
-		Token *name_token = &tv->data[start_index];
-		if(name_token->type != TOKEN_TYPE_IDENTIFIER)
+		// Zero initialized globals cost nothing in bss
+		bool zero = true;
+		for (int i = 0; i < global.size; i++)
+			zero &= global.values[i] == 0;
+		if (zero)
 		{
-			puts("Expected identifier in struct definition!");
-			goto error_cleanup;
+			free(global.values);
+			global.values = NULL;
 		}
-		start_index++;
-		if(start_index >= tv->length)
+	}
+	if (index >= tv->length || tv->data[index].type != TOKEN_TYPE_SEMICOLON)
+	{
+		puts("Expected semicolon after global.");
+		return false;
+	}
+	global_vector_push(&g_globals, &global);
+	*last_index = index;
+	return true;
+}
+
+// Prints initialized globals to the data section and the others to the bss section, which is zeroed before
+// the entry code runs
+void print_globals(GlobalVariableVector *globals)
+{
+	bool data = false;
+	bool bss = false;
+	for (int i = 0; i < globals->length; i++)
+	{
+		data |= globals->data[i].values != NULL;
+		bss |= globals->data[i].values == NULL;
+	}
+	if (data)
+	{
+		puts(".data");
+		for (int i = 0; i < globals->length; i++)
+		{
+			GlobalVariable *global = &globals->data[i];
+			if (!global->values)
+				continue;
+			printf("%s:\n", global->variable.symbol);
+			for (int word = 0; word < global->size; word++)
+				printf(".word %d\n", global->values[word]);
+		}
+	}
+	if (bss)
+	{
+		puts(".bss");
+		for (int i = 0; i < globals->length; i++)
 		{
-			puts("Unexpected end of struct definition!");
-			goto error_cleanup;
+			GlobalVariable *global = &globals->data[i];
+			if (global->values)
+				continue;
+			printf("%s:\n", global->variable.symbol);
+			printf(".zero %d\n", global->size);
 		}
-		
-		StructDescriptorEntry entry;
-		entry.type_descriptor = type_descriptor;
-		entry.entry_name = name_token->name;
-		entry.offset = struct_descriptor.size;
-		entry.pointer_count = pointer_count;
-		sdev_push(&struct_descriptor.entries, &entry);
-
-		struct_descriptor.size += pointer_count > 0 ? 1 : type_descriptor->size;
+	}
+}
 
-		if(tv->data[start_index].type == TOKEN_TYPE_SEMICOLON) continue;
+// Marks the function and everything it calls, directly or not, as reachable
+void mark_reachable(const char *name, bool *reachable)
+{
+	Function *function = function_find(&g_functions, name);
+	if (!function || reachable[function - g_functions.data])
+		return;
+	reachable[function - g_functions.data] = true;
+	for (int i = 0; i < function->callees.length; i++)
+		mark_reachable(function->callees.data[i], reachable);
+}
 
-		if(tv->data[start_index].type != TOKEN_TYPE_SEMICOLON)
+// Drops the functions that can't be reached from the entry code through the call graph and reports them
+// on stderr. Only valid for whole programs, a library's functions are called from outside.
+void eliminate_dead_functions(void)
+{
+	bool *reachable = calloc(g_functions.length + 1, sizeof(bool));
+	for (int i = 0; i < g_entry_callees.length; i++)
+		mark_reachable(g_entry_callees.data[i], reachable);
+
+	int length = 0;
+	int removed_instructions = 0;
+	int function_count = g_functions.length;
+	for (int i = 0; i < g_functions.length; i++)
+	{
+		Function *function = &g_functions.data[i];
+		if (reachable[i])
 		{
-			puts("Expected closing semicolon in struct definition!");
-			goto error_cleanup;
+			g_functions.data[length++] = *function;
+			continue;
 		}
+		fprintf(stderr, "Removed unreachable function %s (%d instructions)\n", function->token->name,
+				function->instructions.length);
+		removed_instructions += function->instructions.length;
+		instruction_vector_free(&function->instructions);
+		free(function->callees.data);
 	}
+	g_functions.length = length;
+	fprintf(stderr, "Dead function elimination removed %d of %d functions, %d instructions\n",
+			function_count - length, function_count, removed_instructions);
+	free(reachable);
+}
 
-	TypeDescriptor type_descriptor = {0};
-	type_descriptor.primitive_type = PRIMITIVE_TYPE_STRUCT;
-	type_descriptor.struct_descriptor = struct_descriptor;
-	type_descriptor.type_name = identifier_token->name;
-	type_descriptor.size = struct_descriptor.size;
-	type_desc_vector_push(&g_tdv, &type_descriptor);
-	*last_index = start_index;
-	return true;
+// Runs the program as it was printed in the emulator and reports the statistics on stderr
+bool run_program(InstructionVector *entry, OutlinedFunctionVector *outlined)
+{
+	CycleTable table;
+	cycle_table_init(&table);
+	if (g_options.cycle_table_path && !cycle_table_load(&table, g_options.cycle_table_path))
+		return false;
 
-	error_cleanup:
-	puts("Failed to compile struct");
-	struct_descriptor_free(&struct_descriptor);
-	return false;
+	EmulatorProgram *program = emulator_program_new();
+	emulator_add_code(program, NULL, entry);
+	for (int i = 0; i < g_functions.length; i++)
+		emulator_add_code(program, g_functions.data[i].token->name, &g_functions.data[i].instructions);
+	for (int i = 0; i < outlined->length; i++)
+		emulator_add_code(program, outlined->data[i].name, &outlined->data[i].instructions);
+	for (int i = 0; i < g_globals.length; i++)
+	{
+		GlobalVariable *global = &g_globals.data[i];
+		emulator_add_data(program, global->variable.symbol, global->values, global->size);
+	}
+
+	EmulatorStatistics statistics;
+	bool halted = g_options.translate ? translate_run(program, &table, g_options.run_limit, &statistics)
+									  : emulator_run(program, &table, g_options.run_limit, &statistics);
+	emulator_print_statistics(&statistics);
+	emulator_program_free(program);
+	return halted;
 }
 
-bool compile_tokens(TokenVector *tv, int start_index, DirectiveStack *stack, ProgramVariableStack *local_var_stack,
-					int *last_index)
+bool parse_arguments(int argc, const char **argv, CompilerOptions *options)
 {
-	int token_vector_index = start_index;
-	for (; token_vector_index < tv->length; token_vector_index++)
+	options->inline_threshold = INLINE_DEFAULT_THRESHOLD;
+	options->run_limit = EMULATOR_DEFAULT_LIMIT;
+	options->passes.level = OPTIMIZATION_O2;
+	bool inline_threshold_given = false;
+	for (int i = 1; i < argc; i++)
 	{
-		int paren_count = 0;
-		Token *current_token = &tv->data[token_vector_index];
-		TypeDescriptor *type_descriptor = get_type_by_name(&g_tdv, current_token);
-		if (type_descriptor)
+		if (!strcmp(argv[i], "--frame-pointer"))
 		{
-			int pointer_count = 0;
-			token_vector_index++;
-			if (token_vector_index >= tv->length)
-			{
-				puts("Invalid variable definition.");
-				*last_index = token_vector_index;
-				return false;
-			}
-			for(; token_vector_index < tv->length && tv->data[token_vector_index].type == TOKEN_TYPE_STAR; token_vector_index++)
-			{
-				pointer_count++;
-			}
-			if (token_vector_index >= tv->length)
-			{
-				puts("Invalid variable definition.");
-				*last_index = token_vector_index;
-				return false;
-			}
-			current_token = &tv->data[token_vector_index];
-			if (current_token->type != TOKEN_TYPE_IDENTIFIER)
-			{
-				puts("Invalid variable definition. Expected identifier.");
-				*last_index = token_vector_index;
-				return false;
-			}
-			Directive directive = {0};
-			directive.token = current_token;
-			directive.type = DIRECTIVE_VAR;
-			directive.type_descriptor = type_descriptor;
-			directive.pointer_count = pointer_count;
-			directive_stack_push(stack, &directive);
+			options->passes.frame_pointer = true;
 			continue;
 		}
-		if (current_token->type == TOKEN_TYPE_SEMICOLON)
+		if (!strcmp(argv[i], "--frame-report"))
 		{
-			process_directive_stack(stack, 0, false, local_var_stack);
-			if (stack->size != 0)
-			{
-				puts("Failed to compile expression. Some directives could not be processed");
-				*last_index = token_vector_index;
-				return false;
-			}
-			*last_index = token_vector_index;
-			return true;
+			options->passes.frame_report = true;
+			continue;
 		}
-
-		if (current_token->type == TOKEN_TYPE_CLOSE_PAREN)
+		if (!strcmp(argv[i], "--time-passes"))
 		{
-			process_directive_stack(stack, 0, true, local_var_stack);
+			options->passes.time_passes = true;
 			continue;
 		}
-		if (current_token->type == TOKEN_TYPE_OPEN_PAREN)
+		if (!strcmp(argv[i], "--stats"))
 		{
-			Directive directive = {0};
-			directive.type = DIRECTIVE_OPEN_PAREN;
-			directive.type_descriptor= get_type_by_name(&g_tdv, &(Token){.type = TOKEN_TYPE_VOID});
-			directive_stack_push(stack, &directive);
+			options->passes.stats = true;
 			continue;
 		}
-
-		DirectiveType directive_type = DIRECTIVE_INVALID;
-		switch (current_token->type)
+		if (!strcmp(argv[i], "--whole-program"))
 		{
-		case TOKEN_TYPE_EQUALS:
-			directive_type = DIRECTIVE_ASSIGN;
-			break;
-
-		case TOKEN_TYPE_PLUS:
-			directive_type = DIRECTIVE_ADD;
-			break;
-
-		case TOKEN_TYPE_MINUS:
-			directive_type = DIRECTIVE_SUB;
-			break;
-
-		case TOKEN_TYPE_STAR:
-			if (stack->size == 0)
-			{
-				directive_type = DIRECTIVE_DEREF;
-				break;
-			}
-			if (stack->size >= 1 &&
-				stack->data[stack->size - 1].type != DIRECTIVE_VARIABLE &&
-				stack->data[stack->size - 1].type != DIRECTIVE_INT)
-			{
-				directive_type = DIRECTIVE_DEREF;
-				break;
-			}
-			directive_type = DIRECTIVE_MUL;
-			break;
-
-		case TOKEN_TYPE_AMP:
-			directive_type = DIRECTIVE_REF;
-			break;
-
-		case TOKEN_TYPE_COMMA:
-			directive_type = DIRECTIVE_COMMA;
-			break;
-
-		case TOKEN_TYPE_INTEGER_LITERAL:
-			directive_type = DIRECTIVE_INT;
-			break;
-
-		case TOKEN_TYPE_IDENTIFIER:
-			directive_type = DIRECTIVE_VARIABLE;
-			break;
-
-		default:
-			puts("Invalid token type encountered while compiling.");
-			*last_index = token_vector_index;
-			return false;
+			options->whole_program = true;
+			continue;
 		}
-		int directive_precedence = directive_type_precedence(directive_type);
-
-		for (int i = stack->size - 1; i >= 0; i--)
+		if (!strcmp(argv[i], "--run"))
 		{
-			if (stack->data[i].type != DIRECTIVE_VARIABLE &&
-				stack->data[i].type != DIRECTIVE_INT &&
-				stack->data[i].type != DIRECTIVE_OPEN_PAREN &&
-				stack->data[i].type != DIRECTIVE_VAR)
-			{
-				if (directive_precedence <= directive_type_precedence(stack->data[i].type))
-				{
-					process_directive_stack(stack, directive_precedence, false, local_var_stack);
-				}
-				break;
-			}
+			options->run = true;
+			continue;
 		}
-
-		current_token = &tv->data[token_vector_index];
-
-		if (current_token->type == TOKEN_TYPE_IDENTIFIER)
+		if (!strcmp(argv[i], "--translate"))
 		{
-			int next_next_token_index = token_vector_index + 1;
-			// This is a function call
-			if (next_next_token_index < tv->length && tv->data[next_next_token_index].type == TOKEN_TYPE_OPEN_PAREN)
+			options->translate = true;
+			continue;
+		}
+		if (!strcmp(argv[i], "--cycle-table") || !strcmp(argv[i], "--run-limit"))
+		{
+			if (i + 1 >= argc)
 			{
-				Directive directive = {0};
-				directive.token = current_token;
-				directive.type = DIRECTIVE_CALL;
-				directive.type_descriptor = get_type_by_name(&g_tdv, &(Token){.type = TOKEN_TYPE_VOID});
-				directive_stack_push(stack, &directive);
-				continue;
+				printf("Missing value for %s.\n", argv[i]);
+				return false;
 			}
-
-			// This is a variable
-			ProgramVariable *pv = prog_var_stack_find(local_var_stack, current_token->name);
-			if (!pv)
+			if (argv[i][2] == 'c')
+				options->cycle_table_path = argv[i + 1];
+			else
+				options->run_limit = atoll(argv[i + 1]);
+			i++;
+			continue;
+		}
+		if (!strcmp(argv[i], "-O0") || !strcmp(argv[i], "-O1") || !strcmp(argv[i], "-O2") || !strcmp(argv[i], "-Os"))
+		{
+			OptimizationLevel levels[] = {OPTIMIZATION_O0, OPTIMIZATION_O1, OPTIMIZATION_O2};
+			options->passes.level = argv[i][2] == 's' ? OPTIMIZATION_OS : levels[argv[i][2] - '0'];
+			continue;
+		}
+		if (!strcmp(argv[i], "--inline-threshold"))
+		{
+			if (++i >= argc)
 			{
-				puts("Could not find variable.");
-				*last_index = token_vector_index;
+				puts("Missing value for --inline-threshold.");
 				return false;
 			}
-
-			Directive directive = {0};
-			directive.token = current_token;
-			directive.location = 0;
-			directive.address = pv->address;
-			directive.type = DIRECTIVE_VARIABLE;
-			directive.type_descriptor = pv->type_descriptor;
-			directive.pointer_count = pv->pointer_count;
-			directive_stack_push(stack, &directive);
+			options->inline_threshold = atoi(argv[i]);
+			inline_threshold_given = true;
 			continue;
 		}
-
-		if (current_token->type == TOKEN_TYPE_INTEGER_LITERAL)
+		if (argv[i][0] == '-')
 		{
-			Directive directive = {0};
-			directive.token = current_token;
-			directive.type = DIRECTIVE_INT;
-			directive.type_descriptor = get_type_by_name(&g_tdv, &(Token){.type = TOKEN_TYPE_I16});
-			directive_stack_push(stack, &directive);
-			continue;
+			printf("Unknown option %s\n", argv[i]);
+			return false;
 		}
-
-		Directive directive = {0};
-		directive.token = current_token;
-		directive.type = directive_type;
-		directive.type_descriptor= get_type_by_name(&g_tdv, &(Token){.type = TOKEN_TYPE_VOID});
-		directive_stack_push(stack, &directive);
-		continue;
+		options->source_path = argv[i];
 	}
 
-	if (stack->size != 0)
+	if (!options->source_path)
 	{
-		puts("Failed to compile expression. Some directives could not be processed");
-		*last_index = token_vector_index;
+		puts("Filepath argument missing.");
 		return false;
 	}
-	*last_index = token_vector_index;
+	// Optimizing for size only inlines calls that don't make the code bigger
+	if (options->passes.level == OPTIMIZATION_OS && !inline_threshold_given)
+		options->inline_threshold = 0;
 	return true;
 }
 
 int main(int argc, const char **argv)
 {
-	if (argc < 2)
+	if (!parse_arguments(argc, argv, &g_options))
 	{
-		puts("Filepath argument missing.");
 		return 1;
 	}
 
-	FILE *file = fopen(argv[1], "r");
+	FILE *file = fopen(g_options.source_path, "r");
 	if (!file)
 	{
-		printf("Failed to open file %s\n", argv[1]);
+		printf("Failed to open file %s\n", g_options.source_path);
 		return 1;
 	}
 
+	pass_manager_init(&g_options.passes);
+	PhaseTimer timer;
+	pass_manager_phase_begin(&timer);
 	TokenVector tv = {0};
 	token_vector_init(&tv, 10);
 	tokenize_file(file, &tv);
+	pass_manager_phase_end(&timer, "tokenize");
 
 	type_desc_vector_init(&g_tdv);
 
+	DirectiveStack stack = {0};
+	stack.data = malloc(sizeof(Directive) * 100);
+	ProgramVariableStack local_var_stack = {0};
+	local_var_stack.data = malloc(sizeof(ProgramVariable) * 100);
+	InstructionVector instructions = {0};
+	instruction_vector_init(&instructions, 100);
+	g_emit_target = &instructions;
+
+	printf("Count: %d\n", tv.length);
+	token_vector_print(&tv);
+
+	// Top level statements make up the entry code, structs and functions can appear between them
+	pass_manager_phase_begin(&timer);
 	int last_index = 0;
-	bool result = compile_struct(&tv, last_index, &last_index);
-	if(!result)
+	while (last_index < tv.length)
 	{
-		return 1;
+		bool result = true;
+		if (tv.data[last_index].type == TOKEN_TYPE_STRUCT)
+			result = compile_struct(&tv, last_index, &last_index);
+		else if (tv.data[last_index].type == TOKEN_TYPE_GLOBAL)
+			result = compile_global(&tv, last_index, &last_index);
+		else if (is_function_definition(&tv, last_index))
+			result = compile_function(&tv, last_index, &last_index);
+		else
+			compile_statement(&tv, last_index, &stack, &local_var_stack, &last_index);
+		if (!result)
+			return 1;
+		last_index++;
 	}
-	last_index++;
-	if(last_index >= tv.length)
+	pass_manager_phase_end(&timer, "codegen");
+
+	// Before optimizing, so no time is spent on code that is dropped anyway
+	if (g_options.whole_program)
+		eliminate_dead_functions();
+
+	pass_manager_run(PIPELINE_FUNCTION, &instructions, "top level code", false);
+	for (int i = 0; i < g_functions.length; i++)
 	{
-		return 0;
+		pass_manager_run(PIPELINE_FUNCTION, &g_functions.data[i].instructions, g_functions.data[i].token->name, true);
 	}
-	result = compile_struct(&tv, last_index, &last_index);
-	if(!result)
+
+	// Keep the entry code from running into the function bodies and the data
+	g_emit_target = &instructions;
+	bool halt_emitted = g_functions.length > 0 || g_globals.length > 0;
+	if (halt_emitted)
+		emit_halt();
+
+	OutlinedFunctionVector outlined = {0};
+	InstructionVector **code = malloc(sizeof(InstructionVector *) * (g_functions.length + 1));
+	code[0] = &instructions;
+	for (int i = 0; i < g_functions.length; i++)
+		code[i + 1] = &g_functions.data[i].instructions;
+	pass_manager_run_program(code, g_functions.length + 1, &outlined);
+	runtime_add_routines(code, g_functions.length + 1, &outlined);
+	free(code);
+
+	// or into the outlined subroutines and runtime routines that follow it
+	if (!halt_emitted && outlined.length > 0)
 	{
-		return 1;
+		g_emit_target = &instructions;
+		emit_halt();
 	}
-	last_index++;
-	if(last_index >= tv.length)
+
+	instruction_vector_print(&instructions);
+	for (int i = 0; i < g_functions.length; i++)
 	{
-		return 0;
+		printf("%s:\n", g_functions.data[i].token->name);
+		instruction_vector_print(&g_functions.data[i].instructions);
 	}
-
-	DirectiveStack stack = {0};
-	stack.data = malloc(sizeof(Directive) * 100);
-	ProgramVariableStack local_var_stack = {0};
-	local_var_stack.data = malloc(sizeof(ProgramVariable) * 100);
-
-	printf("Count: %d\n", tv.length);
-	token_vector_print(&tv);
-	while (true)
+	for (int i = 0; i < outlined.length; i++)
 	{
-		compile_tokens(&tv, last_index, &stack, &local_var_stack, &last_index);
-		last_index++;
-		if (last_index >= tv.length)
-			break;
+		printf("%s:\n", outlined.data[i].name);
+		instruction_vector_print(&outlined.data[i].instructions);
 	}
+	print_globals(&g_globals);
+	pass_manager_report();
+	if (g_options.run && !run_program(&instructions, &outlined))
+		return 1;
 }
\ No newline at end of file
@@ -0,0 +1,1237 @@
+#include <stdlib.h>
+#include <string.h>
+#include "optimize.h"
+
+static int register_bit(int reg)
+{
+	return 1 << reg;
+}
+
+typedef enum
+{
+	VALUE_OPAQUE,	 // Nothing is known about the value
+	VALUE_CONST,
+	VALUE_SLOT_ADDR, // The address of one frame slot, lo and hi are the slots of the object it belongs to
+	VALUE_DERIVED,	 // Some address between the frame slots lo and hi
+	VALUE_EXPR,		 // opcode applied to the values left and right
+} ValueKind;
+
+typedef struct
+{
+	ValueKind kind;
+	int constant;
+	int slot;
+	int lo;
+	int hi;
+	Opcode opcode;
+	int left;
+	int right;
+} Value;
+
+typedef struct
+{
+	int address; // Value numbers
+	int value;
+} MemoryFact;
+
+// What a register may hold wherever a label is reached from: nothing that is known, or an address inside
+// the frame slots lo to hi
+typedef struct
+{
+	bool address;
+	int lo;
+	int hi;
+} LabelRegister;
+
+typedef struct
+{
+	Value *values;
+	int value_count;
+	int value_capacity;
+	MemoryFact *facts;
+	int fact_count;
+	int fact_capacity;
+	bool *escaped; // Frame slots whose address is stored somewhere
+	int escaped_capacity;
+	int registers[REGISTER_COUNT];
+	LabelRegister *label_registers; // REGISTER_COUNT per label number
+	int label_count;
+	bool labels_changed;
+} ValueState;
+
+// What a load or store may touch
+typedef struct
+{
+	bool frame; // Only the frame slots lo to hi, otherwise anything that escaped
+	bool exact; // Exactly the frame slot lo
+	int lo;
+	int hi;
+} AccessRegion;
+
+struct FrameAccess
+{
+	ValueState state;
+	AccessRegion *regions; // Per instruction
+};
+
+static int value_push(ValueState *state, Value *value)
+{
+	if (state->value_count == state->value_capacity)
+	{
+		state->value_capacity = state->value_capacity * 2 + 16;
+		state->values = realloc(state->values, sizeof(Value) * state->value_capacity);
+	}
+	state->values[state->value_count] = *value;
+	return state->value_count++;
+}
+
+// Returns the existing value number for the value or creates one
+static int value_find(ValueState *state, Value *value)
+{
+	for (int i = 0; i < state->value_count; i++)
+	{
+		Value *other = &state->values[i];
+		if (other->kind != value->kind)
+			continue;
+		switch (value->kind)
+		{
+		case VALUE_CONST:
+			if (other->constant == value->constant)
+				return i;
+			break;
+		case VALUE_SLOT_ADDR:
+			if (other->slot == value->slot && other->lo == value->lo && other->hi == value->hi)
+				return i;
+			break;
+		case VALUE_EXPR:
+			if (other->opcode == value->opcode && other->left == value->left && other->right == value->right)
+				return i;
+			break;
+		default:
+			break;
+		}
+	}
+	return value_push(state, value);
+}
+
+static int value_opaque(ValueState *state)
+{
+	Value value = {0};
+	value.kind = VALUE_OPAQUE;
+	return value_push(state, &value);
+}
+
+static int value_const(ValueState *state, int constant)
+{
+	Value value = {0};
+	value.kind = VALUE_CONST;
+	value.constant = constant & 0xFFFF;
+	return value_find(state, &value);
+}
+
+static int value_slot(ValueState *state, int slot, int lo, int hi)
+{
+	Value value = {0};
+	value.kind = VALUE_SLOT_ADDR;
+	value.slot = slot;
+	value.lo = lo;
+	value.hi = hi;
+	return value_find(state, &value);
+}
+
+static int value_derived(ValueState *state, int lo, int hi)
+{
+	Value value = {0};
+	value.kind = VALUE_DERIVED;
+	value.lo = lo;
+	value.hi = hi;
+	return value_push(state, &value);
+}
+
+static int value_expr(ValueState *state, Opcode opcode, int left, int right)
+{
+	Value value = {0};
+	value.kind = VALUE_EXPR;
+	value.opcode = opcode;
+	value.left = left;
+	value.right = right;
+	return value_find(state, &value);
+}
+
+static bool value_is_address(ValueState *state, int vn)
+{
+	return state->values[vn].kind == VALUE_SLOT_ADDR || state->values[vn].kind == VALUE_DERIVED;
+}
+
+// left + right, or left - right when subtract is set
+static int value_add(ValueState *state, int left, int right, bool subtract)
+{
+	Value l = state->values[left];
+	Value r = state->values[right];
+	if (l.kind == VALUE_CONST && r.kind == VALUE_CONST)
+		return value_const(state, subtract ? l.constant - r.constant : l.constant + r.constant);
+
+	// The words of a frame object are consecutive in memory
+	if (l.kind == VALUE_SLOT_ADDR && r.kind == VALUE_CONST)
+		return value_slot(state, subtract ? l.slot - r.constant : l.slot + r.constant, l.lo, l.hi);
+	if (!subtract && r.kind == VALUE_SLOT_ADDR && l.kind == VALUE_CONST)
+		return value_slot(state, r.slot + l.constant, r.lo, r.hi);
+
+	if (value_is_address(state, left))
+		return value_derived(state, l.lo, l.hi);
+	if (value_is_address(state, right))
+		return value_derived(state, r.lo, r.hi);
+
+	return value_expr(state, subtract ? OPCODE_SUB : OPCODE_ADD, left, right);
+}
+
+static void mark_escaped(ValueState *state, int vn)
+{
+	if (!value_is_address(state, vn))
+		return;
+	Value *value = &state->values[vn];
+	if (value->hi >= state->escaped_capacity)
+	{
+		int capacity = value->hi * 2 + 16;
+		state->escaped = realloc(state->escaped, sizeof(bool) * capacity);
+		memset(&state->escaped[state->escaped_capacity], 0, sizeof(bool) * (capacity - state->escaped_capacity));
+		state->escaped_capacity = capacity;
+	}
+	for (int i = value->lo; i <= value->hi; i++)
+		state->escaped[i] = true;
+}
+
+static bool range_escaped(ValueState *state, int lo, int hi)
+{
+	for (int i = lo; i <= hi && i < state->escaped_capacity; i++)
+	{
+		if (i >= 0 && state->escaped[i])
+			return true;
+	}
+	return false;
+}
+
+// Frame slots the address may point at. Returns false when the address may point anywhere that escaped.
+static bool value_region(ValueState *state, int vn, int *lo, int *hi)
+{
+	Value *value = &state->values[vn];
+	if (value->kind == VALUE_SLOT_ADDR)
+	{
+		*lo = value->slot;
+		*hi = value->slot;
+		return true;
+	}
+	if (value->kind == VALUE_DERIVED)
+	{
+		*lo = value->lo;
+		*hi = value->hi;
+		return true;
+	}
+	return false;
+}
+
+static bool same_address(ValueState *state, int a, int b)
+{
+	if (a == b)
+		return true;
+	Value *va = &state->values[a];
+	Value *vb = &state->values[b];
+	return va->kind == VALUE_SLOT_ADDR && vb->kind == VALUE_SLOT_ADDR && va->slot == vb->slot;
+}
+
+static bool may_alias(ValueState *state, int a, int b)
+{
+	if (same_address(state, a, b))
+		return true;
+	int a_lo, a_hi, b_lo, b_hi;
+	bool a_frame = value_region(state, a, &a_lo, &a_hi);
+	bool b_frame = value_region(state, b, &b_lo, &b_hi);
+	if (a_frame && b_frame)
+		return a_lo <= b_hi && b_lo <= a_hi;
+	if (a_frame)
+		return range_escaped(state, a_lo, a_hi);
+	if (b_frame)
+		return range_escaped(state, b_lo, b_hi);
+	return true;
+}
+
+static int fact_find(ValueState *state, int address)
+{
+	for (int i = 0; i < state->fact_count; i++)
+	{
+		if (same_address(state, state->facts[i].address, address))
+			return state->facts[i].value;
+	}
+	return -1;
+}
+
+static void fact_add(ValueState *state, int address, int value)
+{
+	if (state->fact_count == state->fact_capacity)
+	{
+		state->fact_capacity = state->fact_capacity * 2 + 16;
+		state->facts = realloc(state->facts, sizeof(MemoryFact) * state->fact_capacity);
+	}
+	state->facts[state->fact_count].address = address;
+	state->facts[state->fact_count].value = value;
+	state->fact_count++;
+}
+
+// Forgets everything that a store to address may overwrite
+static void fact_invalidate(ValueState *state, int address)
+{
+	int write_index = 0;
+	for (int i = 0; i < state->fact_count; i++)
+	{
+		if (may_alias(state, state->facts[i].address, address))
+			continue;
+		state->facts[write_index++] = state->facts[i];
+	}
+	state->fact_count = write_index;
+}
+
+static void state_reset(ValueState *state)
+{
+	state->value_count = 0;
+	state->fact_count = 0;
+	for (int i = 0; i < REGISTER_COUNT; i++)
+		state->registers[i] = value_opaque(state);
+}
+
+static int register_holding(ValueState *state, int vn)
+{
+	for (int i = 0; i < REGISTER_COUNT; i++)
+	{
+		if (i != REGISTER_SP && state->registers[i] == vn)
+			return i;
+	}
+	return -1;
+}
+
+static void store(ValueState *state, int address, int value)
+{
+	fact_invalidate(state, address);
+	fact_add(state, address, value);
+}
+
+static void record_region(ValueState *state, int address, AccessRegion *region)
+{
+	region->frame = value_region(state, address, &region->lo, &region->hi);
+	region->exact = state->values[address].kind == VALUE_SLOT_ADDR;
+}
+
+// Widens what the label may be reached with by what the registers hold now
+static void label_merge(ValueState *state, int label)
+{
+	LabelRegister *entries = &state->label_registers[label * REGISTER_COUNT];
+	for (int reg = 0; reg < REGISTER_COUNT; reg++)
+	{
+		int vn = state->registers[reg];
+		if (!value_is_address(state, vn))
+			continue;
+		LabelRegister *entry = &entries[reg];
+		Value *value = &state->values[vn];
+		if (entry->address && entry->lo <= value->lo && value->hi <= entry->hi)
+			continue;
+		entry->lo = entry->address && entry->lo < value->lo ? entry->lo : value->lo;
+		entry->hi = entry->address && entry->hi > value->hi ? entry->hi : value->hi;
+		entry->address = true;
+		state->labels_changed = true;
+	}
+}
+
+// Nothing stored is known at a label since it may be reached from elsewhere, registers hold what the
+// label may be reached with
+static void label_enter(ValueState *state, int label)
+{
+	state->fact_count = 0;
+	for (int reg = 0; reg < REGISTER_COUNT; reg++)
+	{
+		LabelRegister *entry = &state->label_registers[label * REGISTER_COUNT + reg];
+		state->registers[reg] = entry->address ? value_derived(state, entry->lo, entry->hi) : value_opaque(state);
+	}
+}
+
+// Walks the code once. The first walk only records which slots escape and, when regions is set, what
+// every load and store may touch. The second walk rewrites.
+static int value_number_walk(InstructionVector *iv, ValueState *state, bool optimize, AccessRegion *regions)
+{
+	int changed = 0;
+	int write_index = 0;
+	bool reachable = true; // Whether the previous instruction can fall through
+	state_reset(state);
+
+	for (int i = 0; i < iv->length; i++)
+	{
+		Instruction instruction = iv->data[i];
+		int *registers = state->registers;
+		bool keep = true;
+
+		switch (instruction.opcode)
+		{
+		case OPCODE_LABEL:
+			if (!optimize && reachable)
+				label_merge(state, instruction.immediate);
+			label_enter(state, instruction.immediate);
+			break;
+
+		case OPCODE_B:
+		case OPCODE_BZ:
+		case OPCODE_BNZ:
+		case OPCODE_BC:
+		case OPCODE_BNC:
+			if (!optimize)
+				label_merge(state, instruction.immediate);
+			break;
+
+		case OPCODE_MOV:
+			if (optimize && registers[instruction.dst] == registers[instruction.src])
+				keep = false;
+			registers[instruction.dst] = registers[instruction.src];
+			break;
+
+		case OPCODE_MOVI:
+		{
+			int vn = value_const(state, instruction.immediate);
+			if (optimize && registers[0] == vn)
+				keep = false;
+			registers[0] = vn;
+			break;
+		}
+
+		case OPCODE_MHI:
+		{
+			if (instruction.symbol)
+			{
+				registers[0] = value_opaque(state);
+				break;
+			}
+			int constant = instruction.immediate & 0xFF00;
+			Instruction *next = i + 1 < iv->length ? &iv->data[i + 1] : NULL;
+			if (next && next->opcode == OPCODE_ORI && !next->symbol)
+			{
+				// mhi/ori pair loading a constant that is already in r0
+				int vn = value_const(state, constant | (next->immediate & 0xFF));
+				if (optimize && registers[0] == vn)
+				{
+					changed += 2;
+					i++;
+					continue;
+				}
+			}
+			registers[0] = value_const(state, constant);
+			break;
+		}
+
+		case OPCODE_ORI:
+			if (instruction.symbol || state->values[registers[0]].kind != VALUE_CONST)
+			{
+				registers[0] = value_opaque(state);
+				break;
+			}
+			registers[0] = value_const(state, state->values[registers[0]].constant | (instruction.immediate & 0xFF));
+			break;
+
+		case OPCODE_ADDI:
+			registers[0] = value_add(state, registers[0], value_const(state, instruction.immediate), false);
+			break;
+
+		case OPCODE_ADD:
+		case OPCODE_SUB:
+			// The frame sits above everything pushed so moving sp doesn't change what is known
+			if (instruction.dst == REGISTER_SP)
+				break;
+			registers[instruction.dst] = value_add(state, registers[instruction.dst], registers[instruction.src],
+												   instruction.opcode == OPCODE_SUB);
+			break;
+
+		case OPCODE_ADC:
+		case OPCODE_SBC:
+			// The result depends on the carry which isn't tracked
+			registers[instruction.dst] = value_opaque(state);
+			break;
+
+		case OPCODE_LDR:
+		{
+			int address = registers[instruction.src];
+			if (regions)
+				record_region(state, address, &regions[i]);
+			int known = fact_find(state, address);
+			if (known == -1)
+			{
+				int vn = value_opaque(state);
+				fact_add(state, address, vn);
+				registers[instruction.dst] = vn;
+				break;
+			}
+			int holder = register_holding(state, known);
+			if (optimize && holder != -1)
+			{
+				if (holder == instruction.dst)
+				{
+					keep = false;
+				}
+				else
+				{
+					Instruction mov = {0};
+					mov.opcode = OPCODE_MOV;
+					mov.dst = instruction.dst;
+					mov.src = holder;
+					instruction = mov;
+					changed++;
+				}
+			}
+			registers[instruction.dst] = known;
+			break;
+		}
+
+		case OPCODE_STR:
+		{
+			int address = registers[instruction.dst];
+			int value = registers[instruction.src];
+			if (regions)
+				record_region(state, address, &regions[i]);
+			if (!optimize)
+				mark_escaped(state, value);
+			if (optimize && fact_find(state, address) == value)
+			{
+				keep = false;
+				break;
+			}
+			store(state, address, value);
+			break;
+		}
+
+		case OPCODE_PUSH:
+			// Pushed words live below the frame, only the pushed value matters
+			if (!optimize)
+				mark_escaped(state, registers[instruction.src]);
+			break;
+
+		case OPCODE_POP:
+			registers[instruction.dst] = value_opaque(state);
+			break;
+
+		case OPCODE_ARG_ADDR:
+			// Incoming stack arguments are outside the frame and never escape
+			registers[0] = value_opaque(state);
+			break;
+
+		case OPCODE_FRAME_ADDR:
+		{
+			int slot = FRAME_ADDR_SLOT(&instruction);
+			int vn = value_slot(state, slot, instruction.immediate, instruction.immediate + instruction.size - 1);
+			int holder = register_holding(state, vn);
+			if (optimize && holder == 0)
+			{
+				keep = false;
+			}
+			else if (optimize && holder != -1)
+			{
+				Instruction mov = {0};
+				mov.opcode = OPCODE_MOV;
+				mov.dst = 0;
+				mov.src = holder;
+				instruction = mov;
+				changed++;
+			}
+			registers[0] = vn;
+			break;
+		}
+
+		case OPCODE_FRAME_CLEAR:
+		{
+			int lo = FRAME_ADDR_SLOT(&instruction);
+			int hi = lo + instruction.count - 1;
+			if (regions)
+			{
+				regions[i].frame = true;
+				regions[i].lo = lo;
+				regions[i].hi = hi;
+			}
+			fact_invalidate(state, value_derived(state, lo, hi));
+			for (int reg = 0; reg < REGISTER_COUNT; reg++)
+			{
+				if (instruction_writes_register(&instruction, reg))
+					registers[reg] = value_opaque(state);
+			}
+			break;
+		}
+
+		default:
+			// Calls and anything unknown may touch every register and all memory that escaped
+			for (int reg = 0; reg < REGISTER_COUNT && !optimize; reg++)
+			{
+				if (instruction.arguments & (1 << reg))
+					mark_escaped(state, registers[reg]);
+			}
+			for (int reg = 0; reg < REGISTER_COUNT; reg++)
+			{
+				if (instruction_writes_register(&instruction, reg) || instruction.opcode != OPCODE_CALL)
+					registers[reg] = value_opaque(state);
+			}
+			state->fact_count = 0;
+			break;
+		}
+
+		reachable = !instruction_ends_flow(&instruction);
+		if (!keep)
+		{
+			changed++;
+			continue;
+		}
+		if (optimize)
+			iv->data[write_index++] = instruction;
+	}
+
+	if (optimize)
+		iv->length = write_index;
+	return changed;
+}
+
+static int value_number(InstructionVector *iv, ValueState *state, bool optimize, AccessRegion *regions)
+{
+	if (optimize)
+		return value_number_walk(iv, state, true, NULL);
+
+	int label_count;
+	free(label_positions(iv, &label_count));
+	if (label_count > state->label_count)
+	{
+		state->label_registers = realloc(state->label_registers, sizeof(LabelRegister) * REGISTER_COUNT * label_count);
+		memset(&state->label_registers[state->label_count * REGISTER_COUNT], 0,
+			   sizeof(LabelRegister) * REGISTER_COUNT * (label_count - state->label_count));
+		state->label_count = label_count;
+	}
+	// A branch back to a label can bring addresses that weren't known when the label was passed, so the
+	// walk is repeated until the labels stop changing
+	do
+	{
+		state->labels_changed = false;
+		value_number_walk(iv, state, false, regions);
+	} while (state->labels_changed);
+	return 0;
+}
+
+// Raw sp arithmetic could reach any slot without going through frame_addr
+static bool uses_raw_sp(InstructionVector *iv)
+{
+	for (int i = 0; i < iv->length; i++)
+	{
+		if (iv->data[i].opcode == OPCODE_MOV && iv->data[i].src == REGISTER_SP)
+			return true;
+	}
+	return false;
+}
+
+FrameAccess *analyze_frame_access(InstructionVector *iv)
+{
+	FrameAccess *access = calloc(1, sizeof(FrameAccess));
+	access->regions = calloc(iv->length + 1, sizeof(AccessRegion));
+	value_number(iv, &access->state, false, access->regions);
+	return access;
+}
+
+void frame_access_free(FrameAccess *access)
+{
+	if (!access)
+		return;
+	free(access->regions);
+	free(access->state.values);
+	free(access->state.facts);
+	free(access->state.escaped);
+	free(access->state.label_registers);
+	free(access);
+}
+
+int optimize_redundant_loads(InstructionVector *iv, FrameAccess *access)
+{
+	if (uses_raw_sp(iv))
+		return 0;
+
+	// The rewriting walk only needs to know which slots escaped and what the labels are reached with, the
+	// value numbers are built again
+	FrameAccess *computed = access ? NULL : analyze_frame_access(iv);
+	int changed = value_number(iv, access ? &access->state : &computed->state, true, NULL);
+	frame_access_free(computed);
+	return changed;
+}
+
+// Walks backwards once keeping track of which frame slots may still be read. Frame slots die at the end of
+// the code, escaped slots are treated as always live and left out. A branch reads what is live at its label,
+// label_live holds slot_count flags per label number and is updated at every label. With dead set, stores
+// that are never read are marked in it and frame_clears are narrowed to the words that are.
+// Returns whether label_live changed.
+static bool slot_liveness_walk(InstructionVector *iv, FrameAccess *access, int slot_count, int *labels,
+							   int label_count, bool *label_live, bool *dead, int *removed)
+{
+	ValueState *state = &access->state;
+	AccessRegion *regions = access->regions;
+	bool *live = calloc(slot_count + 1, sizeof(bool));
+	bool changed = false;
+	for (int i = iv->length - 1; i >= 0; i--)
+	{
+		Instruction *instruction = &iv->data[i];
+		AccessRegion *region = &regions[i];
+		if (instruction->opcode == OPCODE_LABEL)
+		{
+			bool *row = &label_live[instruction->immediate * slot_count];
+			if (memcmp(row, live, sizeof(bool) * slot_count))
+			{
+				memcpy(row, live, sizeof(bool) * slot_count);
+				changed = true;
+			}
+			continue;
+		}
+		if (instruction_is_branch(instruction))
+		{
+			int label = instruction->immediate;
+			if (instruction->opcode == OPCODE_B)
+				memset(live, 0, sizeof(bool) * slot_count);
+			for (int slot = 0; slot < slot_count; slot++)
+				live[slot] |= label >= label_count || labels[label] == -1 || label_live[label * slot_count + slot];
+			continue;
+		}
+		if (instruction->opcode == OPCODE_LDR && region->frame)
+		{
+			for (int slot = region->lo; slot <= region->hi && slot < slot_count; slot++)
+			{
+				if (slot >= 0)
+					live[slot] = true;
+			}
+			continue;
+		}
+		if (instruction->opcode == OPCODE_FRAME_CLEAR && !range_escaped(state, region->lo, region->hi))
+		{
+			// Only the words that may be read before they are written need zeroing, everything from the
+			// first to the last of them is kept
+			int first = -1;
+			int last = -1;
+			for (int slot = region->lo; slot <= region->hi; slot++)
+			{
+				if (!live[slot])
+					continue;
+				if (first == -1)
+					first = slot;
+				last = slot;
+				live[slot] = false;
+			}
+			if (!dead)
+				continue;
+			if (first == -1)
+			{
+				dead[i] = true;
+				(*removed)++;
+				continue;
+			}
+			instruction->offset += first - region->lo;
+			instruction->count = last - first + 1;
+			continue;
+		}
+		if (instruction->opcode != OPCODE_STR || !region->frame || region->lo < 0 || region->hi >= slot_count ||
+			range_escaped(state, region->lo, region->hi))
+			continue;
+
+		bool read_later = false;
+		for (int slot = region->lo; slot <= region->hi; slot++)
+			read_later |= live[slot];
+		if (!read_later)
+		{
+			if (dead)
+			{
+				dead[i] = true;
+				(*removed)++;
+			}
+			continue;
+		}
+		// Only a store to one known slot is sure to overwrite it
+		if (region->exact)
+			live[region->lo] = false;
+	}
+	free(live);
+	return changed;
+}
+
+// Frame slots that may be read before they are written from each label on, slot_count flags per label number
+static bool *slot_liveness_at_labels(InstructionVector *iv, FrameAccess *access, int slot_count, int *labels,
+									 int label_count)
+{
+	bool *label_live = calloc(label_count * slot_count + 1, sizeof(bool));
+	while (slot_liveness_walk(iv, access, slot_count, labels, label_count, label_live, NULL, NULL))
+		;
+	return label_live;
+}
+
+int optimize_dead_stores(InstructionVector *iv, FrameAccess *access)
+{
+	if (uses_raw_sp(iv))
+		return 0;
+
+	FrameAccess *computed = access ? NULL : analyze_frame_access(iv);
+	if (computed)
+		access = computed;
+
+	int slot_count = 0;
+	for (int i = 0; i < iv->length; i++)
+	{
+		Instruction *instruction = &iv->data[i];
+		if (instruction_names_frame_object(instruction) && instruction->immediate + instruction->size > slot_count)
+			slot_count = instruction->immediate + instruction->size;
+	}
+
+	int label_count;
+	int *labels = label_positions(iv, &label_count);
+	bool *label_live = slot_liveness_at_labels(iv, access, slot_count, labels, label_count);
+	bool *dead = calloc(iv->length + 1, sizeof(bool));
+	int removed = 0;
+	slot_liveness_walk(iv, access, slot_count, labels, label_count, label_live, dead, &removed);
+
+	int write_index = 0;
+	for (int i = 0; i < iv->length; i++)
+	{
+		if (!dead[i])
+			iv->data[write_index++] = iv->data[i];
+	}
+	iv->length = write_index;
+
+	free(labels);
+	free(label_live);
+	free(dead);
+	frame_access_free(computed);
+	return removed;
+}
+
+// A frame object and the part of the code during which it holds a value
+typedef struct
+{
+	int id;	   // First slot of the object
+	int size;
+	int start; // First and last instruction that touches the object
+	int end;
+	int base;  // First slot after coloring
+} SlotInterval;
+
+int optimize_scalar_replacement(InstructionVector *iv)
+{
+	int slot_count = 0;
+	for (int i = 0; i < iv->length; i++)
+	{
+		Instruction *instruction = &iv->data[i];
+		if (instruction_names_frame_object(instruction) && instruction->immediate + instruction->size > slot_count)
+			slot_count = instruction->immediate + instruction->size;
+	}
+
+	// An object stays whole once its address is used for anything but loading, storing or copying it. An
+	// address that is still needed where a label is reached is not followed further.
+	bool *whole = calloc(slot_count + 1, sizeof(bool));
+	int holds[REGISTER_COUNT]; // The object whose word address each register holds, or -1
+	for (int reg = 0; reg < REGISTER_COUNT; reg++)
+		holds[reg] = -1;
+	int label_count;
+	int *labels = label_positions(iv, &label_count);
+	int *live_after = register_liveness(iv);
+	for (int i = 0; i < iv->length; i++)
+	{
+		Instruction *instruction = &iv->data[i];
+		int uses = instruction_uses(instruction);
+		if (instruction->opcode == OPCODE_LABEL || instruction_is_branch(instruction))
+		{
+			int label = labels[instruction->immediate];
+			int live = label == -1 ? (1 << REGISTER_COUNT) - 1 : live_after[label];
+			for (int reg = 0; reg < REGISTER_COUNT; reg++)
+			{
+				if (holds[reg] != -1 && (live & register_bit(reg)))
+					whole[holds[reg]] = true;
+				if (instruction->opcode == OPCODE_LABEL)
+					holds[reg] = -1;
+			}
+		}
+		for (int reg = 0; reg < REGISTER_COUNT; reg++)
+		{
+			if (holds[reg] == -1 || !(uses & register_bit(reg)))
+				continue;
+			bool address_operand = (instruction->opcode == OPCODE_LDR && reg == instruction->src) ||
+								   (instruction->opcode == OPCODE_STR && reg == instruction->dst && reg != instruction->src) ||
+								   (instruction->opcode == OPCODE_MOV && reg == instruction->src);
+			if (!address_operand)
+				whole[holds[reg]] = true;
+		}
+
+		if (instruction->opcode == OPCODE_FRAME_ADDR)
+		{
+			holds[0] = instruction->immediate;
+			continue;
+		}
+		// Cleared as a whole
+		if (instruction->opcode == OPCODE_FRAME_CLEAR)
+			whole[instruction->immediate] = true;
+		if (instruction->opcode == OPCODE_MOV)
+		{
+			holds[instruction->dst] = instruction->src == REGISTER_SP ? -1 : holds[instruction->src];
+			continue;
+		}
+		for (int reg = 0; reg < REGISTER_COUNT; reg++)
+		{
+			if (instruction_writes_register(instruction, reg))
+				holds[reg] = -1;
+		}
+	}
+
+	// Every word becomes an object of its own, named after its slot
+	bool *split = calloc(slot_count + 1, sizeof(bool));
+	int split_count = 0;
+	for (int i = 0; i < iv->length; i++)
+	{
+		Instruction *instruction = &iv->data[i];
+		if (instruction->opcode != OPCODE_FRAME_ADDR || instruction->size <= 1 || whole[instruction->immediate])
+			continue;
+		if (!split[instruction->immediate])
+			split_count++;
+		split[instruction->immediate] = true;
+		instruction->immediate += instruction->offset;
+		instruction->offset = 0;
+		instruction->size = 1;
+	}
+
+	free(labels);
+	free(live_after);
+	free(whole);
+	free(split);
+	return split_count;
+}
+
+static int compare_interval_start(const void *a, const void *b)
+{
+	const SlotInterval *left = a;
+	const SlotInterval *right = b;
+	if (left->start != right->start)
+		return left->start - right->start;
+	return left->id - right->id;
+}
+
+int optimize_stack_slots(InstructionVector *iv, FrameAccess *access, int *frame_before)
+{
+	int slot_count = 0;
+	for (int i = 0; i < iv->length; i++)
+	{
+		Instruction *instruction = &iv->data[i];
+		if (instruction_names_frame_object(instruction) && instruction->immediate + instruction->size > slot_count)
+			slot_count = instruction->immediate + instruction->size;
+	}
+
+	// Index into intervals of the object covering each slot, or -1
+	int *slot_object = malloc(sizeof(int) * (slot_count + 1));
+	for (int slot = 0; slot < slot_count; slot++)
+		slot_object[slot] = -1;
+	SlotInterval *intervals = malloc(sizeof(SlotInterval) * (slot_count + 1));
+	int interval_count = 0;
+	for (int i = 0; i < iv->length; i++)
+	{
+		Instruction *instruction = &iv->data[i];
+		if (!instruction_names_frame_object(instruction))
+			continue;
+		int index = slot_object[instruction->immediate];
+		if (index == -1)
+		{
+			index = interval_count++;
+			intervals[index].id = instruction->immediate;
+			intervals[index].size = instruction->size;
+			intervals[index].start = i;
+			intervals[index].base = instruction->immediate;
+			for (int slot = instruction->immediate; slot < instruction->immediate + instruction->size; slot++)
+				slot_object[slot] = index;
+		}
+		intervals[index].end = i;
+	}
+
+	int before = 0;
+	for (int i = 0; i < interval_count; i++)
+		before += intervals[i].size;
+	*frame_before = before;
+
+	if (uses_raw_sp(iv))
+	{
+		free(slot_object);
+		free(intervals);
+		return before;
+	}
+
+	// Addresses can be kept in registers long after frame_addr, so the loads and stores through them
+	// extend the interval too. Escaped objects may be reached through any pointer until the end.
+	FrameAccess *computed = access ? NULL : analyze_frame_access(iv);
+	if (computed)
+		access = computed;
+	ValueState *state = &access->state;
+	AccessRegion *regions = access->regions;
+	for (int i = 0; i < iv->length; i++)
+	{
+		Opcode opcode = iv->data[i].opcode;
+		AccessRegion *region = &regions[i];
+		if ((opcode != OPCODE_LDR && opcode != OPCODE_STR) || !region->frame)
+			continue;
+		for (int slot = region->lo; slot <= region->hi; slot++)
+		{
+			if (slot < 0 || slot >= slot_count || slot_object[slot] == -1)
+				continue;
+			SlotInterval *interval = &intervals[slot_object[slot]];
+			if (i > interval->end)
+				interval->end = i;
+		}
+	}
+	for (int i = 0; i < interval_count; i++)
+	{
+		if (range_escaped(state, intervals[i].id, intervals[i].id + intervals[i].size - 1))
+			intervals[i].end = iv->length;
+	}
+
+	// The code between a branch and its label can run again, or be skipped, so an object that is live at the
+	// label has to keep its slots from the branch to the label. Escaped objects count as live at the labels
+	// of the branches their interval overlaps.
+	int label_count;
+	int *labels = label_positions(iv, &label_count);
+	bool *label_live = slot_liveness_at_labels(iv, access, slot_count, labels, label_count);
+	for (int i = 0; i < iv->length; i++)
+	{
+		Instruction *instruction = &iv->data[i];
+		if (!instruction_is_branch(instruction) || labels[instruction->immediate] == -1)
+			continue;
+		int target = labels[instruction->immediate];
+		int lo = target < i ? target : i;
+		int hi = target < i ? i : target;
+		for (int j = 0; j < interval_count; j++)
+		{
+			SlotInterval *interval = &intervals[j];
+			bool live = false;
+			for (int slot = interval->id; slot < interval->id + interval->size; slot++)
+				live |= label_live[instruction->immediate * slot_count + slot];
+			if (range_escaped(state, interval->id, interval->id + interval->size - 1))
+				live = interval->start <= hi && lo <= interval->end;
+			if (!live)
+				continue;
+			if (lo < interval->start)
+				interval->start = lo;
+			if (hi > interval->end)
+				interval->end = hi;
+		}
+	}
+	free(labels);
+	free(label_live);
+
+	// First fit in order of first use. Objects interfere when their intervals overlap, an object is moved
+	// above every interfering object whose slots it would share until it fits.
+	qsort(intervals, interval_count, sizeof(SlotInterval), compare_interval_start);
+	int after = 0;
+	for (int i = 0; i < interval_count; i++)
+	{
+		SlotInterval *interval = &intervals[i];
+		interval->base = 0;
+		bool moved = true;
+		while (moved)
+		{
+			moved = false;
+			for (int j = 0; j < i; j++)
+			{
+				SlotInterval *placed = &intervals[j];
+				if (placed->end < interval->start || interval->end < placed->start)
+					continue;
+				if (placed->base + placed->size <= interval->base || interval->base + interval->size <= placed->base)
+					continue;
+				interval->base = placed->base + placed->size;
+				moved = true;
+			}
+		}
+		if (interval->base + interval->size > after)
+			after = interval->base + interval->size;
+	}
+
+	for (int i = 0; i < interval_count; i++)
+		slot_object[intervals[i].id] = i;
+	for (int i = 0; i < iv->length; i++)
+	{
+		Instruction *instruction = &iv->data[i];
+		if (instruction_names_frame_object(instruction))
+			instruction->immediate = intervals[slot_object[instruction->immediate]].base;
+	}
+
+	free(slot_object);
+	free(intervals);
+	frame_access_free(computed);
+	return after;
+}
+
+int instruction_uses(Instruction *instruction)
+{
+	switch (instruction->opcode)
+	{
+	case OPCODE_MOV:
+	case OPCODE_LDR:
+	case OPCODE_PUSH:
+		return register_bit(instruction->src);
+	case OPCODE_CALL:
+		return register_bit(instruction->src) | instruction->arguments;
+	case OPCODE_RETURN:
+	case OPCODE_TAIL_CALL:
+		return instruction->arguments | register_bit(REGISTER_FP) | register_bit(REGISTER_SP);
+	case OPCODE_ORI:
+	case OPCODE_ADDI:
+		return register_bit(0);
+	case OPCODE_BZ:
+	case OPCODE_BNZ:
+		return register_bit(instruction->src);
+	case OPCODE_BC:
+	case OPCODE_BNC:
+		return CARRY_BIT;
+	case OPCODE_B:
+	case OPCODE_LABEL:
+		return 0;
+	case OPCODE_ADD:
+	case OPCODE_SUB:
+	case OPCODE_STR:
+		return register_bit(instruction->dst) | register_bit(instruction->src);
+	case OPCODE_ADC:
+	case OPCODE_SBC:
+		return register_bit(instruction->dst) | register_bit(instruction->src) | CARRY_BIT;
+	case OPCODE_MOVI:
+	case OPCODE_MHI:
+	case OPCODE_POP:
+	case OPCODE_FRAME_ADDR:
+	case OPCODE_FRAME_CLEAR:
+	case OPCODE_ARG_ADDR:
+		return 0;
+	default:
+		return ((1 << REGISTER_COUNT) - 1) | CARRY_BIT;
+	}
+}
+
+int instruction_defs(Instruction *instruction)
+{
+	int defs = 0;
+	for (int reg = 0; reg < REGISTER_COUNT; reg++)
+	{
+		if (instruction_writes_register(instruction, reg))
+			defs |= register_bit(reg);
+	}
+	switch (instruction->opcode)
+	{
+	case OPCODE_ADDI:
+	case OPCODE_ADD:
+	case OPCODE_SUB:
+	case OPCODE_ADC:
+	case OPCODE_SBC:
+		defs |= CARRY_BIT;
+		break;
+	default:
+		break;
+	}
+	return defs;
+}
+
+bool instruction_removable(Instruction *instruction)
+{
+	switch (instruction->opcode)
+	{
+	case OPCODE_MOV:
+	case OPCODE_MOVI:
+	case OPCODE_MHI:
+	case OPCODE_ORI:
+	case OPCODE_ADDI:
+	case OPCODE_ADD:
+	case OPCODE_SUB:
+	case OPCODE_ADC:
+	case OPCODE_SBC:
+	case OPCODE_LDR:
+	case OPCODE_FRAME_ADDR:
+	case OPCODE_ARG_ADDR:
+		return instruction->dst != REGISTER_SP;
+	default:
+		return false;
+	}
+}
+
+int *label_positions(InstructionVector *iv, int *count)
+{
+	*count = 0;
+	for (int i = 0; i < iv->length; i++)
+	{
+		Instruction *instruction = &iv->data[i];
+		if ((instruction->opcode == OPCODE_LABEL || instruction_is_branch(instruction)) &&
+			instruction->immediate >= *count)
+			*count = instruction->immediate + 1;
+	}
+	int *positions = malloc(sizeof(int) * (*count + 1));
+	for (int label = 0; label < *count; label++)
+		positions[label] = -1;
+	for (int i = 0; i < iv->length; i++)
+	{
+		if (iv->data[i].opcode == OPCODE_LABEL)
+			positions[iv->data[i].immediate] = i;
+	}
+	return positions;
+}
+
+// Backward liveness of the registers and the carry. A branch reads what is live at its label, the walk is
+// repeated until that stops changing. With dead set, removable instructions whose results are never read
+// are marked in it and don't count as reading anything. Returns what is live after every instruction.
+static int *compute_liveness(InstructionVector *iv, bool *dead)
+{
+	int label_count;
+	int *labels = label_positions(iv, &label_count);
+	int *label_live = calloc(label_count + 1, sizeof(int));
+	int *live_after = calloc(iv->length + 1, sizeof(int));
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+		int live = 0;
+		for (int i = iv->length - 1; i >= 0; i--)
+		{
+			Instruction *instruction = &iv->data[i];
+			if (instruction_ends_flow(instruction))
+				live = 0;
+			if (instruction_is_branch(instruction))
+			{
+				int label = instruction->immediate;
+				live |= labels[label] == -1 ? ((1 << REGISTER_COUNT) - 1) | CARRY_BIT : label_live[label];
+			}
+			live_after[i] = live;
+			if (instruction->opcode == OPCODE_LABEL && label_live[instruction->immediate] != live)
+			{
+				label_live[instruction->immediate] = live;
+				changed = true;
+			}
+
+			int defs = instruction_defs(instruction);
+			if (dead)
+				dead[i] = instruction_removable(instruction) && !(defs & live);
+			if (dead && dead[i])
+				continue;
+			live = (live & ~defs) | instruction_uses(instruction);
+		}
+	}
+	free(labels);
+	free(label_live);
+	return live_after;
+}
+
+int *register_liveness(InstructionVector *iv)
+{
+	return compute_liveness(iv, NULL);
+}
+
+int optimize_dead_code(InstructionVector *iv)
+{
+	bool *dead = calloc(iv->length + 1, sizeof(bool));
+	free(compute_liveness(iv, dead));
+	int removed = 0;
+	int write_index = 0;
+	for (int i = 0; i < iv->length; i++)
+	{
+		if (!dead[i])
+			iv->data[write_index++] = iv->data[i];
+		else
+			removed++;
+	}
+	iv->length = write_index;
+	free(dead);
+	return removed;
+}
@@ -0,0 +1,57 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+#include "emit.h"
+
+// Liveness treats the carry flag as one more register
+#define CARRY_BIT (1 << REGISTER_COUNT)
+
+// Registers read and written by the instruction, one bit per register plus CARRY_BIT
+int instruction_uses(Instruction *instruction);
+int instruction_defs(Instruction *instruction);
+
+// Whether the instruction only computes a register and can be dropped when nobody reads it
+bool instruction_removable(Instruction *instruction);
+
+// Position of every label in the code, indexed by label number and -1 for labels that aren't in it.
+// count receives the number of entries, one more than the highest label number used.
+int *label_positions(InstructionVector *iv, int *count);
+
+// Registers and carry, as in instruction_uses, that may be read after every instruction, following
+// branches to their labels
+int *register_liveness(InstructionVector *iv);
+
+// Which frame slots escape and what every load and store of the code may touch. The passes that need it
+// take a precomputed one so it can be shared while the code doesn't change, or NULL to compute their own.
+typedef struct FrameAccess FrameAccess;
+
+FrameAccess *analyze_frame_access(InstructionVector *iv);
+void frame_access_free(FrameAccess *access);
+
+// Forwards stored values to later loads of the same cell and reuses values that are still held in a
+// register instead of loading them again. Frame slots whose address never escapes can only be reached
+// through frame_addr, so stores through other pointers do not invalidate them.
+// Returns the number of instructions removed or simplified.
+int optimize_redundant_loads(InstructionVector *iv, FrameAccess *access);
+
+// Removes stores to frame slots that are overwritten or never read again. Together with dead code
+// elimination this drops unused locals entirely since their slots are no longer referenced.
+// Returns the number of stores removed.
+int optimize_dead_stores(InstructionVector *iv, FrameAccess *access);
+
+// Splits frame objects such as struct locals and two word integers into one object per word when their
+// address is only ever used to load and store single words. The words then get their own lifetimes, so
+// dead ones disappear and the rest can share slots with other objects.
+// Returns the number of objects split.
+int optimize_scalar_replacement(InstructionVector *iv);
+
+// Lets frame objects whose lifetimes don't overlap share frame slots by renumbering them. An object lives
+// from the first to the last instruction that touches it, widened to cover the branches that reach a label
+// where it is live.
+// frame_before receives the frame size in words without sharing. Returns the frame size afterwards.
+int optimize_stack_slots(InstructionVector *iv, FrameAccess *access, int *frame_before);
+
+// Removes instructions without side effects whose results are never read.
+// Returns the number of instructions removed.
+int optimize_dead_code(InstructionVector *iv);
+
+#endif // !OPTIMIZE_H
@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "outline.h"
+#include "isel.h"
+#include "optimize.h"
+
+#define OUTLINE_MIN_LENGTH 4
+#define OUTLINE_MAX_LENGTH 32
+#define OUTLINE_CALL_COST 3 // mhi, ori and call at every occurrence
+#define OUTLINE_BODY_COST 1 // The ret at the end of the subroutine
+
+// A sequence of length instructions starting at start in one of the vectors being searched
+typedef struct
+{
+	unsigned hash;
+	int vector;
+	int start;
+} Window;
+
+static bool same_instruction(Instruction *a, Instruction *b)
+{
+	if (a->opcode != b->opcode || a->dst != b->dst || a->src != b->src)
+		return false;
+	if (a->symbol || b->symbol)
+		return a->symbol && b->symbol && !strcmp(a->symbol, b->symbol);
+	return a->immediate == b->immediate;
+}
+
+static unsigned instruction_hash(Instruction *instruction)
+{
+	unsigned hash = instruction->opcode * 31u + instruction->dst;
+	hash = hash * 31u + instruction->src;
+	if (instruction->symbol)
+	{
+		for (const char *c = instruction->symbol; *c; c++)
+			hash = hash * 31u + (unsigned char)*c;
+		return hash;
+	}
+	return hash * 31u + (unsigned)instruction->immediate;
+}
+
+static bool same_sequence(Instruction *a, Instruction *b, int length)
+{
+	for (int i = 0; i < length; i++)
+	{
+		if (!same_instruction(&a[i], &b[i]))
+			return false;
+	}
+	return true;
+}
+
+// Whether the sequence behaves the same when it runs one call deeper. The call leaves the address of the
+// subroutine in r0, so the sequence has to write r0 itself to leave the same value in it.
+static bool outlinable(Instruction *sequence, int length)
+{
+	bool r0_written = false;
+	for (int i = 0; i < length; i++)
+	{
+		Instruction *instruction = &sequence[i];
+		switch (instruction->opcode)
+		{
+		case OPCODE_MOV:
+		case OPCODE_MOVI:
+		case OPCODE_MHI:
+		case OPCODE_ORI:
+		case OPCODE_ADDI:
+		case OPCODE_ADD:
+		case OPCODE_SUB:
+		case OPCODE_ADC:
+		case OPCODE_SBC:
+		case OPCODE_LDR:
+		case OPCODE_STR:
+			break;
+		default:
+			return false;
+		}
+		if (instruction->dst == REGISTER_SP)
+			return false;
+		if (instruction->src == REGISTER_SP)
+		{
+			// Only frame addresses formed by mov r0, sp and an addi can be adjusted for the return address
+			if (instruction->opcode != OPCODE_MOV || instruction->dst != 0 || i + 1 >= length ||
+				sequence[i + 1].opcode != OPCODE_ADDI || !immediate_encodable(OPCODE_ADDI, sequence[i + 1].immediate + 1))
+				return false;
+		}
+		if ((instruction_uses(instruction) & 1) && !r0_written)
+			return false;
+		if (instruction_writes_register(instruction, 0))
+			r0_written = true;
+	}
+	return r0_written;
+}
+
+static int compare_windows(const void *a, const void *b)
+{
+	const Window *left = a;
+	const Window *right = b;
+	if (left->hash != right->hash)
+		return left->hash < right->hash ? -1 : 1;
+	if (left->vector != right->vector)
+		return left->vector - right->vector;
+	return left->start - right->start;
+}
+
+// The best sequence found so far
+typedef struct
+{
+	int saved;
+	int length;
+	int vector; // Where the first occurrence is
+	int start;
+} Candidate;
+
+// Number of occurrences of the sequence of the first window that don't overlap, taken in order of position
+static int count_occurrences(InstructionVector **code, Window *windows, int first, int last, int length)
+{
+	Instruction *sequence = &code[windows[first].vector]->data[windows[first].start];
+	int count = 0;
+	int vector = -1;
+	int end = 0;
+	for (int i = first; i < last; i++)
+	{
+		Window *window = &windows[i];
+		if (window->vector == vector && window->start < end)
+			continue;
+		if (!same_sequence(sequence, &code[window->vector]->data[window->start], length))
+			continue;
+		vector = window->vector;
+		end = window->start + length;
+		count++;
+	}
+	return count;
+}
+
+static bool find_candidate(InstructionVector **code, int code_count, Candidate *best)
+{
+	int total = 0;
+	for (int v = 0; v < code_count; v++)
+		total += code[v]->length;
+	Window *windows = malloc(sizeof(Window) * (total + 1));
+
+	best->saved = 0;
+	for (int length = OUTLINE_MIN_LENGTH; length <= OUTLINE_MAX_LENGTH; length++)
+	{
+		int window_count = 0;
+		for (int v = 0; v < code_count; v++)
+		{
+			for (int start = 0; start + length <= code[v]->length; start++)
+			{
+				Instruction *sequence = &code[v]->data[start];
+				if (!outlinable(sequence, length))
+					continue;
+				unsigned hash = 0;
+				for (int i = 0; i < length; i++)
+					hash = hash * 16777619u + instruction_hash(&sequence[i]);
+				windows[window_count].hash = hash;
+				windows[window_count].vector = v;
+				windows[window_count].start = start;
+				window_count++;
+			}
+		}
+		qsort(windows, window_count, sizeof(Window), compare_windows);
+
+		for (int first = 0; first < window_count;)
+		{
+			int last = first + 1;
+			while (last < window_count && windows[last].hash == windows[first].hash)
+				last++;
+			if (last - first > 1)
+			{
+				int count = count_occurrences(code, windows, first, last, length);
+				int saved = count * length - count * OUTLINE_CALL_COST - length - OUTLINE_BODY_COST;
+				if (saved > best->saved)
+				{
+					best->saved = saved;
+					best->length = length;
+					best->vector = windows[first].vector;
+					best->start = windows[first].start;
+				}
+			}
+			first = last;
+		}
+	}
+	free(windows);
+	return best->saved > 0;
+}
+
+static void push_instruction(InstructionVector *iv, Opcode opcode, const char *symbol)
+{
+	Instruction instruction = {0};
+	instruction.opcode = opcode;
+	instruction.symbol = symbol;
+	instruction_vector_push(iv, &instruction);
+}
+
+static void outline_candidate(InstructionVector **code, int code_count, Candidate *candidate,
+							  OutlinedFunctionVector *functions)
+{
+	int length = candidate->length;
+	Instruction *sequence = &code[candidate->vector]->data[candidate->start];
+
+	// The subroutine runs with the return address pushed, so frame addresses are one word further up
+	OutlinedFunction function = {0};
+	char name[32];
+	snprintf(name, sizeof(name), "__outlined_%d", functions->length);
+	function.name = malloc(strlen(name) + 1);
+	strcpy(function.name, name);
+	instruction_vector_init(&function.instructions, length + 1);
+	for (int i = 0; i < length; i++)
+	{
+		Instruction instruction = sequence[i];
+		instruction_vector_push(&function.instructions, &instruction);
+		if (instruction.opcode == OPCODE_MOV && instruction.src == REGISTER_SP)
+		{
+			Instruction addi = sequence[++i];
+			addi.immediate++;
+			instruction_vector_push(&function.instructions, &addi);
+		}
+	}
+	push_instruction(&function.instructions, OPCODE_RET, NULL);
+
+	// Every occurrence becomes a call, the sequence is copied first since the vectors get rewritten
+	Instruction *copy = malloc(sizeof(Instruction) * length);
+	memcpy(copy, sequence, sizeof(Instruction) * length);
+	for (int v = 0; v < code_count; v++)
+	{
+		InstructionVector *iv = code[v];
+		InstructionVector rewritten;
+		instruction_vector_init(&rewritten, iv->length + 1);
+		for (int i = 0; i < iv->length; i++)
+		{
+			if (i + length <= iv->length && outlinable(&iv->data[i], length) &&
+				same_sequence(copy, &iv->data[i], length))
+			{
+				push_instruction(&rewritten, OPCODE_MHI, function.name);
+				push_instruction(&rewritten, OPCODE_ORI, function.name);
+				push_instruction(&rewritten, OPCODE_CALL, NULL);
+				i += length - 1;
+				continue;
+			}
+			instruction_vector_push(&rewritten, &iv->data[i]);
+		}
+		instruction_vector_free(iv);
+		*iv = rewritten;
+	}
+	free(copy);
+
+	if (functions->length == functions->capacity)
+	{
+		functions->capacity = functions->capacity * 2 + 4;
+		functions->data = realloc(functions->data, sizeof(OutlinedFunction) * functions->capacity);
+	}
+	functions->data[functions->length++] = function;
+}
+
+int outline_code(InstructionVector **code, int code_count, OutlinedFunctionVector *functions)
+{
+	// The subroutines are searched along with the code they came from
+	InstructionVector **searched = malloc(sizeof(InstructionVector *) * code_count);
+	memcpy(searched, code, sizeof(InstructionVector *) * code_count);
+	int searched_count = code_count;
+
+	int saved = 0;
+	Candidate candidate = {0};
+	while (find_candidate(searched, searched_count, &candidate))
+	{
+		outline_candidate(searched, searched_count, &candidate, functions);
+		saved += candidate.saved;
+
+		searched = realloc(searched, sizeof(InstructionVector *) * (code_count + functions->length));
+		for (int i = 0; i < functions->length; i++)
+			searched[code_count + i] = &functions->data[i].instructions;
+		searched_count = code_count + functions->length;
+	}
+	free(searched);
+	return saved;
+}
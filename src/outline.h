@@ -0,0 +1,28 @@
+#ifndef OUTLINE_H
+#define OUTLINE_H
+#include "emit.h"
+
+// A subroutine made from a sequence that was outlined
+typedef struct
+{
+	char *name;
+	InstructionVector instructions;
+} OutlinedFunction;
+
+typedef struct
+{
+	OutlinedFunction *data;
+	int length;
+	int capacity;
+} OutlinedFunctionVector;
+
+// Looks for instruction sequences that repeat across the lowered code and moves them into shared
+// subroutines, replacing every occurrence with a call, as long as that makes the program smaller.
+// Sequences may not push, pop, call or move sp and must not read r0 before writing it since the call
+// goes through r0. Reading sp is allowed for frame addresses, the subroutine adds one to them for the
+// return address on the stack. code holds code_count vectors that are rewritten in place, the new
+// subroutines are added to functions. Outlined subroutines are searched as well, so they can end up
+// calling each other. Returns the number of instructions saved.
+int outline_code(InstructionVector **code, int code_count, OutlinedFunctionVector *functions);
+
+#endif // !OUTLINE_H
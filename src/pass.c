@@ -0,0 +1,301 @@
+#include <stdlib.h>
+#include <string.h>
+#include "pass.h"
+#include "optimize.h"
+#include "ssa.h"
+#include "frame.h"
+#include "isel.h"
+#include "loop.h"
+#include "branch.h"
+
+typedef enum
+{
+	ANALYSIS_FRAME_ACCESS,
+	ANALYSIS_COUNT,
+} AnalysisKind;
+
+typedef struct
+{
+	const char *name;
+	void *(*compute)(InstructionVector *iv);
+	void (*release)(void *result);
+} Analysis;
+
+// The code a pipeline runs over and the analyses that are still valid for it
+typedef struct
+{
+	InstructionVector *iv;
+	const char *name;
+	bool function;
+	void *analyses[ANALYSIS_COUNT];
+} PassUnit;
+
+typedef struct
+{
+	const char *name;
+	int (*run)(PassUnit *unit); // Returns the number of changes
+	OptimizationLevel level;	// Lowest level the pass runs at
+	bool estimate;				// Part of PIPELINE_INLINE_ESTIMATE
+} Pass;
+
+typedef struct
+{
+	const char *name;
+	int runs;
+	int changes;
+	int removed; // Instructions
+	int hits;	 // Requests answered from the cache, for analyses
+	clock_t time;
+} PassStatistics;
+
+static PassOptions g_pass_options;
+static PassStatistics *g_statistics;
+static int g_statistics_length;
+static int g_statistics_capacity;
+static clock_t g_pass_time; // Spent in passes and analyses so far
+
+static void *compute_frame_access(InstructionVector *iv)
+{
+	return analyze_frame_access(iv);
+}
+
+static void release_frame_access(void *result)
+{
+	frame_access_free(result);
+}
+
+static const Analysis g_analyses[ANALYSIS_COUNT] = {
+	{"frame-access", compute_frame_access, release_frame_access},
+};
+
+// Finds the statistics of a pass, analysis or phase by name, adding them on first use
+static PassStatistics *statistics_entry(const char *name)
+{
+	for (int i = 0; i < g_statistics_length; i++)
+	{
+		if (!strcmp(g_statistics[i].name, name))
+			return &g_statistics[i];
+	}
+	if (g_statistics_length == g_statistics_capacity)
+	{
+		g_statistics_capacity = g_statistics_capacity * 2 + 16;
+		g_statistics = realloc(g_statistics, sizeof(PassStatistics) * g_statistics_capacity);
+	}
+	PassStatistics *entry = &g_statistics[g_statistics_length++];
+	memset(entry, 0, sizeof(PassStatistics));
+	entry->name = name;
+	return entry;
+}
+
+static void *unit_analysis(PassUnit *unit, AnalysisKind kind)
+{
+	PassStatistics *statistics = statistics_entry(g_analyses[kind].name);
+	if (unit->analyses[kind])
+	{
+		statistics->hits++;
+		return unit->analyses[kind];
+	}
+	clock_t start = clock();
+	unit->analyses[kind] = g_analyses[kind].compute(unit->iv);
+	statistics->time += clock() - start;
+	g_pass_time += clock() - start;
+	statistics->runs++;
+	return unit->analyses[kind];
+}
+
+static void unit_invalidate(PassUnit *unit)
+{
+	for (int kind = 0; kind < ANALYSIS_COUNT; kind++)
+	{
+		if (unit->analyses[kind])
+			g_analyses[kind].release(unit->analyses[kind]);
+		unit->analyses[kind] = NULL;
+	}
+}
+
+// Cheap fingerprint of the code to notice when a pass changed it
+static unsigned code_hash(InstructionVector *iv)
+{
+	unsigned hash = 2166136261u ^ (unsigned)iv->length;
+	for (int i = 0; i < iv->length; i++)
+	{
+		Instruction *instruction = &iv->data[i];
+		int fields[] = {instruction->opcode, instruction->dst,	  instruction->src,	 instruction->immediate,
+						instruction->offset, instruction->size,	  instruction->count, instruction->depth,
+						instruction->arguments, (int)(size_t)instruction->symbol};
+		for (int j = 0; j < (int)(sizeof(fields) / sizeof(fields[0])); j++)
+			hash = (hash ^ (unsigned)fields[j]) * 16777619u;
+	}
+	return hash;
+}
+
+static int run_branches(PassUnit *unit)
+{
+	return optimize_branches(unit->iv);
+}
+
+static int run_scalar_replacement(PassUnit *unit)
+{
+	return optimize_scalar_replacement(unit->iv);
+}
+
+static int run_common_addresses(PassUnit *unit)
+{
+	return frame_common_addresses(unit->iv);
+}
+
+static int run_redundant_loads(PassUnit *unit)
+{
+	return optimize_redundant_loads(unit->iv, unit_analysis(unit, ANALYSIS_FRAME_ACCESS));
+}
+
+static int run_ssa(PassUnit *unit)
+{
+	return optimize_ssa(unit->iv);
+}
+
+static int run_dead_stores(PassUnit *unit)
+{
+	return optimize_dead_stores(unit->iv, unit_analysis(unit, ANALYSIS_FRAME_ACCESS));
+}
+
+static int run_dead_code(PassUnit *unit)
+{
+	return optimize_dead_code(unit->iv);
+}
+
+static int run_stack_slots(PassUnit *unit)
+{
+	int frame_before = 0;
+	int frame_after = optimize_stack_slots(unit->iv, unit_analysis(unit, ANALYSIS_FRAME_ACCESS), &frame_before);
+	if (g_pass_options.frame_report)
+		fprintf(stderr, "Frame size of %s: %d words, %d after slot coloring\n", unit->name, frame_before, frame_after);
+	return frame_before - frame_after;
+}
+
+static int run_loop_invariants(PassUnit *unit)
+{
+	return hoist_loop_invariants(unit->iv);
+}
+
+static int run_frame_lower(PassUnit *unit)
+{
+	// Leaf functions never need the frame pointer, they address everything from sp without saving r7
+	bool leaf = true;
+	for (int i = 0; i < unit->iv->length; i++)
+	{
+		if (unit->iv->data[i].opcode == OPCODE_CALL)
+			leaf = false;
+	}
+	bool use_frame_pointer = g_pass_options.frame_pointer && !(unit->function && leaf);
+	frame_lower(unit->iv, use_frame_pointer, unit->function);
+	return 0;
+}
+
+static int run_select_constants(PassUnit *unit)
+{
+	return select_constants(unit->iv);
+}
+
+// Branches are cleaned up first so the passes after it see fewer labels, and again once dead code is gone
+static const Pass g_passes[] = {
+	{"branches", run_branches, OPTIMIZATION_O1, true},
+	{"scalar-replacement", run_scalar_replacement, OPTIMIZATION_O2, true},
+	{"common-addresses", run_common_addresses, OPTIMIZATION_O1, true},
+	{"redundant-loads", run_redundant_loads, OPTIMIZATION_O1, true},
+	{"ssa", run_ssa, OPTIMIZATION_O2, true},
+	{"dead-stores", run_dead_stores, OPTIMIZATION_O1, true},
+	{"dead-code", run_dead_code, OPTIMIZATION_O1, true},
+	{"branches", run_branches, OPTIMIZATION_O1, true},
+	{"stack-slots", run_stack_slots, OPTIMIZATION_O1, false},
+	{"loop-invariants", run_loop_invariants, OPTIMIZATION_O2, false},
+	{"frame-lower", run_frame_lower, OPTIMIZATION_O0, false},
+	{"select-constants", run_select_constants, OPTIMIZATION_O1, false},
+};
+
+void pass_manager_init(PassOptions *options)
+{
+	g_pass_options = *options;
+}
+
+void pass_manager_run(Pipeline pipeline, InstructionVector *iv, const char *name, bool function)
+{
+	PassUnit unit = {0};
+	unit.iv = iv;
+	unit.name = name;
+	unit.function = function;
+	for (int i = 0; i < (int)(sizeof(g_passes) / sizeof(g_passes[0])); i++)
+	{
+		const Pass *pass = &g_passes[i];
+		if (pass->level > g_pass_options.level || (pipeline == PIPELINE_INLINE_ESTIMATE && !pass->estimate))
+			continue;
+
+		PassStatistics *statistics = statistics_entry(pass->name);
+		unsigned hash = code_hash(iv);
+		int length = iv->length;
+		clock_t start = clock();
+		int changes = pass->run(&unit);
+		statistics->time += clock() - start;
+		g_pass_time += clock() - start;
+		statistics->runs++;
+		statistics->changes += changes;
+		statistics->removed += length - iv->length;
+		if (code_hash(iv) != hash)
+			unit_invalidate(&unit);
+	}
+	unit_invalidate(&unit);
+}
+
+void pass_manager_run_program(InstructionVector **code, int code_count, OutlinedFunctionVector *functions)
+{
+	if (g_pass_options.level < OPTIMIZATION_OS)
+		return;
+	PassStatistics *statistics = statistics_entry("outline");
+	clock_t start = clock();
+	statistics->removed += outline_code(code, code_count, functions);
+	statistics->time += clock() - start;
+	g_pass_time += clock() - start;
+	statistics->runs++;
+	statistics->changes += functions->length;
+}
+
+void pass_manager_phase_begin(PhaseTimer *timer)
+{
+	timer->start = clock();
+	timer->passes = g_pass_time;
+}
+
+void pass_manager_phase_end(PhaseTimer *timer, const char *name)
+{
+	PassStatistics *statistics = statistics_entry(name);
+	statistics->time += clock() - timer->start - (g_pass_time - timer->passes);
+	statistics->runs++;
+}
+
+void pass_manager_report(void)
+{
+	if (g_pass_options.time_passes)
+	{
+		clock_t total = 0;
+		for (int i = 0; i < g_statistics_length; i++)
+			total += g_statistics[i].time;
+		fprintf(stderr, "%-20s %10s %7s\n", "Pass", "Time (ms)", "Share");
+		for (int i = 0; i < g_statistics_length; i++)
+		{
+			PassStatistics *statistics = &g_statistics[i];
+			fprintf(stderr, "%-20s %10.3f %6.1f%%\n", statistics->name, statistics->time * 1000.0 / CLOCKS_PER_SEC,
+					total ? statistics->time * 100.0 / total : 0.0);
+		}
+		fprintf(stderr, "%-20s %10.3f\n", "Total", total * 1000.0 / CLOCKS_PER_SEC);
+	}
+	if (g_pass_options.stats)
+	{
+		fprintf(stderr, "%-20s %6s %8s %8s %6s\n", "Pass", "Runs", "Changes", "Removed", "Hits");
+		for (int i = 0; i < g_statistics_length; i++)
+		{
+			PassStatistics *statistics = &g_statistics[i];
+			fprintf(stderr, "%-20s %6d %8d %8d %6d\n", statistics->name, statistics->runs, statistics->changes,
+					statistics->removed, statistics->hits);
+		}
+	}
+}
@@ -0,0 +1,54 @@
+#ifndef PASS_H
+#define PASS_H
+#include <time.h>
+#include "emit.h"
+#include "outline.h"
+
+typedef enum
+{
+	OPTIMIZATION_O0, // Only what is needed to get working code
+	OPTIMIZATION_O1, // Cheap local passes, no inlining
+	OPTIMIZATION_O2, // Everything that makes the code faster
+	OPTIMIZATION_OS, // O2 plus outlining, inlining only where it doesn't grow the code
+} OptimizationLevel;
+
+typedef struct
+{
+	OptimizationLevel level;
+	bool frame_pointer; // Address locals from r7 instead of sp
+	bool frame_report;	// Print the frame size before and after stack slot coloring
+	bool time_passes;	// Print the time spent in every pass
+	bool stats;			// Print how much every pass changed
+} PassOptions;
+
+typedef enum
+{
+	PIPELINE_FUNCTION,		  // Optimizes the code of a function or the top level code and lowers its frame
+	PIPELINE_INLINE_ESTIMATE, // The passes that shrink a body, run on a copy to estimate its inlined size
+} Pipeline;
+
+void pass_manager_init(PassOptions *options);
+
+// Runs the passes of the pipeline that are enabled at the optimization level over the code. Analyses
+// are computed when a pass first asks for them and kept until a pass changes the code.
+void pass_manager_run(Pipeline pipeline, InstructionVector *iv, const char *name, bool function);
+
+// Runs the passes over the whole program that are enabled at the optimization level, which is outlining
+// at -Os. code holds code_count vectors, outlined subroutines are added to functions.
+void pass_manager_run_program(InstructionVector **code, int code_count, OutlinedFunctionVector *functions);
+
+// Times work outside the passes, such as tokenizing, for the timing report. Time spent in passes that
+// run in between is left out.
+typedef struct
+{
+	clock_t start;
+	clock_t passes; // Time spent in passes when the phase started
+} PhaseTimer;
+
+void pass_manager_phase_begin(PhaseTimer *timer);
+void pass_manager_phase_end(PhaseTimer *timer, const char *name);
+
+// Prints the timing and statistics reports that were asked for to stderr
+void pass_manager_report(void);
+
+#endif // !PASS_H
@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+#include "runtime.h"
+
+static void push_instruction(InstructionVector *iv, Opcode opcode, int dst, int src, int immediate)
+{
+	Instruction instruction = {0};
+	instruction.opcode = opcode;
+	instruction.dst = dst;
+	instruction.src = src;
+	instruction.immediate = immediate;
+	instruction_vector_push(iv, &instruction);
+}
+
+static bool vector_calls(InstructionVector *iv, const char *symbol)
+{
+	for (int i = 0; i < iv->length; i++)
+	{
+		if (iv->data[i].opcode == OPCODE_MHI && iv->data[i].symbol && !strcmp(iv->data[i].symbol, symbol))
+			return true;
+	}
+	return false;
+}
+
+static bool calls(InstructionVector **code, int code_count, OutlinedFunctionVector *routines, const char *symbol)
+{
+	for (int i = 0; i < code_count; i++)
+	{
+		if (vector_calls(code[i], symbol))
+			return true;
+	}
+	for (int i = 0; i < routines->length; i++)
+	{
+		if (vector_calls(&routines->data[i].instructions, symbol))
+			return true;
+	}
+	return false;
+}
+
+// Shift-add over the bits of r2 from the top. The leading zero bits are shifted out first, the first set
+// bit makes the product r1, and every bit after it doubles the product and adds r1 when it is set. r0
+// holds the 1 the counter in r4 steps down by.
+static void mul16(InstructionVector *iv)
+{
+	int find = emit_new_label();
+	int loop = emit_new_label();
+	int next = emit_new_label();
+	int done = emit_new_label();
+	int zero = emit_new_label();
+	push_instruction(iv, OPCODE_BZ, 0, 2, zero);
+	push_instruction(iv, OPCODE_MOVI, 0, 0, 16);
+	push_instruction(iv, OPCODE_MOV, 4, 0, 0);
+	push_instruction(iv, OPCODE_MOVI, 0, 0, 1);
+	push_instruction(iv, OPCODE_LABEL, 0, 0, find);
+	push_instruction(iv, OPCODE_SUB, 4, 0, 0);
+	push_instruction(iv, OPCODE_ADD, 2, 2, 0);
+	push_instruction(iv, OPCODE_BNC, 0, 0, find);
+	push_instruction(iv, OPCODE_MOV, 3, 1, 0);
+	push_instruction(iv, OPCODE_BZ, 0, 4, done);
+	push_instruction(iv, OPCODE_LABEL, 0, 0, loop);
+	push_instruction(iv, OPCODE_ADD, 1, 1, 0);
+	push_instruction(iv, OPCODE_ADD, 2, 2, 0);
+	push_instruction(iv, OPCODE_BNC, 0, 0, next);
+	push_instruction(iv, OPCODE_ADD, 1, 3, 0);
+	push_instruction(iv, OPCODE_LABEL, 0, 0, next);
+	push_instruction(iv, OPCODE_SUB, 4, 0, 0);
+	push_instruction(iv, OPCODE_BNZ, 0, 4, loop);
+	push_instruction(iv, OPCODE_LABEL, 0, 0, done);
+	push_instruction(iv, OPCODE_RET, 0, 0, 0);
+	push_instruction(iv, OPCODE_LABEL, 0, 0, zero);
+	push_instruction(iv, OPCODE_MOV, 1, 2, 0);
+	push_instruction(iv, OPCODE_RET, 0, 0, 0);
+}
+
+void runtime_add_routines(InstructionVector **code, int code_count, OutlinedFunctionVector *routines)
+{
+	if (!calls(code, code_count, routines, RUNTIME_MUL16))
+		return;
+	OutlinedFunction routine;
+	routine.name = malloc(strlen(RUNTIME_MUL16) + 1);
+	strcpy(routine.name, RUNTIME_MUL16);
+	instruction_vector_init(&routine.instructions, 32);
+	mul16(&routine.instructions);
+	if (routines->length == routines->capacity)
+	{
+		routines->capacity = routines->capacity * 2 + 4;
+		routines->data = realloc(routines->data, sizeof(OutlinedFunction) * routines->capacity);
+	}
+	routines->data[routines->length++] = routine;
+}
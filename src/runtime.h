@@ -0,0 +1,12 @@
+#ifndef RUNTIME_H
+#define RUNTIME_H
+#include "outline.h"
+
+#define RUNTIME_MUL16 "__mul16" // r1 = r1 * r2, may clobber what a call may
+
+// Adds the runtime routines the lowered code calls to routines, so they are emitted with the program.
+// code holds code_count vectors, the routines already in routines are searched as well. Routines that
+// aren't called are left out.
+void runtime_add_routines(InstructionVector **code, int code_count, OutlinedFunctionVector *routines);
+
+#endif // !RUNTIME_H
@@ -0,0 +1,675 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ssa.h"
+#include "optimize.h"
+
+// Values live in the registers and the carry flag
+#define LOCATION_CARRY REGISTER_COUNT
+#define LOCATION_COUNT (REGISTER_COUNT + 1)
+
+typedef struct
+{
+	int start; // First instruction
+	int end;   // One past the last instruction
+	int successors[2];
+	int successor_count;
+	int *predecessors;
+	int predecessor_count;
+	int idom;	   // Immediate dominator, -1 for the entry and unreachable blocks
+	int rpo_index; // Position in reverse postorder, -1 if unreachable
+} BasicBlock;
+
+typedef struct
+{
+	int block;
+	int location;
+	int version;
+	int *arguments; // Incoming version per predecessor
+} Phi;
+
+typedef struct
+{
+	int instruction; // Defining instruction, -1 for phis and values on entry
+	int phi;		 // Defining phi or -1
+	int copy_of;	 // Version with the same value if this one was copied from it, otherwise -1
+	bool live;
+} Version;
+
+// A value computed earlier on the path from the entry
+typedef struct
+{
+	Opcode opcode;
+	int immediate;
+	const char *symbol;
+	int left; // Value numbers of the inputs, -1 if unused
+	int right;
+	int version;
+} Expression;
+
+typedef struct
+{
+	InstructionVector *iv;
+	BasicBlock *blocks;
+	int block_count;
+	int *rpo; // Reachable blocks in reverse postorder
+	int rpo_count;
+	bool *frontier; // block_count * block_count, frontier[b * block_count + x] if x is in the frontier of b
+	Phi *phis;
+	int phi_count;
+	int phi_capacity;
+	Version *versions;
+	int version_count;
+	int version_capacity;
+	int (*uses)[LOCATION_COUNT]; // Version read per instruction and location, -1 if not read
+	int (*defs)[LOCATION_COUNT]; // Version written per instruction and location, -1 if not written
+	int *reads;					 // Number of instructions reading each version
+	bool *deleted;
+	bool *live;
+	Expression *expressions;
+	int expression_count;
+	int changed;
+} Ssa;
+
+static int location_bit(int location)
+{
+	return 1 << location;
+}
+
+static int version_new(Ssa *ssa, int instruction, int phi)
+{
+	if (ssa->version_count == ssa->version_capacity)
+	{
+		ssa->version_capacity = ssa->version_capacity ? ssa->version_capacity * 2 : 64;
+		ssa->versions = realloc(ssa->versions, sizeof(Version) * ssa->version_capacity);
+	}
+	Version *version = &ssa->versions[ssa->version_count];
+	version->instruction = instruction;
+	version->phi = phi;
+	version->copy_of = -1;
+	version->live = false;
+	return ssa->version_count++;
+}
+
+// The version a chain of copies started from, two versions with the same value number hold the same value
+static int value_number(Ssa *ssa, int version)
+{
+	while (version != -1 && ssa->versions[version].copy_of != -1)
+		version = ssa->versions[version].copy_of;
+	return version;
+}
+
+static void add_edge(Ssa *ssa, int from, int to)
+{
+	BasicBlock *block = &ssa->blocks[to];
+	ssa->blocks[from].successors[ssa->blocks[from].successor_count++] = to;
+	block->predecessors = realloc(block->predecessors, sizeof(int) * (block->predecessor_count + 1));
+	block->predecessors[block->predecessor_count++] = from;
+}
+
+// A block starts at every label and after every instruction that may continue elsewhere. It falls through
+// to the next block unless it ends in an instruction that never does, and a branch adds its label's block.
+static void build_blocks(Ssa *ssa)
+{
+	InstructionVector *iv = ssa->iv;
+	ssa->blocks = calloc(iv->length, sizeof(BasicBlock));
+	int *block_of = malloc(sizeof(int) * iv->length); // Block of every instruction
+	int start = 0;
+	for (int i = 0; i < iv->length; i++)
+	{
+		Instruction *instruction = &iv->data[i];
+		bool last = i == iv->length - 1 || iv->data[i + 1].opcode == OPCODE_LABEL ||
+					instruction_ends_flow(instruction) || instruction_is_branch(instruction);
+		block_of[i] = ssa->block_count;
+		if (last)
+		{
+			BasicBlock *block = &ssa->blocks[ssa->block_count++];
+			block->start = start;
+			block->end = i + 1;
+			block->idom = -1;
+			block->rpo_index = -1;
+			start = i + 1;
+		}
+	}
+
+	int label_count;
+	int *labels = label_positions(iv, &label_count);
+	for (int b = 0; b < ssa->block_count; b++)
+	{
+		Instruction *last = &iv->data[ssa->blocks[b].end - 1];
+		if (!instruction_ends_flow(last) && b + 1 < ssa->block_count)
+			add_edge(ssa, b, b + 1);
+		if (instruction_is_branch(last) && labels[last->immediate] != -1)
+			add_edge(ssa, b, block_of[labels[last->immediate]]);
+	}
+	free(labels);
+	free(block_of);
+}
+
+static void visit_postorder(Ssa *ssa, int block, bool *visited, int *postorder, int *count)
+{
+	visited[block] = true;
+	for (int i = 0; i < ssa->blocks[block].successor_count; i++)
+	{
+		int successor = ssa->blocks[block].successors[i];
+		if (!visited[successor])
+			visit_postorder(ssa, successor, visited, postorder, count);
+	}
+	postorder[(*count)++] = block;
+}
+
+static int intersect(Ssa *ssa, int *idom, int a, int b)
+{
+	while (a != b)
+	{
+		while (ssa->blocks[a].rpo_index > ssa->blocks[b].rpo_index)
+			a = idom[a];
+		while (ssa->blocks[b].rpo_index > ssa->blocks[a].rpo_index)
+			b = idom[b];
+	}
+	return a;
+}
+
+// Iterative dominators over the reverse postorder (Cooper, Harvey and Kennedy) and the dominance frontiers
+static void build_dominators(Ssa *ssa)
+{
+	int n = ssa->block_count;
+	bool *visited = calloc(n, sizeof(bool));
+	int *postorder = malloc(sizeof(int) * n);
+	visit_postorder(ssa, 0, visited, postorder, &ssa->rpo_count);
+	ssa->rpo = malloc(sizeof(int) * n);
+	for (int i = 0; i < ssa->rpo_count; i++)
+	{
+		ssa->rpo[i] = postorder[ssa->rpo_count - 1 - i];
+		ssa->blocks[ssa->rpo[i]].rpo_index = i;
+	}
+
+	int *idom = malloc(sizeof(int) * n);
+	for (int b = 0; b < n; b++)
+		idom[b] = -1;
+	idom[0] = 0;
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+		for (int i = 1; i < ssa->rpo_count; i++)
+		{
+			BasicBlock *block = &ssa->blocks[ssa->rpo[i]];
+			int new_idom = -1;
+			for (int p = 0; p < block->predecessor_count; p++)
+			{
+				int predecessor = block->predecessors[p];
+				if (idom[predecessor] == -1)
+					continue;
+				new_idom = new_idom == -1 ? predecessor : intersect(ssa, idom, predecessor, new_idom);
+			}
+			if (idom[ssa->rpo[i]] != new_idom)
+			{
+				idom[ssa->rpo[i]] = new_idom;
+				changed = true;
+			}
+		}
+	}
+
+	ssa->frontier = calloc(n * n, sizeof(bool));
+	for (int b = 0; b < n; b++)
+	{
+		BasicBlock *block = &ssa->blocks[b];
+		if (block->rpo_index == -1 || block->predecessor_count < 2)
+			continue;
+		for (int p = 0; p < block->predecessor_count; p++)
+		{
+			int runner = block->predecessors[p];
+			if (ssa->blocks[runner].rpo_index == -1)
+				continue;
+			while (runner != idom[b])
+			{
+				ssa->frontier[runner * n + b] = true;
+				runner = idom[runner];
+			}
+		}
+	}
+	for (int b = 1; b < n; b++)
+		ssa->blocks[b].idom = idom[b];
+
+	free(visited);
+	free(postorder);
+	free(idom);
+}
+
+static void place_phi(Ssa *ssa, int block, int location)
+{
+	if (ssa->phi_count == ssa->phi_capacity)
+	{
+		ssa->phi_capacity = ssa->phi_capacity ? ssa->phi_capacity * 2 : 16;
+		ssa->phis = realloc(ssa->phis, sizeof(Phi) * ssa->phi_capacity);
+	}
+	Phi *phi = &ssa->phis[ssa->phi_count];
+	phi->block = block;
+	phi->location = location;
+	phi->arguments = malloc(sizeof(int) * (ssa->blocks[block].predecessor_count + 1));
+	for (int p = 0; p < ssa->blocks[block].predecessor_count; p++)
+		phi->arguments[p] = -1;
+	phi->version = version_new(ssa, -1, ssa->phi_count);
+	ssa->phi_count++;
+}
+
+// Every location gets a phi on the iterated dominance frontier of the blocks that write it
+static void place_phis(Ssa *ssa)
+{
+	int n = ssa->block_count;
+	bool *has_phi = malloc(n * sizeof(bool));
+	bool *queued = malloc(n * sizeof(bool));
+	int *worklist = malloc(n * sizeof(int));
+	for (int location = 0; location < LOCATION_COUNT; location++)
+	{
+		memset(has_phi, 0, n * sizeof(bool));
+		memset(queued, 0, n * sizeof(bool));
+		int count = 0;
+		for (int b = 0; b < n; b++)
+		{
+			BasicBlock *block = &ssa->blocks[b];
+			for (int i = block->start; i < block->end && !queued[b]; i++)
+			{
+				if (instruction_defs(&ssa->iv->data[i]) & location_bit(location))
+				{
+					queued[b] = true;
+					worklist[count++] = b;
+				}
+			}
+		}
+		while (count > 0)
+		{
+			int b = worklist[--count];
+			for (int x = 0; x < n; x++)
+			{
+				if (!ssa->frontier[b * n + x] || has_phi[x])
+					continue;
+				has_phi[x] = true;
+				place_phi(ssa, x, location);
+				if (!queued[x])
+				{
+					queued[x] = true;
+					worklist[count++] = x;
+				}
+			}
+		}
+	}
+	free(has_phi);
+	free(queued);
+	free(worklist);
+}
+
+static void rename_block(Ssa *ssa, int b, const int *incoming)
+{
+	int current[LOCATION_COUNT];
+	memcpy(current, incoming, sizeof(current));
+	BasicBlock *block = &ssa->blocks[b];
+	for (int p = 0; p < ssa->phi_count; p++)
+	{
+		if (ssa->phis[p].block == b)
+			current[ssa->phis[p].location] = ssa->phis[p].version;
+	}
+
+	for (int i = block->start; i < block->end; i++)
+	{
+		Instruction *instruction = &ssa->iv->data[i];
+		int uses = instruction_uses(instruction);
+		int defs = instruction_defs(instruction);
+		for (int location = 0; location < LOCATION_COUNT; location++)
+		{
+			ssa->uses[i][location] = (uses & location_bit(location)) ? current[location] : -1;
+			if (ssa->uses[i][location] != -1)
+				ssa->reads[ssa->uses[i][location]]++;
+		}
+		for (int location = 0; location < LOCATION_COUNT; location++)
+		{
+			ssa->defs[i][location] = -1;
+			if (!(defs & location_bit(location)))
+				continue;
+			int version = version_new(ssa, i, -1);
+			if (instruction->opcode == OPCODE_MOV)
+				ssa->versions[version].copy_of = ssa->uses[i][instruction->src];
+			ssa->defs[i][location] = version;
+			current[location] = version;
+		}
+	}
+
+	for (int s = 0; s < block->successor_count; s++)
+	{
+		BasicBlock *successor = &ssa->blocks[block->successors[s]];
+		for (int p = 0; p < successor->predecessor_count; p++)
+		{
+			if (successor->predecessors[p] != b)
+				continue;
+			for (int phi = 0; phi < ssa->phi_count; phi++)
+			{
+				if (ssa->phis[phi].block == block->successors[s])
+					ssa->phis[phi].arguments[p] = current[ssa->phis[phi].location];
+			}
+		}
+	}
+
+	for (int child = 0; child < ssa->block_count; child++)
+	{
+		if (ssa->blocks[child].idom == b)
+			rename_block(ssa, child, current);
+	}
+}
+
+// Recomputes which versions the possibly rewritten instruction reads, current holds the versions before it
+static void update_uses(Ssa *ssa, int i, const int *current)
+{
+	int uses = instruction_uses(&ssa->iv->data[i]);
+	for (int location = 0; location < LOCATION_COUNT; location++)
+	{
+		if (ssa->uses[i][location] != -1)
+			ssa->reads[ssa->uses[i][location]]--;
+		ssa->uses[i][location] = (uses & location_bit(location)) ? current[location] : -1;
+		if (ssa->uses[i][location] != -1)
+			ssa->reads[ssa->uses[i][location]]++;
+	}
+}
+
+// A register other than except that holds the value number, -1 if there is none
+static int register_holding(Ssa *ssa, const int *current, int value, int except)
+{
+	for (int reg = 0; reg < REGISTER_SP; reg++)
+	{
+		if (reg != except && current[reg] != -1 && value_number(ssa, current[reg]) == value)
+			return reg;
+	}
+	return -1;
+}
+
+// Reads the operand from the register the value was copied from if that still holds it
+static void propagate_copy(Ssa *ssa, int i, int *operand, const int *current)
+{
+	if (*operand == REGISTER_SP)
+		return;
+	int version = ssa->uses[i][*operand];
+	if (version == -1 || ssa->versions[version].copy_of == -1)
+		return;
+	int reg = register_holding(ssa, current, value_number(ssa, version), *operand);
+	if (reg == -1)
+		return;
+	*operand = reg;
+	update_uses(ssa, i, current);
+	ssa->changed++;
+}
+
+static bool is_pure(Opcode opcode)
+{
+	switch (opcode)
+	{
+	case OPCODE_MOVI:
+	case OPCODE_MHI:
+	case OPCODE_ORI:
+	case OPCODE_ADDI:
+	case OPCODE_ADD:
+	case OPCODE_SUB:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// The register the pure instruction writes
+static int pure_destination(Instruction *instruction)
+{
+	return instruction->opcode == OPCODE_ADD || instruction->opcode == OPCODE_SUB ? instruction->dst : 0;
+}
+
+static bool same_expression(Expression *a, Expression *b)
+{
+	if (a->opcode != b->opcode || a->immediate != b->immediate || a->left != b->left || a->right != b->right)
+		return false;
+	if (!a->symbol || !b->symbol)
+		return a->symbol == b->symbol;
+	return !strcmp(a->symbol, b->symbol);
+}
+
+// Value numbering of one instruction. Drops it if its destination already holds the value, otherwise
+// turns it into a mov from a register that does, otherwise remembers it for the blocks it dominates.
+static void number_instruction(Ssa *ssa, int i, const int *current)
+{
+	Instruction *instruction = &ssa->iv->data[i];
+	if (instruction->opcode == OPCODE_MOV)
+	{
+		if (instruction->dst != REGISTER_SP &&
+			value_number(ssa, current[instruction->dst]) == value_number(ssa, ssa->uses[i][instruction->src]))
+		{
+			ssa->deleted[i] = true;
+			ssa->changed++;
+		}
+		return;
+	}
+	if (!is_pure(instruction->opcode))
+		return;
+	// The carry result has no register that could hold it instead
+	int carry = ssa->defs[i][LOCATION_CARRY];
+	if (carry != -1 && ssa->reads[carry] > 0)
+		return;
+
+	int dst = pure_destination(instruction);
+	if (dst == REGISTER_SP)
+		return;
+	Expression expression = {0};
+	expression.opcode = instruction->opcode;
+	expression.immediate = instruction->immediate;
+	expression.symbol = instruction->symbol;
+	expression.left = -1;
+	expression.right = -1;
+	if (instruction->opcode == OPCODE_ORI || instruction->opcode == OPCODE_ADDI)
+		expression.left = value_number(ssa, ssa->uses[i][0]);
+	if (instruction->opcode == OPCODE_ADD || instruction->opcode == OPCODE_SUB)
+	{
+		expression.left = value_number(ssa, ssa->uses[i][instruction->dst]);
+		expression.right = value_number(ssa, ssa->uses[i][instruction->src]);
+	}
+	expression.version = ssa->defs[i][dst];
+
+	for (int e = ssa->expression_count - 1; e >= 0; e--)
+	{
+		if (!same_expression(&ssa->expressions[e], &expression))
+			continue;
+		int value = value_number(ssa, ssa->expressions[e].version);
+		if (current[dst] != -1 && value_number(ssa, current[dst]) == value)
+		{
+			ssa->versions[expression.version].copy_of = current[dst];
+			ssa->deleted[i] = true;
+			ssa->changed++;
+			return;
+		}
+		int reg = register_holding(ssa, current, value, dst);
+		if (reg == -1)
+			break;
+		instruction->opcode = OPCODE_MOV;
+		instruction->dst = dst;
+		instruction->src = reg;
+		instruction->immediate = 0;
+		instruction->symbol = NULL;
+		update_uses(ssa, i, current);
+		ssa->versions[expression.version].copy_of = current[reg];
+		ssa->changed++;
+		return;
+	}
+	ssa->expressions[ssa->expression_count++] = expression;
+}
+
+static void optimize_block(Ssa *ssa, int b, const int *incoming)
+{
+	int current[LOCATION_COUNT];
+	memcpy(current, incoming, sizeof(current));
+	int expression_count = ssa->expression_count;
+	BasicBlock *block = &ssa->blocks[b];
+	for (int p = 0; p < ssa->phi_count; p++)
+	{
+		if (ssa->phis[p].block == b)
+			current[ssa->phis[p].location] = ssa->phis[p].version;
+	}
+
+	for (int i = block->start; i < block->end; i++)
+	{
+		Instruction *instruction = &ssa->iv->data[i];
+		switch (instruction->opcode)
+		{
+		case OPCODE_MOV:
+		case OPCODE_LDR:
+		case OPCODE_PUSH:
+		case OPCODE_ADD:
+		case OPCODE_SUB:
+		case OPCODE_ADC:
+		case OPCODE_SBC:
+			propagate_copy(ssa, i, &instruction->src, current);
+			break;
+		case OPCODE_STR:
+			propagate_copy(ssa, i, &instruction->dst, current);
+			propagate_copy(ssa, i, &instruction->src, current);
+			break;
+		default:
+			break;
+		}
+		number_instruction(ssa, i, current);
+
+		for (int location = 0; location < LOCATION_COUNT; location++)
+		{
+			int version = ssa->defs[i][location];
+			if (version == -1)
+				continue;
+			// A dropped instruction leaves the value that was already there
+			if (ssa->deleted[i])
+			{
+				ssa->versions[version].copy_of = current[location];
+				ssa->versions[version].instruction = -1;
+			}
+			current[location] = version;
+		}
+	}
+
+	for (int child = 0; child < ssa->block_count; child++)
+	{
+		if (ssa->blocks[child].idom == b)
+			optimize_block(ssa, child, current);
+	}
+	ssa->expression_count = expression_count;
+}
+
+static void mark_instruction(Ssa *ssa, int i, int *worklist, int *count);
+
+static void mark_version(Ssa *ssa, int v, int *worklist, int *count)
+{
+	if (v == -1 || ssa->versions[v].live)
+		return;
+	Version *version = &ssa->versions[v];
+	version->live = true;
+	if (version->instruction != -1)
+		mark_instruction(ssa, version->instruction, worklist, count);
+	else if (version->phi != -1)
+		worklist[(*count)++] = v;
+	else if (version->copy_of != -1)
+		mark_version(ssa, version->copy_of, worklist, count);
+}
+
+static void mark_instruction(Ssa *ssa, int i, int *worklist, int *count)
+{
+	if (ssa->live[i])
+		return;
+	ssa->live[i] = true;
+	for (int location = 0; location < LOCATION_COUNT; location++)
+		mark_version(ssa, ssa->uses[i][location], worklist, count);
+}
+
+// Keeps what has side effects and, following the def-use chains backwards, what that reads. Phis only
+// keep their arguments alive once they are live themselves, so dead cycles through phis go away too.
+static void eliminate_dead_code(Ssa *ssa)
+{
+	InstructionVector *iv = ssa->iv;
+	int *worklist = malloc(sizeof(int) * (ssa->version_count + 1));
+	int count = 0;
+	for (int r = 0; r < ssa->rpo_count; r++)
+	{
+		BasicBlock *block = &ssa->blocks[ssa->rpo[r]];
+		for (int i = block->start; i < block->end; i++)
+		{
+			if (!ssa->deleted[i] && !instruction_removable(&iv->data[i]))
+				mark_instruction(ssa, i, worklist, &count);
+		}
+	}
+	while (count > 0)
+	{
+		Phi *phi = &ssa->phis[ssa->versions[worklist[--count]].phi];
+		for (int p = 0; p < ssa->blocks[phi->block].predecessor_count; p++)
+			mark_version(ssa, phi->arguments[p], worklist, &count);
+	}
+	free(worklist);
+
+	for (int i = 0; i < iv->length; i++)
+	{
+		if (!ssa->deleted[i] && !ssa->live[i])
+		{
+			ssa->deleted[i] = true;
+			ssa->changed++;
+		}
+	}
+}
+
+int optimize_ssa(InstructionVector *iv)
+{
+	if (iv->length == 0)
+		return 0;
+
+	Ssa ssa = {0};
+	ssa.iv = iv;
+	build_blocks(&ssa);
+	build_dominators(&ssa);
+	place_phis(&ssa);
+
+	ssa.uses = malloc(sizeof(*ssa.uses) * iv->length);
+	ssa.defs = malloc(sizeof(*ssa.defs) * iv->length);
+	for (int i = 0; i < iv->length; i++)
+	{
+		for (int location = 0; location < LOCATION_COUNT; location++)
+		{
+			ssa.uses[i][location] = -1;
+			ssa.defs[i][location] = -1;
+		}
+	}
+	// Each location starts out with the value it has on entry
+	int entry[LOCATION_COUNT];
+	for (int location = 0; location < LOCATION_COUNT; location++)
+		entry[location] = version_new(&ssa, -1, -1);
+	ssa.reads = calloc(ssa.version_count + iv->length * LOCATION_COUNT, sizeof(int));
+	rename_block(&ssa, 0, entry);
+
+	ssa.deleted = calloc(iv->length, sizeof(bool));
+	ssa.live = calloc(iv->length, sizeof(bool));
+	ssa.expressions = malloc(sizeof(Expression) * iv->length);
+	optimize_block(&ssa, 0, entry);
+	eliminate_dead_code(&ssa);
+
+	// Out of SSA: versions stayed in the register they were defined in, so only the deleted code goes
+	int write_index = 0;
+	for (int i = 0; i < iv->length; i++)
+	{
+		if (!ssa.deleted[i])
+			iv->data[write_index++] = iv->data[i];
+	}
+	iv->length = write_index;
+
+	for (int b = 0; b < ssa.block_count; b++)
+		free(ssa.blocks[b].predecessors);
+	for (int p = 0; p < ssa.phi_count; p++)
+		free(ssa.phis[p].arguments);
+	free(ssa.blocks);
+	free(ssa.rpo);
+	free(ssa.frontier);
+	free(ssa.phis);
+	free(ssa.versions);
+	free(ssa.uses);
+	free(ssa.defs);
+	free(ssa.reads);
+	free(ssa.deleted);
+	free(ssa.live);
+	free(ssa.expressions);
+	return ssa.changed;
+}
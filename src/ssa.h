@@ -0,0 +1,17 @@
+#ifndef SSA_H
+#define SSA_H
+#include "emit.h"
+
+// Puts the registers and the carry flag of the code into SSA form: the code is split into basic blocks,
+// the dominator tree is built and phis are placed on the dominance frontiers of every definition. On top
+// of that it runs
+// - global value numbering over the dominator tree, dropping computations whose value is still in the
+//   destination register and turning the others into a mov from the register that holds the value,
+// - copy propagation, reading a copied value from the register it was copied from while that still holds it,
+// - dead code elimination that follows the SSA def-use chains, which also removes unreachable code.
+// Versions are never moved to another register, so leaving SSA form only means dropping the phis and
+// needs no copies. Values in memory are left to optimize_redundant_loads.
+// Returns the number of instructions removed or rewritten.
+int optimize_ssa(InstructionVector *iv);
+
+#endif // !SSA_H
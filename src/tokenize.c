@@ -3,6 +3,9 @@
 #include <ctype.h>
 #include "tokenize.h"
 
+// Longest token that can be read, plus the character after it. Fits the ten digits of any u32 literal.
+#define TOKENIZER_BUFFER_SIZE 32
+
 void token_vector_init(TokenVector *tv, int capacity)
 {
 	tv->length = 0;
@@ -68,7 +71,7 @@ int check_keyword(char *buffer, int buffer_size, int buffer_index, TokenVector *
 
 bool tokenize_file(FILE *file, TokenVector *tv)
 {
-	char buffer[10];
+	char buffer[TOKENIZER_BUFFER_SIZE];
 	int buffer_length = 0;
 	int buffer_read_index = 0;
 	int eof = 0;
@@ -89,12 +92,12 @@ bool tokenize_file(FILE *file, TokenVector *tv)
 			{
 				int char_count = buffer_length - buffer_read_index;
 				memmove(buffer, &buffer[buffer_read_index], char_count);
-				buffer_length = fread(&buffer[char_count], sizeof(char), 10 - char_count, file);
+				buffer_length = fread(&buffer[char_count], sizeof(char), TOKENIZER_BUFFER_SIZE - char_count, file);
 				buffer_length += char_count;
 			}
 			else
 			{
-				buffer_length = fread(buffer, sizeof(char), 10, file);
+				buffer_length = fread(buffer, sizeof(char), TOKENIZER_BUFFER_SIZE, file);
 			}
 			buffer_read_index = 0;
 			int read_result = ferror(file);
@@ -117,6 +120,38 @@ bool tokenize_file(FILE *file, TokenVector *tv)
 									   eof, &read_more);
 		buffer_read_index += keyword_length;
 
+		keyword_length = check_keyword(buffer, buffer_length, buffer_read_index, tv, "u32", TOKEN_TYPE_U32,
+									   eof, &read_more);
+		buffer_read_index += keyword_length;
+
+		keyword_length = check_keyword(buffer, buffer_length, buffer_read_index, tv, "i32", TOKEN_TYPE_I32,
+									   eof, &read_more);
+		buffer_read_index += keyword_length;
+
+		keyword_length = check_keyword(buffer, buffer_length, buffer_read_index, tv, "return", TOKEN_TYPE_RETURN,
+									   eof, &read_more);
+		buffer_read_index += keyword_length;
+
+		keyword_length = check_keyword(buffer, buffer_length, buffer_read_index, tv, "while", TOKEN_TYPE_WHILE,
+									   eof, &read_more);
+		buffer_read_index += keyword_length;
+
+		keyword_length = check_keyword(buffer, buffer_length, buffer_read_index, tv, "for", TOKEN_TYPE_FOR,
+									   eof, &read_more);
+		buffer_read_index += keyword_length;
+
+		keyword_length = check_keyword(buffer, buffer_length, buffer_read_index, tv, "if", TOKEN_TYPE_IF,
+									   eof, &read_more);
+		buffer_read_index += keyword_length;
+
+		keyword_length = check_keyword(buffer, buffer_length, buffer_read_index, tv, "else", TOKEN_TYPE_ELSE,
+									   eof, &read_more);
+		buffer_read_index += keyword_length;
+
+		keyword_length = check_keyword(buffer, buffer_length, buffer_read_index, tv, "global", TOKEN_TYPE_GLOBAL,
+									   eof, &read_more);
+		buffer_read_index += keyword_length;
+
 		if (buffer_length - buffer_read_index >= 3 && buffer[buffer_read_index] == 'u' && buffer[buffer_read_index + 1] == '1' && buffer[buffer_read_index + 2] == '6')
 		{
 			int chars_in_buffer = buffer_length - buffer_read_index;
@@ -204,18 +239,60 @@ bool tokenize_file(FILE *file, TokenVector *tv)
 			}
 		}
 
-		if (buffer[buffer_read_index] == '=')
+		if (buffer[buffer_read_index] == '=' || buffer[buffer_read_index] == '!' || buffer[buffer_read_index] == '<' ||
+			buffer[buffer_read_index] == '>')
 		{
+			// These may be followed by a second = that hasn't been read yet
+			if (buffer_length - buffer_read_index < 2 && !eof)
+			{
+				read_more = true;
+				continue;
+			}
+			bool equals_follows = buffer_length - buffer_read_index >= 2 && buffer[buffer_read_index + 1] == '=';
 			Token token = {0};
-			token.type = TOKEN_TYPE_EQUALS;
+			switch (buffer[buffer_read_index])
+			{
+			case '=':
+				token.type = equals_follows ? TOKEN_TYPE_EQUAL_EQUAL : TOKEN_TYPE_EQUALS;
+				break;
+			case '<':
+				token.type = equals_follows ? TOKEN_TYPE_LESS_EQUAL : TOKEN_TYPE_LESS;
+				break;
+			case '>':
+				token.type = equals_follows ? TOKEN_TYPE_GREATER_EQUAL : TOKEN_TYPE_GREATER;
+				break;
+			default:
+				if (!equals_follows)
+				{
+					puts("Tokenizer error");
+					return false;
+				}
+				token.type = TOKEN_TYPE_NOT_EQUAL;
+				break;
+			}
 			token_vector_push(tv, &token);
-			buffer_read_index++;
+			buffer_read_index += equals_follows ? 2 : 1;
 			continue;
 		}
 		if (buffer[buffer_read_index] == '-')
 		{
+			// May be the start of -> with the > not read yet
+			if (buffer_length - buffer_read_index < 2 && !eof)
+			{
+				read_more = true;
+				continue;
+			}
+			bool arrow = buffer_length - buffer_read_index >= 2 && buffer[buffer_read_index + 1] == '>';
 			Token token = {0};
-			token.type = TOKEN_TYPE_MINUS;
+			token.type = arrow ? TOKEN_TYPE_ARROW : TOKEN_TYPE_MINUS;
+			token_vector_push(tv, &token);
+			buffer_read_index += arrow ? 2 : 1;
+			continue;
+		}
+		if (buffer[buffer_read_index] == '.')
+		{
+			Token token = {0};
+			token.type = TOKEN_TYPE_DOT;
 			token_vector_push(tv, &token);
 			buffer_read_index++;
 			continue;
@@ -260,6 +337,22 @@ bool tokenize_file(FILE *file, TokenVector *tv)
 			buffer_read_index++;
 			continue;
 		}
+		if (buffer[buffer_read_index] == '[')
+		{
+			Token token = {0};
+			token.type = TOKEN_TYPE_OPEN_BRACKET;
+			token_vector_push(tv, &token);
+			buffer_read_index++;
+			continue;
+		}
+		if (buffer[buffer_read_index] == ']')
+		{
+			Token token = {0};
+			token.type = TOKEN_TYPE_CLOSE_BRACKET;
+			token_vector_push(tv, &token);
+			buffer_read_index++;
+			continue;
+		}
 		if (buffer[buffer_read_index] == '}')
 		{
 			Token token = {0};
@@ -313,7 +406,12 @@ bool tokenize_file(FILE *file, TokenVector *tv)
 						char int_char_buffer[12];
 						memcpy(int_char_buffer, &buffer[buffer_read_index], token_length);
 						int_char_buffer[token_length] = 0;
-						int value = atoi(int_char_buffer);
+						long long value = strtoll(int_char_buffer, NULL, 10);
+						if (value > 0xFFFFFFFFll)
+						{
+							puts("Integer literals have to fit in 32 bits");
+							return false;
+						}
 
 						Token token = {0};
 						token.type = TOKEN_TYPE_INTEGER_LITERAL;
@@ -340,7 +438,12 @@ bool tokenize_file(FILE *file, TokenVector *tv)
 					char int_char_buffer[12];
 					memcpy(int_char_buffer, &buffer[buffer_read_index], token_length);
 					int_char_buffer[token_length] = 0;
-					int value = atoi(int_char_buffer);
+					long long value = strtoll(int_char_buffer, NULL, 10);
+					if (value > 0xFFFFFFFFll)
+					{
+						puts("Integer literals have to fit in 32 bits");
+						return false;
+					}
 
 					Token token = {0};
 					token.type = TOKEN_TYPE_INTEGER_LITERAL;
@@ -442,7 +545,7 @@ void token_vector_print(TokenVector *tv)
 			printf("%s\n", token->name);
 			break;
 		case TOKEN_TYPE_INTEGER_LITERAL:
-			printf("%d\n", token->int_literal);
+			printf("%lld\n", token->int_literal);
 			break;
 		case TOKEN_TYPE_OPEN_PAREN:
 			puts("(");
@@ -450,12 +553,66 @@ void token_vector_print(TokenVector *tv)
 		case TOKEN_TYPE_CLOSE_PAREN:
 			puts(")");
 			break;
+		case TOKEN_TYPE_OPEN_BRACKET:
+			puts("[");
+			break;
+		case TOKEN_TYPE_CLOSE_BRACKET:
+			puts("]");
+			break;
+		case TOKEN_TYPE_DOT:
+			puts(".");
+			break;
+		case TOKEN_TYPE_ARROW:
+			puts("->");
+			break;
+		case TOKEN_TYPE_GLOBAL:
+			puts("global");
+			break;
 		case TOKEN_TYPE_U16:
 			puts("U16");
 			break;
 		case TOKEN_TYPE_I16:
 			puts("I16");
 			break;
+		case TOKEN_TYPE_U32:
+			puts("U32");
+			break;
+		case TOKEN_TYPE_I32:
+			puts("I32");
+			break;
+		case TOKEN_TYPE_RETURN:
+			puts("return");
+			break;
+		case TOKEN_TYPE_WHILE:
+			puts("while");
+			break;
+		case TOKEN_TYPE_FOR:
+			puts("for");
+			break;
+		case TOKEN_TYPE_IF:
+			puts("if");
+			break;
+		case TOKEN_TYPE_ELSE:
+			puts("else");
+			break;
+		case TOKEN_TYPE_EQUAL_EQUAL:
+			puts("==");
+			break;
+		case TOKEN_TYPE_NOT_EQUAL:
+			puts("!=");
+			break;
+		case TOKEN_TYPE_LESS:
+			puts("<");
+			break;
+		case TOKEN_TYPE_LESS_EQUAL:
+			puts("<=");
+			break;
+		case TOKEN_TYPE_GREATER:
+			puts(">");
+			break;
+		case TOKEN_TYPE_GREATER_EQUAL:
+			puts(">=");
+			break;
 		case TOKEN_TYPE_AMP:
 			puts("&");
 			break;
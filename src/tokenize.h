@@ -25,13 +25,31 @@ typedef enum
 	TOKEN_TYPE_COMMA,
 	TOKEN_TYPE_STRUCT,
 	TOKEN_TYPE_VOID,
+	TOKEN_TYPE_U32,
+	TOKEN_TYPE_I32,
+	TOKEN_TYPE_RETURN,
+	TOKEN_TYPE_WHILE,
+	TOKEN_TYPE_FOR,
+	TOKEN_TYPE_IF,
+	TOKEN_TYPE_ELSE,
+	TOKEN_TYPE_EQUAL_EQUAL,
+	TOKEN_TYPE_NOT_EQUAL,
+	TOKEN_TYPE_LESS,
+	TOKEN_TYPE_LESS_EQUAL,
+	TOKEN_TYPE_GREATER,
+	TOKEN_TYPE_GREATER_EQUAL,
+	TOKEN_TYPE_OPEN_BRACKET,
+	TOKEN_TYPE_CLOSE_BRACKET,
+	TOKEN_TYPE_DOT,
+	TOKEN_TYPE_ARROW,
+	TOKEN_TYPE_GLOBAL,
 } TokenType;
 
 typedef struct
 {
 	TokenType type;
 	char *name;
-	int int_literal;
+	long long int_literal; // Any u32, as well as the results of folding literals
 } Token;
 
 typedef struct
@@ -0,0 +1,509 @@
+#ifndef _WIN32
+#define _DEFAULT_SOURCE // For MAP_ANONYMOUS
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+#include "translate.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// Host registers: rbx holds the EmulatorState and r12 its memory, eax and ecx are scratch
+#define STATE_OFFSET(field) ((int32_t)offsetof(EmulatorState, field))
+#define REGISTER_OFFSET(reg) (STATE_OFFSET(registers) + (int32_t)sizeof(int) * (reg))
+#define STATISTIC_OFFSET(field) (STATE_OFFSET(statistics) + (int32_t)offsetof(EmulatorStatistics, field))
+#define EXECUTED_OFFSET(opcode) (STATISTIC_OFFSET(executed) + (int32_t)sizeof(long long) * (opcode))
+
+// A branch at the end of a block that still goes through the dispatcher
+typedef struct
+{
+	uint8_t *site; // The rel32 of its jmp
+	int target;	   // Code address it goes to
+} Patch;
+
+typedef struct
+{
+	uint8_t *code; // Executable host code
+	int used;
+	uint8_t *enter; // void enter(EmulatorState *state, void *block)
+	uint8_t *exit;	// Returns from enter
+	uint8_t **blocks; // Host code of the block starting at every code address, NULL until translated
+	int *lengths;	  // Instructions every translated block counts
+	Patch *patches;
+	int patch_count;
+	int patch_capacity;
+	EmulatorProgram *program;
+	CycleTable *table;
+} Translator;
+
+static void emit_byte(Translator *translator, int byte)
+{
+	translator->code[translator->used++] = (uint8_t)byte;
+}
+
+static void emit_int32(Translator *translator, int32_t value)
+{
+	memcpy(&translator->code[translator->used], &value, sizeof(value));
+	translator->used += sizeof(value);
+}
+
+// opcode modrm disp32 with rbx as the base, reg is the host register or opcode extension
+static void emit_state_operand(Translator *translator, int opcode, int reg, int32_t offset)
+{
+	emit_byte(translator, opcode);
+	emit_byte(translator, 0x83 | (reg << 3));
+	emit_int32(translator, offset);
+}
+
+#define HOST_EAX 0
+#define HOST_ECX 1
+
+static void emit_load(Translator *translator, int host, int32_t offset)
+{
+	emit_state_operand(translator, 0x8B, host, offset); // mov host, [rbx + offset]
+}
+
+static void emit_store(Translator *translator, int32_t offset, int host)
+{
+	emit_state_operand(translator, 0x89, host, offset); // mov [rbx + offset], host
+}
+
+static void emit_store_immediate(Translator *translator, int32_t offset, int32_t value)
+{
+	emit_state_operand(translator, 0xC7, 0, offset); // mov dword [rbx + offset], value
+	emit_int32(translator, value);
+}
+
+static void emit_add_counter(Translator *translator, int32_t offset, int32_t value)
+{
+	emit_byte(translator, 0x48);
+	emit_state_operand(translator, 0x81, 0, offset); // add qword [rbx + offset], value
+	emit_int32(translator, value);
+}
+
+static void emit_mask(Translator *translator)
+{
+	emit_byte(translator, 0x25); // and eax, 0xFFFF
+	emit_int32(translator, 0xFFFF);
+}
+
+// Stores eax masked to 16 bits into reg and bit 16, or the sign bit for a subtraction, into the carry
+static void emit_result_with_carry(Translator *translator, int reg, bool borrow)
+{
+	emit_byte(translator, 0x89); // mov ecx, eax
+	emit_byte(translator, 0xC1);
+	emit_byte(translator, 0xC1); // shr ecx, 16 or 31
+	emit_byte(translator, 0xE9);
+	emit_byte(translator, borrow ? 31 : 16); // eax is negative exactly when there was a borrow
+	emit_store(translator, STATE_OFFSET(carry), HOST_ECX);
+	emit_mask(translator);
+	emit_store(translator, REGISTER_OFFSET(reg), HOST_EAX);
+}
+
+// eax is the address, the word at it goes to or comes from host register
+static void emit_memory_access(Translator *translator, bool store, int host)
+{
+	emit_byte(translator, 0x41); // mov host, [r12 + rax * 4] or the other way round
+	emit_byte(translator, store ? 0x89 : 0x8B);
+	emit_byte(translator, 0x04 | (host << 3));
+	emit_byte(translator, 0x84);
+}
+
+static void emit_peak_stack(Translator *translator)
+{
+	emit_byte(translator, 0xB8); // mov eax, EMULATOR_STACK_TOP
+	emit_int32(translator, EMULATOR_STACK_TOP);
+	emit_state_operand(translator, 0x2B, HOST_EAX, REGISTER_OFFSET(REGISTER_SP)); // sub eax, sp
+	emit_state_operand(translator, 0x3B, HOST_EAX, STATISTIC_OFFSET(peak_stack)); // cmp eax, peak_stack
+	emit_byte(translator, 0x7E);												  // jle over the store
+	emit_byte(translator, 6);
+	emit_store(translator, STATISTIC_OFFSET(peak_stack), HOST_EAX);
+}
+
+static void add_patch(Translator *translator, uint8_t *site, int target)
+{
+	if (translator->patch_count == translator->patch_capacity)
+	{
+		translator->patch_capacity = translator->patch_capacity * 2 + 64;
+		translator->patches = realloc(translator->patches, sizeof(Patch) * translator->patch_capacity);
+	}
+	translator->patches[translator->patch_count++] = (Patch){site, target};
+}
+
+static void patch_jump(uint8_t *site, uint8_t *destination)
+{
+	int32_t relative = (int32_t)(destination - (site + 4));
+	memcpy(site, &relative, sizeof(relative));
+}
+
+// Leaves the block for the code address target. The jmp goes to the dispatcher until the block at target
+// is translated and to that block afterwards.
+static void emit_exit(Translator *translator, int target)
+{
+	emit_store_immediate(translator, STATE_OFFSET(pc), target);
+	emit_byte(translator, 0xE9);
+	uint8_t *site = &translator->code[translator->used];
+	emit_int32(translator, 0);
+	if (target >= 0 && target < emulator_code_length(translator->program) && translator->blocks[target])
+		patch_jump(site, translator->blocks[target]);
+	else
+	{
+		patch_jump(site, translator->exit);
+		add_patch(translator, site, target);
+	}
+}
+
+// Whether the instruction can be part of a block, the others are run by emulator_step
+static bool translatable(Instruction *instruction)
+{
+	switch (instruction->opcode)
+	{
+	case OPCODE_MOV:
+	case OPCODE_MOVI:
+	case OPCODE_MHI:
+	case OPCODE_ORI:
+	case OPCODE_ADDI:
+	case OPCODE_ADD:
+	case OPCODE_SUB:
+	case OPCODE_ADC:
+	case OPCODE_SBC:
+	case OPCODE_LDR:
+	case OPCODE_STR:
+	case OPCODE_PUSH:
+	case OPCODE_POP:
+	case OPCODE_B:
+	case OPCODE_BZ:
+	case OPCODE_BNZ:
+	case OPCODE_BC:
+	case OPCODE_BNC:
+	case OPCODE_LABEL:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void translate_instruction(Translator *translator, Instruction *instruction, int pc)
+{
+	int dst = instruction->dst;
+	int src = instruction->src;
+	switch (instruction->opcode)
+	{
+	case OPCODE_MOV:
+		emit_load(translator, HOST_EAX, REGISTER_OFFSET(src));
+		emit_store(translator, REGISTER_OFFSET(dst), HOST_EAX);
+		break;
+	case OPCODE_MOVI:
+		emit_store_immediate(translator, REGISTER_OFFSET(0), instruction->immediate & 0xFF);
+		break;
+	case OPCODE_MHI:
+	{
+		int value = instruction->symbol ? emulator_symbol_value(translator->program, pc) : instruction->immediate;
+		emit_store_immediate(translator, REGISTER_OFFSET(0), value & 0xFF00);
+		break;
+	}
+	case OPCODE_ORI:
+	{
+		int value = instruction->symbol ? emulator_symbol_value(translator->program, pc) : instruction->immediate;
+		emit_state_operand(translator, 0x81, 1, REGISTER_OFFSET(0)); // or dword [rbx + offset], value
+		emit_int32(translator, value & 0xFF);
+		break;
+	}
+	case OPCODE_ADDI:
+		emit_load(translator, HOST_EAX, REGISTER_OFFSET(0));
+		emit_byte(translator, 0x05); // add eax, immediate
+		emit_int32(translator, instruction->immediate & 0xFFFF);
+		emit_result_with_carry(translator, 0, false);
+		break;
+	case OPCODE_ADD:
+	case OPCODE_ADC:
+	case OPCODE_SUB:
+	case OPCODE_SBC:
+	{
+		bool subtract = instruction->opcode == OPCODE_SUB || instruction->opcode == OPCODE_SBC;
+		int operation = subtract ? 0x2B : 0x03; // sub or add eax, [rbx + offset]
+		emit_load(translator, HOST_EAX, REGISTER_OFFSET(dst));
+		emit_state_operand(translator, operation, HOST_EAX, REGISTER_OFFSET(src));
+		if (instruction->opcode == OPCODE_ADC || instruction->opcode == OPCODE_SBC)
+			emit_state_operand(translator, operation, HOST_EAX, STATE_OFFSET(carry));
+		emit_result_with_carry(translator, dst, subtract);
+		break;
+	}
+	case OPCODE_LDR:
+		emit_load(translator, HOST_EAX, REGISTER_OFFSET(src));
+		emit_memory_access(translator, false, HOST_EAX);
+		emit_store(translator, REGISTER_OFFSET(dst), HOST_EAX);
+		emit_add_counter(translator, STATISTIC_OFFSET(loads), 1);
+		break;
+	case OPCODE_STR:
+		emit_load(translator, HOST_EAX, REGISTER_OFFSET(dst));
+		emit_load(translator, HOST_ECX, REGISTER_OFFSET(src));
+		emit_memory_access(translator, true, HOST_ECX);
+		emit_add_counter(translator, STATISTIC_OFFSET(stores), 1);
+		break;
+	case OPCODE_PUSH:
+		emit_load(translator, HOST_EAX, REGISTER_OFFSET(REGISTER_SP));
+		emit_load(translator, HOST_ECX, REGISTER_OFFSET(src));
+		emit_memory_access(translator, true, HOST_ECX);
+		emit_byte(translator, 0x2D); // sub eax, 1
+		emit_int32(translator, 1);
+		emit_mask(translator);
+		emit_store(translator, REGISTER_OFFSET(REGISTER_SP), HOST_EAX);
+		emit_add_counter(translator, STATISTIC_OFFSET(stores), 1);
+		break;
+	case OPCODE_POP:
+		emit_load(translator, HOST_EAX, REGISTER_OFFSET(REGISTER_SP));
+		emit_byte(translator, 0x05); // add eax, 1
+		emit_int32(translator, 1);
+		emit_mask(translator);
+		emit_store(translator, REGISTER_OFFSET(REGISTER_SP), HOST_EAX);
+		emit_memory_access(translator, false, HOST_EAX);
+		emit_store(translator, REGISTER_OFFSET(dst), HOST_EAX);
+		emit_add_counter(translator, STATISTIC_OFFSET(loads), 1);
+		break;
+	default:
+		break;
+	}
+	if (instruction_writes_register(instruction, REGISTER_SP))
+		emit_peak_stack(translator);
+}
+
+// Ends the block with a branch at pc. A conditional branch is a test that skips over the exit to the
+// label, the exit to the next instruction follows.
+static void translate_branch(Translator *translator, Instruction *instruction, int pc)
+{
+	int target = emulator_label_position(translator->program, instruction->immediate);
+	if (instruction->opcode == OPCODE_B)
+	{
+		emit_exit(translator, target);
+		return;
+	}
+	bool on_carry = instruction->opcode == OPCODE_BC || instruction->opcode == OPCODE_BNC;
+	bool when_zero = instruction->opcode == OPCODE_BZ || instruction->opcode == OPCODE_BNC;
+	emit_state_operand(translator, 0x83, 7, on_carry ? STATE_OFFSET(carry) : REGISTER_OFFSET(instruction->src));
+	emit_byte(translator, 0); // cmp dword [rbx + offset], 0
+	emit_byte(translator, 0x0F);
+	emit_byte(translator, when_zero ? 0x85 : 0x84); // jne or je over the taken exit
+	int skip = translator->used;
+	emit_int32(translator, 0);
+	emit_exit(translator, target);
+	int32_t relative = translator->used - (skip + 4);
+	memcpy(&translator->code[skip], &relative, sizeof(relative));
+	emit_exit(translator, pc + 1);
+}
+
+// Drops every translated block, for when the code buffer runs full
+static void flush(Translator *translator)
+{
+	translator->used = translator->exit + 4 - translator->code;
+	memset(translator->blocks, 0, sizeof(uint8_t *) * (emulator_code_length(translator->program) + 1));
+	translator->patch_count = 0;
+}
+
+// Translates the block starting at pc. Returns NULL when the instruction at pc can't be translated.
+static uint8_t *translate_block(Translator *translator, int pc)
+{
+	EmulatorProgram *program = translator->program;
+	int code_length = emulator_code_length(program);
+
+	// What the block counts when it is entered
+	long long executed[OPCODE_LABEL + 1] = {0};
+	int length = 0;
+	int cycles = 0;
+	int end = pc;
+	bool branch = false;
+	while (end < code_length && length < TRANSLATE_MAX_BLOCK && !branch)
+	{
+		Instruction *instruction = emulator_instruction(program, end);
+		if (!translatable(instruction))
+			break;
+		end++;
+		if (instruction->opcode == OPCODE_LABEL)
+			continue;
+		branch = instruction_is_branch(instruction);
+		executed[instruction->opcode]++;
+		length++;
+		cycles += translator->table->opcodes[instruction->opcode];
+	}
+	if (length == 0)
+		return NULL;
+
+	// No instruction takes more than 128 bytes of host code, and the counters and exits take less than 512
+	if (translator->used + (end - pc) * 128 + 512 > TRANSLATE_CODE_SIZE)
+		flush(translator);
+	uint8_t *block = &translator->code[translator->used];
+
+	// Leave for the dispatcher, which steps one instruction at a time, when the whole block doesn't fit in
+	// the limit: mov rax, [rbx + instructions]; add rax, length; cmp rax, [rbx + limit]; jg exit
+	emit_byte(translator, 0x48);
+	emit_load(translator, HOST_EAX, STATISTIC_OFFSET(instructions));
+	emit_byte(translator, 0x48);
+	emit_byte(translator, 0x05);
+	emit_int32(translator, length);
+	emit_byte(translator, 0x48);
+	emit_state_operand(translator, 0x3B, HOST_EAX, STATE_OFFSET(limit));
+	emit_byte(translator, 0x0F);
+	emit_byte(translator, 0x8E); // jle over the exit
+	int skip = translator->used;
+	emit_int32(translator, 0);
+	emit_store_immediate(translator, STATE_OFFSET(pc), pc);
+	emit_byte(translator, 0xE9);
+	emit_int32(translator, 0);
+	patch_jump(&translator->code[translator->used - 4], translator->exit);
+	int32_t relative = translator->used - (skip + 4);
+	memcpy(&translator->code[skip], &relative, sizeof(relative));
+
+	emit_add_counter(translator, STATISTIC_OFFSET(instructions), length);
+	emit_add_counter(translator, STATISTIC_OFFSET(cycles), cycles);
+	for (int opcode = 0; opcode <= OPCODE_LABEL; opcode++)
+	{
+		if (executed[opcode] > 0)
+			emit_add_counter(translator, EXECUTED_OFFSET(opcode), (int32_t)executed[opcode]);
+	}
+
+	for (int i = pc; i < end; i++)
+	{
+		Instruction *instruction = emulator_instruction(program, i);
+		if (instruction_is_branch(instruction))
+			translate_branch(translator, instruction, i);
+		else
+			translate_instruction(translator, instruction, i);
+	}
+	if (!branch)
+		emit_exit(translator, end);
+
+	translator->blocks[pc] = block;
+	translator->lengths[pc] = length;
+
+	// Branches that were waiting for this block go straight to it from now on
+	int kept = 0;
+	for (int i = 0; i < translator->patch_count; i++)
+	{
+		Patch *patch = &translator->patches[i];
+		if (patch->target == pc)
+			patch_jump(patch->site, block);
+		else
+			translator->patches[kept++] = *patch;
+	}
+	translator->patch_count = kept;
+	return block;
+}
+
+static uint8_t *allocate_executable(size_t size)
+{
+#ifdef _WIN32
+	return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+	void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return memory == MAP_FAILED ? NULL : memory;
+#endif
+}
+
+static void free_executable(uint8_t *memory, size_t size)
+{
+#ifdef _WIN32
+	(void)size;
+	VirtualFree(memory, 0, MEM_RELEASE);
+#else
+	munmap(memory, size);
+#endif
+}
+
+// Saves rbx and r12, loads them and jumps to the block. The exit restores them and returns.
+static void emit_trampolines(Translator *translator)
+{
+	translator->enter = &translator->code[translator->used];
+	emit_byte(translator, 0x53); // push rbx
+	emit_byte(translator, 0x41); // push r12
+	emit_byte(translator, 0x54);
+#ifdef _WIN32
+	emit_byte(translator, 0x48); // mov rbx, rcx
+	emit_byte(translator, 0x89);
+	emit_byte(translator, 0xCB);
+#else
+	emit_byte(translator, 0x48); // mov rbx, rdi
+	emit_byte(translator, 0x89);
+	emit_byte(translator, 0xFB);
+#endif
+	emit_byte(translator, 0x4C); // mov r12, [rbx + memory]
+	emit_byte(translator, 0x8B);
+	emit_byte(translator, 0xA3);
+	emit_int32(translator, STATE_OFFSET(memory));
+	emit_byte(translator, 0xFF); // jmp to the block in the second argument register
+#ifdef _WIN32
+	emit_byte(translator, 0xE2);
+#else
+	emit_byte(translator, 0xE6);
+#endif
+
+	translator->exit = &translator->code[translator->used];
+	emit_byte(translator, 0x41); // pop r12
+	emit_byte(translator, 0x5C);
+	emit_byte(translator, 0x5B); // pop rbx
+	emit_byte(translator, 0xC3); // ret
+}
+
+bool translate_run(EmulatorProgram *program, CycleTable *table, long long limit, EmulatorStatistics *statistics)
+{
+	EmulatorState state;
+	emulator_start(program, limit, &state);
+	int code_length = emulator_code_length(program);
+
+	Translator translator = {0};
+	translator.program = program;
+	translator.table = table;
+	translator.code = allocate_executable(TRANSLATE_CODE_SIZE);
+	if (!translator.code)
+	{
+		puts("Failed to allocate memory for translated code, falling back to the emulator.");
+		emulator_finish(&state);
+		return emulator_run(program, table, limit, statistics);
+	}
+	translator.blocks = calloc(code_length + 1, sizeof(uint8_t *));
+	translator.lengths = calloc(code_length + 1, sizeof(int));
+	emit_trampolines(&translator);
+	void (*enter)(EmulatorState *, uint8_t *) = (void (*)(EmulatorState *, uint8_t *))translator.enter;
+
+	EmulatorStatus status = EMULATOR_RUNNING;
+	while (status == EMULATOR_RUNNING && state.statistics.instructions < limit)
+	{
+		int pc = state.pc;
+		uint8_t *block = NULL;
+		if (pc >= 0 && pc < code_length)
+		{
+			block = translator.blocks[pc];
+			if (!block && translatable(emulator_instruction(program, pc)))
+				block = translate_block(&translator, pc);
+		}
+		// A block returns with pc where it left off, which may be a chained block that didn't fit in the limit
+		if (block && state.statistics.instructions + translator.lengths[pc] <= limit)
+			enter(&state, block);
+		else
+			status = emulator_step(program, table, &state);
+	}
+
+	*statistics = state.statistics;
+	free(translator.blocks);
+	free(translator.lengths);
+	free(translator.patches);
+	free_executable(translator.code, TRANSLATE_CODE_SIZE);
+	emulator_finish(&state);
+	return status == EMULATOR_HALTED;
+}
+
+#else
+
+bool translate_run(EmulatorProgram *program, CycleTable *table, long long limit, EmulatorStatistics *statistics)
+{
+	return emulator_run(program, table, limit, statistics);
+}
+
+#endif
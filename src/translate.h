@@ -0,0 +1,18 @@
+#ifndef TRANSLATE_H
+#define TRANSLATE_H
+#include "emulator.h"
+
+#define TRANSLATE_MAX_BLOCK 64			  // Instructions of a translated block
+#define TRANSLATE_CODE_SIZE (16 << 20) // Bytes of host code, the cache is flushed when it runs full
+
+// Runs the program like emulator_run, with the same results and statistics, by translating it to x86-64
+// code one basic block at a time. A block runs from where execution enters it up to and including a
+// branch, or up to a call, jmp, ret or halt, which are left to emulator_step together with the calls
+// they make outside of the program. Blocks are kept in a cache by their first code address, and a branch
+// at the end of a block is patched to jump straight to the block it goes to once that is translated, so
+// loops run without going back to the dispatcher. Every block adds its counts to the statistics when it
+// is entered and checks the limit first, so the run stops at exactly the same instruction. On other hosts
+// this is emulator_run.
+bool translate_run(EmulatorProgram *program, CycleTable *table, long long limit, EmulatorStatistics *statistics);
+
+#endif // !TRANSLATE_H
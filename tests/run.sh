@@ -0,0 +1,22 @@
+#!/bin/sh
+# Compiles every tests/*.txt at each optimization level, runs it in the emulator and compares the calls
+# it makes with tests/*.expected. sinkN takes N arguments, the registers past them are left out. Options
+# in tests/*.flags are passed along with the optimization level.
+# Usage: tests/run.sh path/to/LangCompiler
+compiler=$1
+dir=$(dirname "$0")
+failed=0
+for source in "$dir"/*.txt; do
+	expected=${source%.txt}.expected
+	flags=$(cat "${source%.txt}.flags" 2>/dev/null)
+	for level in -O0 -O1 -O2 -Os; do
+		actual=$("$compiler" "$source" $level $flags --run 2>&1 >/dev/null | grep '^Call to' |
+			sed -E 's/^(Call to sink1 with r1=[0-9]+).*/\1/; s/^(Call to sink2 with r1=[0-9]+ r2=[0-9]+).*/\1/')
+		if [ "$actual" != "$(cat "$expected")" ]; then
+			echo "FAIL $source $level"
+			failed=1
+		fi
+	done
+done
+[ $failed = 0 ] && echo "All tests passed"
+exit $failed